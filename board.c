@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -67,7 +68,11 @@ board_init(char *fbookfile)
 int
 board_cmp(struct board *b1, struct board *b2)
 {
-	return memcmp(b1, b2, sizeof(struct board));
+	/* Local history past history_len is garbage. */
+	int r = memcmp(b1, b2, offsetof(struct board, history_local));
+	if (r)
+		return r;
+	return memcmp(b1->history_local, b2->history_local, b1->history_len * sizeof(hash_t));
 }
 
 int
@@ -102,6 +107,8 @@ board_quick_cmp(struct board *b1, struct board *b2)
 		fprintf(stderr, "differs in n\n");  return 1;  }
 	if (memcmp(b1->p,  b2->p,  sizeof(b1->p))) {
 		fprintf(stderr, "differs in p\n");  return 1;  }
+	if (memcmp(b1->bb, b2->bb, sizeof(b1->bb))) {
+		fprintf(stderr, "differs in bb\n");  return 1;  }
 	if (memcmp(b1->gi, b2->gi, sizeof(b1->gi))) {
 		fprintf(stderr, "differs in gi\n");  return 1;  }
 
@@ -112,20 +119,125 @@ board_quick_cmp(struct board *b1, struct board *b2)
 struct board *
 board_copy(struct board *b2, struct board *b1)
 {
-	memcpy(b2, b1, sizeof(struct board));
+	memcpy(b2, b1, offsetof(struct board, history_local));
+	memcpy(b2->history_local, b1->history_local, b1->history_len * sizeof(hash_t));
 
 	// XXX: Special semantics.
 	b2->fbook = NULL;
 	b2->ps = NULL;
+	if (b2->history)
+		__sync_fetch_and_add(&b2->history->refs, 1);
 
 	return b2;
 }
 
+static struct board_history *
+board_history_new(int bits)
+{
+	struct board_history *h = calloc2(1, sizeof(*h) + (sizeof(hash_t) << bits));
+	h->refs = 1;
+	h->bits = bits;
+	return h;
+}
+
+static void
+board_history_release(struct board_history *h)
+{
+	if (h && !__sync_sub_and_fetch(&h->refs, 1))
+		free(h);
+}
+
+static void
+board_history_put(struct board_history *h, hash_t hash)
+{
+	hash_t mask = (1 << h->bits) - 1;
+	hash_t i = hash;
+	while (h->hash[i & mask])
+		i++;
+	h->hash[i & mask] = hash;
+	h->len++;
+}
+
+void
+board_history_add(struct board *b, hash_t hash)
+{
+	struct board_history *h = b->history;
+	int len = h->len + b->history_len + 1;
+
+	/* Rebuild if shared, to fold in the local positions, or half full. */
+	if (h->refs > 1 || b->history_len || len * 2 > 1 << h->bits) {
+		int bits = h->bits;
+		while (len * 2 > 1 << bits)
+			bits++;
+		struct board_history *h2 = board_history_new(bits);
+		for (int i = 0; i < 1 << h->bits; i++)
+			if (h->hash[i])
+				board_history_put(h2, h->hash[i]);
+		for (int i = 0; i < b->history_len; i++)
+			board_history_put(h2, b->history_local[i]);
+		board_history_release(h);
+
+		b->history = h = h2;
+		b->history_len = 0;
+		memset(b->history_filter, 0, sizeof(b->history_filter));
+	}
+	board_history_put(h, hash);
+}
+
+/* Restore the first n entries of array field f. */
+#define rollback_array(b_, src_, f_, n_)  memcpy((b_)->f_, (src_)->f_, (n_) * sizeof((b_)->f_[0]))
+/* Restore fields from f1 up to (not including) f2. */
+#define rollback_fields(b_, src_, f1_, f2_) \
+	memcpy(&(b_)->f1_, &(src_)->f1_, offsetof(struct board, f2_) - offsetof(struct board, f1_))
+
+void
+board_rollback(struct board *b, struct board *src)
+{
+	assert(b->size == src->size);
+	if (b->ps) free(b->ps);
+
+	/* Only the first size2 entries of the goban maps are ever written. */
+	int n = board_size2(src);
+	rollback_fields(b, src, size, b);
+	rollback_array(b, src, b, n);
+	rollback_array(b, src, g, n);
+	rollback_array(b, src, p, n);
+	rollback_array(b, src, n, n);
+	rollback_array(b, src, bb, S_MAX);
+#ifdef BOARD_PAT3
+	rollback_array(b, src, pat3, n);
+#endif
+	rollback_array(b, src, gi, n);
+	rollback_array(b, src, f, n);
+	rollback_array(b, src, fmap, n);
+	b->flen = src->flen;
+#ifdef WANT_BOARD_C
+	rollback_array(b, src, c, BOARD_MAX_GROUPS);
+	b->clen = src->clen;
+#endif
+	rollback_fields(b, src, last_ko, ps);
+	b->ps = NULL;
+
+	rollback_fields(b, src, handicap, history);
+	b->fbook = NULL;
+
+	/* Back to sharing src's history, unless we did not unshare it. */
+	if (b->history != src->history) {
+		board_history_release(b->history);
+		b->history = src->history;
+		__sync_fetch_and_add(&b->history->refs, 1);
+	}
+	rollback_fields(b, src, history_len, history_local);
+	rollback_array(b, src, history_local, src->history_len);
+}
+
 void
 board_done_noalloc(struct board *board)
 {
 	if (board->fbook) fbook_done(board->fbook);
 	if (board->ps) free(board->ps);
+	board_history_release(board->history);
+	board->history = NULL;
 }
 
 void
@@ -229,6 +341,10 @@ board_init_data(struct board *board)
 	for (i = 0; i <= top_row; i += board_size(board))
 		board->b[i] = board->b[board_size(board) - 1 + i] = S_OFFBOARD;
 
+	foreach_point(board) {
+		bitboard_add(&board->bb[board_at(board, c)], c);
+	} foreach_point_end;
+
 	foreach_point(board) {
 		coord_t coord = c;
 		if (board_at(board, coord) == S_OFFBOARD)
@@ -275,6 +391,7 @@ board_clear(struct board *board)
 	board->komi = komi;
 	board->fbookfile = fbookfile;
 	board->rules = rules;
+	board->history = board_history_new(10);
 
 	if (board->fbookfile)
 		board->fbook = fbook_init(board->fbookfile, board);
@@ -428,29 +545,47 @@ board_hash_update(struct board *board, coord_t coord, enum stone color)
 #endif
 }
 
+static inline bool
+board_history_seen(struct board *board, hash_t hash)
+{
+	struct board_history *h = board->history;
+	hash_t mask = (1 << h->bits) - 1;
+	for (hash_t i = hash; h->hash[i & mask]; i++)
+		if (h->hash[i & mask] == hash)
+			return true;
+
+	int f = (hash >> 32) & ((1 << BOARD_HISTORY_FILTER_BITS) - 1);
+	if (!(board->history_filter[f / 64] & (1ULL << (f % 64))))
+		return false;
+	for (int i = 0; i < board->history_len; i++)
+		if (board->history_local[i] == hash)
+			return true;
+	return false;
+}
+
 /* Commit current board hash to history. */
 static void profiling_noinline
 board_hash_commit(struct board *board)
 {
+	hash_t hash = board->hash;
 	if (DEBUGL(8))
-		fprintf(stderr, "board_hash_commit %"PRIhash"\n", board->hash);
-	if (likely(board->history_hash[board->hash & history_hash_mask]) == 0) {
-		board->history_hash[board->hash & history_hash_mask] = board->hash;
+		fprintf(stderr, "board_hash_commit %"PRIhash"\n", hash);
+	if (unlikely(board_history_seen(board, hash))) {
+		if (DEBUGL(5))
+			fprintf(stderr, "SUPERKO VIOLATION noted at %d,%d\n",
+				coord_x(board->last_move.coord, board), coord_y(board->last_move.coord, board));
+		board->superko_violation = true;
 		return;
 	}
 
-	hash_t i = board->hash;
-	while (board->history_hash[i & history_hash_mask]) {
-		if (board->history_hash[i & history_hash_mask] == board->hash) {
-			if (DEBUGL(5))
-				fprintf(stderr, "SUPERKO VIOLATION noted at %d,%d\n",
-					coord_x(board->last_move.coord, board), coord_y(board->last_move.coord, board));
-			board->superko_violation = true;
-			return;
-		}
-		i = history_hash_next(i);
+	/* Leave the history table alone while it is shared. */
+	if (likely(board->history->refs > 1 && board->history_len < BOARD_HISTORY_LOCAL)) {
+		int f = (hash >> 32) & ((1 << BOARD_HISTORY_FILTER_BITS) - 1);
+		board->history_filter[f / 64] |= 1ULL << (f % 64);
+		board->history_local[board->history_len++] = hash;
+		return;
 	}
-	board->history_hash[i & history_hash_mask] = board->hash;
+	board_history_add(board, hash);
 }
 
 
@@ -631,6 +766,9 @@ board_group_addlib(struct board *board, group_t group, coord_t coord, struct boa
 
 	struct group *gi = &board_group_info(board, group);
 	bool onestone = group_is_onestone(board, group);
+#ifdef BOARD_LIBSET
+	bitboard_add(&gi->libset, coord);
+#endif
 	if (gi->libs < GROUP_KEEP_LIBS) {
 		for (int i = 0; i < GROUP_KEEP_LIBS; i++) {
 #if 0
@@ -654,6 +792,20 @@ board_group_addlib(struct board *board, group_t group, coord_t coord, struct boa
 static void
 board_group_find_extra_libs(struct board *board, group_t group, struct group *gi, coord_t avoid)
 {
+#ifdef BOARD_LIBSET
+	/* Add extra liberty from the libset to our liberty list;
+	 * @avoid is gone from there already. */
+	foreach_bitboard(&gi->libset) {
+		bool have = false;
+		for (int i = 0; i < gi->libs; i++)
+			have |= (gi->lib[i] == c);
+		if (have)
+			continue;
+		gi->lib[gi->libs++] = c;
+		if (unlikely(gi->libs >= GROUP_KEEP_LIBS))
+			return;
+	} foreach_bitboard_end;
+#else
 	/* Add extra liberty from the board to our liberty list. */
 	unsigned char watermark[board_size2(board) / 8];
 	memset(watermark, 0, sizeof(watermark));
@@ -677,6 +829,7 @@ board_group_find_extra_libs(struct board *board, group_t group, struct group *gi
 	} foreach_in_group_end;
 #undef watermark_get
 #undef watermark_set
+#endif
 }
 
 static void
@@ -689,6 +842,9 @@ board_group_rmlib(struct board *board, group_t group, coord_t coord, struct boar
 
 	struct group *gi = &board_group_info(board, group);
 	bool onestone = group_is_onestone(board, group);
+#ifdef BOARD_LIBSET
+	bitboard_rm(&gi->libset, coord);
+#endif
 	for (int i = 0; i < GROUP_KEEP_LIBS; i++) {
 #if 0
 		/* Seems extra branch just slows it down */
@@ -729,6 +885,8 @@ board_remove_stone(struct board *board, group_t group, coord_t c, struct board_u
 {
 	enum stone color = board_at(board, c);
 	board_at(board, c) = S_NONE;
+	bitboard_rm(&board->bb[color], c);
+	bitboard_add(&board->bb[S_NONE], c);
 	group_at(board, c) = 0;
 	if (!u)
 		board_hash_update(board, c, color);
@@ -813,6 +971,10 @@ merge_groups(struct board *board, group_t group_to, group_t group_from, struct b
 	if (DEBUGL(7))
 		fprintf(stderr,"---- (froml %d, tol %d)\n", gi_from->libs, gi_to->libs);
 
+#ifdef BOARD_LIBSET
+	bitboard_or(&gi_to->libset, &gi_from->libset);
+#endif
+
 	if (gi_to->libs < GROUP_KEEP_LIBS) {
 		for (int i = 0; i < gi_from->libs; i++) {
 			for (int j = 0; j < gi_to->libs; j++)
@@ -870,12 +1032,16 @@ new_group(struct board *board, coord_t coord, struct board_undo *u)
 	group_t group = coord;
 	struct group *gi = &board_group_info(board, group);
 	foreach_neighbor(board, coord, {
-		if (board_at(board, c) == S_NONE)
+		if (board_at(board, c) == S_NONE) {
+#ifdef BOARD_LIBSET
+			bitboard_add(&gi->libset, c);
+#endif
 			/* board_group_addlib is ridiculously expensive for us */
 #if GROUP_KEEP_LIBS < 4
 			if (gi->libs < GROUP_KEEP_LIBS)
 #endif
 			gi->lib[gi->libs++] = c;
+		}
 	});
 
 	group_at(board, coord) = group;
@@ -1018,6 +1184,8 @@ board_play_outside(struct board *board, struct move *m, int f, struct board_undo
 	});
 
 	board_at(board, coord) = color;
+	bitboard_rm(&board->bb[S_NONE], coord);
+	bitboard_add(&board->bb[color], coord);
 	if (unlikely(!group))
 		group = new_group(board, coord, u);
 
@@ -1112,6 +1280,8 @@ board_play_in_eye(struct board *board, struct move *m, int f, struct board_undo
 	}
 
 	board_at(board, coord) = color;
+	bitboard_rm(&board->bb[S_NONE], coord);
+	bitboard_add(&board->bb[color], coord);
 	group_t group = new_group(board, coord, u);
 
 	if (!u) {
@@ -1279,6 +1449,8 @@ restore_enemies(struct board *b, struct board_undo *u, struct move *m)
 		coord_t *stones = enemy[i].stones;
 		for (int j = 0; stones[j]; j++) {
 			board_at(b, stones[j]) = other_color;
+			bitboard_rm(&b->bb[S_NONE], stones[j]);
+			bitboard_add(&b->bb[other_color], stones[j]);
 			group_at(b, stones[j]) = old_group;
 			groupnext_at(b, stones[j]) = stones[j + 1];
 
@@ -1317,6 +1489,8 @@ board_undo_stone(struct board *b, struct board_undo *u, struct move *m)
 		memset(&board_group_info(b, group_at(b, coord)), 0, sizeof(struct group));
 	
 	board_at(b, coord) = S_NONE;
+	bitboard_rm(&b->bb[color], coord);
+	bitboard_add(&b->bb[S_NONE], coord);
 	group_at(b, coord) = 0;
 	groupnext_at(b, coord) = u->next_at;
 	
@@ -1346,6 +1520,8 @@ restore_suicide(struct board *b, struct board_undo *u, struct move *m)
 		coord_t *stones = enemy[i].stones;
 		for (int j = 0; stones[j]; j++) {
 			board_at(b, stones[j]) = other_color;
+			bitboard_rm(&b->bb[S_NONE], stones[j]);
+			bitboard_add(&b->bb[other_color], stones[j]);
 			group_at(b, stones[j]) = old_group;
 			groupnext_at(b, stones[j]) = stones[j + 1];
 
@@ -1383,6 +1559,8 @@ board_undo_suicide(struct board *b, struct board_undo *u, struct move *m)
 	undo_merge(b, u, m);
 
 	board_at(b, coord) = S_NONE;
+	bitboard_rm(&b->bb[m->color], coord);
+	bitboard_add(&b->bb[S_NONE], coord);
 	group_at(b, coord) = 0;
 	groupnext_at(b, coord) = u->next_at;
 
@@ -1527,13 +1705,15 @@ board_fast_score(struct board *board)
 	int scores[S_MAX];
 	memset(scores, 0, sizeof(scores));
 
-	foreach_point(board) {
-		enum stone color = board_at(board, c);
-		if (color == S_NONE && board->rules != RULES_STONES_ONLY)
-			color = board_get_one_point_eye(board, c);
-		scores[color]++;
-		// fprintf(stderr, "%d, %d ++%d = %d\n", coord_x(c, board), coord_y(c, board), color, scores[color]);
-	} foreach_point_end;
+	scores[S_BLACK] = bitboard_count(&board->bb[S_BLACK]);
+	scores[S_WHITE] = bitboard_count(&board->bb[S_WHITE]);
+	if (board->rules != RULES_STONES_ONLY) {
+		struct bitboard eyes;
+		board_one_point_eyes(board, S_BLACK, &eyes);
+		scores[S_BLACK] += bitboard_count(&eyes);
+		board_one_point_eyes(board, S_WHITE, &eyes);
+		scores[S_WHITE] += bitboard_count(&eyes);
+	}
 
 	return board->komi + (board->rules != RULES_SIMING ? board->handicap : 0) + scores[S_WHITE] - scores[S_BLACK];
 }
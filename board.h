@@ -31,6 +31,8 @@ struct fbook;
 
 //#define BOARD_UNDO_CHECKS 1  // Guard against invalid quick_play() / quick_undo() uses
 
+//#define BOARD_LIBSET // exact liberty bitset for each group, see struct group
+
 #define BOARD_MAX_COORDS  ((BOARD_MAX_SIZE+2) * (BOARD_MAX_SIZE+2) )
 #define BOARD_MAX_MOVES (BOARD_MAX_SIZE * BOARD_MAX_SIZE)
 #define BOARD_MAX_GROUPS (BOARD_MAX_SIZE * BOARD_MAX_SIZE * 2 / 3)
@@ -73,6 +75,20 @@ typedef uint32_t hash3_t; // 3x3 pattern hash
  * connected for us. */
 typedef coord_t group_t;
 
+/* Storage types for the goban maps, to keep struct board compact.
+ * On-board coords always fit 16 bits, stones 8 bits; code outside
+ * the board implementation still works with coord_t / enum stone. */
+typedef uint16_t bcoord_t;
+typedef uint8_t stone_t;
+
+/* Set of coords, one bit each. The loops below are simple enough for
+ * the compiler to vectorize. No alignment attribute: boards come from
+ * malloc() and get memcpy()ed around. */
+#define BITBOARD_WORDS 8
+struct bitboard {
+	uint64_t w[BITBOARD_WORDS];
+};
+
 struct group {
 	/* We keep track of only up to GROUP_KEEP_LIBS; over that, we
 	 * don't care. */
@@ -82,17 +98,93 @@ struct group {
 	// refill lib[] only when we hit this; this must be at least 2!
 	// Moggy requires at least 3 - see below for semantic impact.
 #define GROUP_REFILL_LIBS 5
-	coord_t lib[GROUP_KEEP_LIBS];
+	bcoord_t lib[GROUP_KEEP_LIBS];
 	/* libs is only LOWER BOUND for the number of real liberties!!!
 	 * It denotes only number of items in lib[], thus you can rely
 	 * on it to store real liberties only up to <= GROUP_REFILL_LIBS. */
 	int libs;
+#ifdef BOARD_LIBSET
+	/* All the liberties, exact: lib[] is refilled from here and
+	 * bitboard_count() gives the real number of liberties. */
+	struct bitboard libset;
+#endif
 };
 
+static inline void
+bitboard_add(struct bitboard *s, coord_t c)
+{
+	s->w[c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline void
+bitboard_rm(struct bitboard *s, coord_t c)
+{
+	s->w[c >> 6] &= ~(1ULL << (c & 63));
+}
+
+static inline bool
+bitboard_has(struct bitboard *s, coord_t c)
+{
+	return s->w[c >> 6] & (1ULL << (c & 63));
+}
+
+static inline void
+bitboard_or(struct bitboard *s, struct bitboard *s2)
+{
+	for (int i = 0; i < BITBOARD_WORDS; i++)
+		s->w[i] |= s2->w[i];
+}
+
+static inline void
+bitboard_and(struct bitboard *s, struct bitboard *s2)
+{
+	for (int i = 0; i < BITBOARD_WORDS; i++)
+		s->w[i] &= s2->w[i];
+}
+
+/* @d = @s shifted by @n coords, towards higher coords if @n > 0.
+ * |n| must be below 64. */
+static inline void
+bitboard_shift(struct bitboard *d, struct bitboard *s, int n)
+{
+	if (n > 0) {
+		d->w[0] = s->w[0] << n;
+		for (int i = 1; i < BITBOARD_WORDS; i++)
+			d->w[i] = (s->w[i] << n) | (s->w[i - 1] >> (64 - n));
+	} else {
+		n = -n;
+		for (int i = 0; i < BITBOARD_WORDS - 1; i++)
+			d->w[i] = (s->w[i] >> n) | (s->w[i + 1] << (64 - n));
+		d->w[BITBOARD_WORDS - 1] = s->w[BITBOARD_WORDS - 1] >> n;
+	}
+}
+
+static inline int
+bitboard_count(struct bitboard *s)
+{
+	int n = 0;
+	for (int i = 0; i < BITBOARD_WORDS; i++)
+		n += __builtin_popcountll(s->w[i]);
+	return n;
+}
+
 struct neighbor_colors {
 	char colors[S_MAX];
 };
 
+/* Superko history: hashes of the positions seen so far, open addressing.
+ * Shared by a board and its copies, read-only while refs > 1. */
+struct board_history {
+	int refs;
+	int bits;   // 1 << bits slots
+	int len;
+	hash_t hash[];
+};
+
+/* Positions a board keeps to itself while its history is shared. */
+#define BOARD_HISTORY_LOCAL 1024
+#define BOARD_HISTORY_FILTER_BITS 12
+
 
 /* Quick hack to help ensure tactics code stays within quick board limitations.
  * Ideally we'd have two different types for boards and quick_boards. The idea
@@ -154,15 +246,15 @@ extern struct board_statics board_statics;
  * you want to change it. */
 
 struct board {
+	/* --- HOT PLAYOUT STATE ---
+	 * Everything a playout reads and writes lives here, goban maps in
+	 * compact storage types; keep cold data out of this part. */
+
 	int size; /* Including S_OFFBOARD margin - see below. */
 	int size2; /* size^2 */
 	int bits2; /* ceiling(log2(size2)) */
 	int captures[S_MAX];
 	floating_t komi;
-	int handicap;
-	enum go_ruleset rules;
-	char *fbookfile;
-	struct fbook *fbook;
 
 	int moves;
 	struct move last_move;
@@ -180,13 +272,16 @@ FB_ONLY(bool superko_violation);
 	 * you need to handle them yourselves, if you need to. */
 
 	/* Stones played on the board */
-	enum stone b[BOARD_MAX_COORDS];
+	stone_t b[BOARD_MAX_COORDS];
 	/* Group id the stones are part of; 0 == no group */
-	group_t g[BOARD_MAX_COORDS];
+	bcoord_t g[BOARD_MAX_COORDS];
 	/* Positions of next stones in the stone group; 0 == last stone */
-	coord_t p[BOARD_MAX_COORDS];
+	bcoord_t p[BOARD_MAX_COORDS];
 	/* Neighboring colors; numbers of neighbors of index color */
 	struct neighbor_colors n[BOARD_MAX_COORDS];
+	/* b[] as a bitboard per color, for whole-board scans; bb[S_NONE]
+	 * are the empty points, bb[S_OFFBOARD] the margin. */
+	struct bitboard bb[S_MAX];
 
 #ifdef BOARD_PAT3
 	/* 3x3 pattern code for each position; see pattern3.h for encoding
@@ -200,18 +295,15 @@ FB_ONLY(hash3_t pat3)[BOARD_MAX_COORDS];
 	/* List of free positions */
 	/* Note that free position here is any valid move; including single-point eyes!
 	 * However, pass is not included. */
-FB_ONLY(coord_t f)[BOARD_MAX_COORDS];  FB_ONLY(int flen);
+FB_ONLY(bcoord_t f)[BOARD_MAX_COORDS];  FB_ONLY(int flen);
 	/* Map free positions coords to their list index, for quick lookup. */
-FB_ONLY(int fmap)[BOARD_MAX_COORDS];
+FB_ONLY(bcoord_t fmap)[BOARD_MAX_COORDS];
 
 #ifdef WANT_BOARD_C
 	/* Queue of capturable groups */
-FB_ONLY(group_t c)[BOARD_MAX_GROUPS];  FB_ONLY(int clen);
+FB_ONLY(bcoord_t c)[BOARD_MAX_GROUPS];  FB_ONLY(int clen);
 #endif
 
-	/* Symmetry information */
-FB_ONLY(struct board_symmetry symmetry);
-
 	/* Last ko played on the board. */
 FB_ONLY(struct move last_ko);
 FB_ONLY(int last_ko_age);
@@ -223,31 +315,44 @@ FB_ONLY(int last_ko_age);
 	/* Guard against invalid quick_play() / quick_undo() uses */
 	int quicked;
 #endif
-	
-	/* Engine-specific state; persistent through board development,
-	 * is reset only at clear_board. */
-	void *es;
+
+	/* Hash of current board position. */
+FB_ONLY(hash_t hash);
+	/* Hash of current board position quadrants. */
+FB_ONLY(hash_t qhash)[4];
 
 	/* Playout-specific state; persistent through board development,
 	 * initialized by play_random_game() and free()'d at board destroy time */
 	void *ps;
 
 
+	/* --- GAME RECORD ---
+	 * Game-level state; playouts leave it alone. */
+
+	int handicap;
+	enum go_ruleset rules;
+	char *fbookfile;
+	struct fbook *fbook;
+
+	/* Symmetry information */
+FB_ONLY(struct board_symmetry symmetry);
+
+	/* Engine-specific state; persistent through board development,
+	 * is reset only at clear_board. */
+	void *es;
+
 	/* --- PRIVATE DATA --- */
 
 	/* For superko check: */
 
-	/* Board "history" - hashes encountered. Size of the hash should be
-	 * >> board_size^2. */
-#define history_hash_bits 12
-#define history_hash_mask ((1 << history_hash_bits) - 1)
-#define history_hash_prev(i) ((i - 1) & history_hash_mask)
-#define history_hash_next(i) ((i + 1) & history_hash_mask)
-FB_ONLY(hash_t history_hash)[1 << history_hash_bits];
-	/* Hash of current board position. */
-FB_ONLY(hash_t hash);
-	/* Hash of current board position quadrants. */
-FB_ONLY(hash_t qhash)[4];
+	/* Positions encountered, shared with our copies (copy-on-write). */
+FB_ONLY(struct board_history *history);
+	/* Positions since the last write to history, with a bit per
+	 * hash in history_filter to skip most scans. board_copy() only
+	 * copies the history_len entries in use. */
+FB_ONLY(int history_len);
+FB_ONLY(uint64_t history_filter)[(1 << BOARD_HISTORY_FILTER_BITS) / 64];
+FB_ONLY(hash_t history_local)[BOARD_HISTORY_LOCAL];
 };
 
 struct undo_merge {
@@ -340,7 +445,16 @@ struct board_undo {
 
 struct board *board_init(char *fbookfile);
 struct board *board_copy(struct board *board2, struct board *board1);
+/* Scratch board for many simulations: instead of a new board_copy() for
+ * each of them, board_rollback() makes @board a copy of @src. Both must
+ * have the same size and @board must come from board_copy(); @src may be
+ * any position, not just the one @board was copied from. Only the part of
+ * the goban in use is copied. */
+void board_rollback(struct board *board, struct board *src);
 void board_done_noalloc(struct board *board);
+/* Slow path of the superko check in board_play(): put @hash in a history
+ * table of our own, unsharing or growing it as needed. */
+void board_history_add(struct board *board, hash_t hash);
 void board_done(struct board *board);
 /* size here is without the S_OFFBOARD margin. */
 void board_resize(struct board *board, int size);
@@ -397,6 +511,8 @@ static bool board_coord_in_symmetry(struct board *b, coord_t c);
 
 /* Returns true if given coordinate has all neighbors of given color or the edge. */
 static bool board_is_eyelike(struct board *board, coord_t coord, enum stone eye_color);
+/* Bitboard of all the empty points that are board_is_eyelike(). */
+static void board_eyelike_points(struct board *b, enum stone eye_color, struct bitboard *eyes);
 /* Returns true if given coordinate could be a false eye; this check makes
  * sense only if you already know the coordinate is_eyelike(). */
 bool board_is_false_eyelike(struct board *board, coord_t coord, enum stone eye_color);
@@ -405,6 +521,8 @@ bool board_is_false_eyelike(struct board *board, coord_t coord, enum stone eye_c
 bool board_is_one_point_eye(struct board *board, coord_t c, enum stone eye_color);
 /* Returns color of a 1pt eye owner, S_NONE if not an eye. */
 enum stone board_get_one_point_eye(struct board *board, coord_t c);
+/* Bitboard of all the 1pt eyes of given color. */
+static void board_one_point_eyes(struct board *b, enum stone eye_color, struct bitboard *eyes);
 
 /* board_official_score() is the scoring method for yielding score suitable
  * for external presentation. For fast scoring of entirely filled boards
@@ -427,7 +545,7 @@ bool board_set_rules(struct board *board, char *name);
  *
  * Currently this means these can't be used:
  *   - incremental patterns (pat3)
- *   - hashes, superko_violation (spathash, hash, qhash, history_hash)
+ *   - hashes, superko_violation (spathash, hash, qhash, history)
  *   - list of free positions (f / flen)
  *   - list of capturable groups (c / clen)
  *   - traits (btraits, t, tq, tqlen)
@@ -510,6 +628,18 @@ void board_quick_undo(struct board *b, struct move *m, struct board_undo *u);
 		} while (c != 0); \
 	} while (0)
 
+/* Coords in a bitboard, in increasing order. break only leaves the
+ * current word, use goto / return to stop early. */
+#define foreach_bitboard(set_) \
+	do { \
+		struct bitboard *set__ = (set_); \
+		for (int w__ = 0; w__ < BITBOARD_WORDS; w__++) \
+		for (uint64_t bits__ = set__->w[w__]; bits__; bits__ &= bits__ - 1) { \
+			coord_t c = w__ * 64 + __builtin_ctzll(bits__);
+#define foreach_bitboard_end \
+		} \
+	} while (0)
+
 /* NOT VALID inside of foreach_point() or another foreach_neighbor(), or rather
  * on S_OFFBOARD coordinates. */
 #define foreach_neighbor(board_, coord_, loop_body) \
@@ -551,6 +681,29 @@ board_is_eyelike(struct board *board, coord_t coord, enum stone eye_color)
 	        + neighbor_count_at(board, coord, S_OFFBOARD)) == 4;
 }
 
+static inline void
+board_eyelike_points(struct board *b, enum stone eye_color, struct bitboard *eyes)
+{
+	/* Empty points with a wall on each side */
+	struct bitboard wall = b->bb[eye_color], side;
+	bitboard_or(&wall, &b->bb[S_OFFBOARD]);
+	*eyes = b->bb[S_NONE];
+	bitboard_shift(&side, &wall, 1);               bitboard_and(eyes, &side);
+	bitboard_shift(&side, &wall, -1);              bitboard_and(eyes, &side);
+	bitboard_shift(&side, &wall, board_size(b));   bitboard_and(eyes, &side);
+	bitboard_shift(&side, &wall, -board_size(b));  bitboard_and(eyes, &side);
+}
+
+static inline void
+board_one_point_eyes(struct board *b, enum stone eye_color, struct bitboard *eyes)
+{
+	board_eyelike_points(b, eye_color, eyes);
+	foreach_bitboard(eyes) {
+		if (board_is_false_eyelike(b, c, eye_color))
+			bitboard_rm(eyes, c);
+	} foreach_bitboard_end;
+}
+
 /* Group suicides allowed */
 static inline bool
 board_is_valid_play(struct board *board, enum stone color, coord_t coord)
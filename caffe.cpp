@@ -48,22 +48,25 @@ caffe_init()
 
 
 void
-caffe_get_data(float *data, float *result, int planes, int size)
+caffe_get_data(float *data, float *result, int n, int planes, int size)
 {
-	Blob<float> *blob = new Blob<float>(1, planes, size, size);
-	blob->set_cpu_data(data);
-	vector<Blob<float>*> bottom;
-	bottom.push_back(blob);
 	assert(net);
-	const vector<Blob<float>*>& rr = net->Forward(bottom);
+	/* Feed the net input blob directly, reshaping the net
+	 * only when the batch size changes. */
+	Blob<float> *input = net->input_blobs()[0];
+	if (input->num() != n || input->channels() != planes) {
+		input->Reshape(n, planes, size, size);
+		net->Reshape();
+	}
+	memcpy(input->mutable_cpu_data(), data, n * planes * size * size * sizeof(float));
+	const vector<Blob<float>*>& rr = net->Forward();
 	
-	for (int i = 0; i < 19 * 19; i++) {
-		result[i] = rr[0]->cpu_data()[i];
+	const float *r = rr[0]->cpu_data();
+	for (int i = 0; i < n * size * size; i++) {
+		result[i] = r[i];
 		if (result[i] < 0.00001)
 			result[i] = 0.00001;
 	}
-	
-	delete blob;	
 }
 
 	
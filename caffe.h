@@ -2,6 +2,9 @@
 #ifndef PACHI_CAFFE_H
 #define PACHI_CAFFE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -9,7 +12,23 @@ extern "C" {
 
 bool caffe_ready();
 void caffe_init();
-void caffe_get_data(float *data, float *result, int planes, int size);
+/* Evaluate n positions at once, data and result hold n of them back to back. */
+void caffe_get_data(float *data, float *result, int n, int planes, int size);
+
+#ifdef DCNN_BUILTIN
+/* Weights precision of the builtin backend (cnn.c), set before caffe_init(). */
+enum dcnn_weights {
+	DCNN_WEIGHTS_FLOAT,
+	DCNN_WEIGHTS_FP16,
+	DCNN_WEIGHTS_INT8,
+};
+extern enum dcnn_weights dcnn_weights;
+
+/* Set up the builtin backend with net description net (prototxt text)
+ * and weights (golast.trained format) instead of the dcnn files.
+ * Returns false if the net is not supported. */
+bool cnn_init(char *net, uint8_t *weights, size_t len);
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,738 @@
+/* Builtin CPU backend for the dcnn, an alternative to caffe.cpp with
+ * no dependencies (make DCNN=1 DCNN_BUILTIN=1). It reads the Caffe net
+ * description (golast19.prototxt) and weights (golast.trained) itself
+ * and runs the forward pass with direct convolutions: activations are
+ * kept channels-last in a zero-bordered 19x19 grid so that each output
+ * point is a plain sum over the kernel window, computed for 8 output
+ * channels at a time with AVX2, without im2col.
+ *
+ * Supported layers: Convolution (stride 1), ReLU, Bias, Softmax, and
+ * Flatten / Reshape / Dropout / Input which are no-ops here. Layers
+ * must form a chain, convolutions first, the last one with a single
+ * output channel.
+ *
+ * Weights can be kept as fp16 or int8 (per output channel scale) to
+ * save memory bandwidth, see dcnn_weights. */
+
+#define DEBUG
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#include "debug.h"
+#include "util.h"
+#include "caffe.h"
+
+enum dcnn_weights dcnn_weights = DCNN_WEIGHTS_FLOAT;
+
+#define CNN_SIZE 19
+#define CNN_POINTS (CNN_SIZE * CNN_SIZE)
+/* Activations grid: zero border of CNN_PAD_MAX points, channels padded
+ * to CNN_CHANNELS_MAX for every point so that the border stays put. */
+#define CNN_PAD_MAX 3
+#define CNN_GRID (CNN_SIZE + 2 * CNN_PAD_MAX)
+#define CNN_CHANNELS_MAX 512
+
+enum cnn_layer_type { CNN_CONV, CNN_RELU, CNN_BIAS, CNN_SOFTMAX };
+
+struct cnn_layer {
+	enum cnn_layer_type type;
+	char name[64];
+	/* Convolution */
+	int cin, cout, cout8, k, pad;
+	bool relu;       // followed by a ReLU, done in place
+	enum dcnn_weights wtype;
+	void *w;         // [k * k][cin][cout8]
+	float *scale;    // [cout8], int8 dequantization (1 otherwise)
+	float *bias;     // [cout8] for convolutions, [nbias] for Bias layers
+	int nbias;
+};
+
+static struct cnn_layer *layers;
+static int nlayers;
+static int input_planes;
+static bool ready;
+
+
+/**************************************************************************************************/
+/* Net description: text protobuf. */
+
+struct pt_node {
+	char *key, *value;   // value is NULL for messages
+	struct pt_node *child, *next;
+};
+
+static char *
+pt_token(char **s)
+{
+	while (1) {
+		while (**s && strchr(" \t\r\n", **s))  (*s)++;
+		if (**s != '#')  break;
+		while (**s && **s != '\n')  (*s)++;
+	}
+	if (!**s)  return NULL;
+	char *start = *s;
+	if (strchr("{}:", **s)) {
+		(*s)++;
+	} else if (**s == '"') {
+		start = ++(*s);
+		while (**s && **s != '"')  (*s)++;
+	} else {
+		while (**s && !strchr(" \t\r\n{}:#\"", **s))  (*s)++;
+	}
+	/* Keep the delimiter around for the caller. */
+	static char tok[256];
+	int len = *s - start;
+	if (len >= (int)sizeof(tok))  len = sizeof(tok) - 1;
+	memcpy(tok, start, len);  tok[len] = 0;
+	if (**s == '"')  (*s)++;
+	return tok;
+}
+
+/* Parse fields until '}' or end of input. */
+static struct pt_node *
+pt_parse(char **s)
+{
+	struct pt_node *first = NULL, **last = &first;
+	char *tok;
+	while ((tok = pt_token(s)) && strcmp(tok, "}")) {
+		struct pt_node *n = calloc2(1, sizeof(*n));
+		n->key = strdup(tok);
+		tok = pt_token(s);
+		if (tok && !strcmp(tok, ":"))
+			tok = pt_token(s);
+		if (!tok)
+			die("cnn: truncated net description\n");
+		if (!strcmp(tok, "{"))
+			n->child = pt_parse(s);
+		else
+			n->value = strdup(tok);
+		*last = n;  last = &n->next;
+	}
+	return first;
+}
+
+static void
+pt_free(struct pt_node *n)
+{
+	while (n) {
+		struct pt_node *next = n->next;
+		pt_free(n->child);
+		free(n->key);  free(n->value);  free(n);
+		n = next;
+	}
+}
+
+static struct pt_node *
+pt_find(struct pt_node *n, const char *key)
+{
+	for (; n; n = n->next)
+		if (!strcmp(n->key, key))
+			return n;
+	return NULL;
+}
+
+static int
+pt_int(struct pt_node *n, const char *key, int def)
+{
+	n = pt_find(n, key);
+	return n && n->value ? atoi(n->value) : def;
+}
+
+static const char *
+pt_str(struct pt_node *n, const char *key)
+{
+	n = pt_find(n, key);
+	return n && n->value ? n->value : "";
+}
+
+
+/**************************************************************************************************/
+/* Weights: binary protobuf (NetParameter). */
+
+struct pb_blob {
+	float *data;
+	size_t count;
+};
+
+struct pb_layer {
+	char name[64];
+	struct pb_blob blobs[2];
+	int nblobs;
+};
+
+static bool
+pb_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	*v = 0;
+	for (int shift = 0; *p < end && shift < 64; shift += 7) {
+		uint8_t b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+	return false;
+}
+
+/* Next field of the message in [*p, end). Length delimited fields
+ * are returned in val / len, others in num. */
+static bool
+pb_field(const uint8_t **p, const uint8_t *end, int *field, const uint8_t **val, size_t *len, uint64_t *num)
+{
+	uint64_t tag;
+	if (*p >= end || !pb_varint(p, end, &tag))
+		return false;
+	*field = tag >> 3;
+	*val = NULL;  *len = 0;  *num = 0;
+	switch (tag & 7) {
+		case 0:
+			return pb_varint(p, end, num);
+		case 1:
+			if (end - *p < 8)  return false;
+			*val = *p;  *len = 8;  *p += 8;
+			return true;
+		case 2:
+			if (!pb_varint(p, end, num) || *num > (uint64_t)(end - *p))
+				return false;
+			*val = *p;  *len = *num;  *p += *len;
+			return true;
+		case 5:
+			if (end - *p < 4)  return false;
+			*val = *p;  *len = 4;  *p += 4;
+			return true;
+	}
+	return false;
+}
+
+/* BlobProto: data is field 5 (float, packed or not) or 8 (double). */
+static bool
+pb_blob(const uint8_t *p, const uint8_t *end, struct pb_blob *blob)
+{
+	int field;  const uint8_t *val;  size_t len;  uint64_t num;
+	size_t alloc = 0;
+	memset(blob, 0, sizeof(*blob));
+	while (pb_field(&p, end, &field, &val, &len, &num)) {
+		int size = field == 5 ? 4 : 8;
+		if ((field != 5 && field != 8) || !val || len % size)
+			continue;
+		if (blob->count + len / size > alloc) {
+			alloc = (blob->count + len / size) * 2;
+			blob->data = realloc(blob->data, alloc * sizeof(float));
+			if (!blob->data)  die("cnn: out of memory\n");
+		}
+		for (size_t i = 0; i < len; i += size) {
+			float f;  double d;
+			if (size == 4)  memcpy(&f, val + i, 4);
+			else  { memcpy(&d, val + i, 8);  f = d; }
+			blob->data[blob->count++] = f;
+		}
+	}
+	return p == end;
+}
+
+static int
+pb_layers(const uint8_t *p, const uint8_t *end, struct pb_layer **layersp)
+{
+	int field;  const uint8_t *val;  size_t len;  uint64_t num;
+	struct pb_layer *l = NULL;
+	int n = 0;
+	while (pb_field(&p, end, &field, &val, &len, &num)) {
+		/* LayerParameter (100): name 1, blobs 7.
+		 * Old V1LayerParameter (2): name 4, blobs 6. */
+		if (field != 100 && field != 2)
+			continue;
+		int name_field = field == 100 ? 1 : 4, blobs_field = field == 100 ? 7 : 6;
+		l = realloc(l, (n + 1) * sizeof(*l));
+		struct pb_layer *pl = &l[n++];
+		memset(pl, 0, sizeof(*pl));
+		const uint8_t *q = val, *qend = val + len;
+		int f;  const uint8_t *v;  size_t vlen;  uint64_t vnum;
+		while (pb_field(&q, qend, &f, &v, &vlen, &vnum)) {
+			if (f == name_field && v) {
+				size_t nlen = vlen < sizeof(pl->name) - 1 ? vlen : sizeof(pl->name) - 1;
+				memcpy(pl->name, v, nlen);
+			} else if (f == blobs_field && v && pl->nblobs < 2) {
+				if (!pb_blob(v, v + vlen, &pl->blobs[pl->nblobs]))
+					die("cnn: cannot read weights of layer %s\n", pl->name);
+				pl->nblobs++;
+			}
+		}
+	}
+	*layersp = l;
+	return n;
+}
+
+static void
+pb_layers_free(struct pb_layer *l, int n)
+{
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < l[i].nblobs; j++)
+			free(l[i].blobs[j].data);
+	free(l);
+}
+
+
+/**************************************************************************************************/
+/* Weights storage */
+
+static uint16_t
+float_to_half(float f)
+{
+	uint32_t x;  memcpy(&x, &f, sizeof(x));
+	uint32_t sign = (x >> 16) & 0x8000;
+	int exp = ((x >> 23) & 0xff) - 127 + 15;
+	uint32_t mant = x & 0x7fffff;
+	if (exp <= 0) {  /* subnormal or zero */
+		if (exp < -10)  return sign;
+		mant |= 0x800000;
+		uint32_t h = mant >> (14 - exp);
+		if ((mant >> (13 - exp)) & 1)  h++;
+		return sign | h;
+	}
+	if (exp >= 31)  return sign | 0x7c00;
+	uint32_t h = sign | (exp << 10) | (mant >> 13);
+	if (mant & 0x1000)  h++;   /* round, may carry into the exponent */
+	return h;
+}
+
+static float
+half_to_float(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	int exp = (h >> 10) & 0x1f;
+	uint32_t mant = h & 0x3ff;
+	float f;
+	if (!exp)
+		f = ldexpf(mant, -24);
+	else if (exp == 31)
+		f = mant ? NAN : INFINITY;
+	else
+		f = ldexpf(mant | 0x400, exp - 25);
+	uint32_t x;  memcpy(&x, &f, sizeof(x));
+	x |= sign;  memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+/* Store conv weights from Caffe's [cout][cin][k][k] in our
+ * [k * k][cin][cout8] layout and the layer's weight type. */
+static void
+cnn_conv_weights(struct cnn_layer *l, struct pb_blob *wb)
+{
+	size_t n = (size_t)l->k * l->k * l->cin * l->cout8;
+	float *w = calloc2(n, sizeof(float));
+	for (int co = 0; co < l->cout; co++)
+		for (int ci = 0; ci < l->cin; ci++)
+			for (int kk = 0; kk < l->k * l->k; kk++)
+				w[((size_t)kk * l->cin + ci) * l->cout8 + co] =
+					wb->data[((size_t)co * l->cin + ci) * l->k * l->k + kk];
+
+	l->scale = malloc2(l->cout8 * sizeof(float));
+	for (int co = 0; co < l->cout8; co++)
+		l->scale[co] = 1;
+
+	l->wtype = dcnn_weights;
+	if (l->wtype == DCNN_WEIGHTS_FLOAT) {
+		l->w = w;
+		return;
+	}
+	if (l->wtype == DCNN_WEIGHTS_FP16) {
+		uint16_t *w16 = malloc2(n * sizeof(*w16));
+		for (size_t i = 0; i < n; i++)
+			w16[i] = float_to_half(w[i]);
+		l->w = w16;
+	} else {
+		/* Symmetric, one scale per output channel. */
+		for (int co = 0; co < l->cout; co++) {
+			float max = 0;
+			for (size_t i = co; i < n; i += l->cout8)
+				max = fmaxf(max, fabsf(w[i]));
+			l->scale[co] = max > 0 ? max / 127 : 1;
+		}
+		int8_t *w8 = malloc2(n);
+		for (size_t i = 0; i < n; i++)
+			w8[i] = lrintf(w[i] / l->scale[i % l->cout8]);
+		l->w = w8;
+	}
+	free(w);
+}
+
+
+/**************************************************************************************************/
+/* Forward pass */
+
+/* Input and output points of the grid, (x, y) in 0..CNN_SIZE-1 */
+#define grid_at(a, x, y)  ((a) + ((size_t)((y) + CNN_PAD_MAX) * CNN_GRID + (x) + CNN_PAD_MAX) * CNN_CHANNELS_MAX)
+
+/* Activations grids, one pair per thread so that several threads can
+ * evaluate at once. Allocated on first use, freed with the thread. */
+#define CNN_GRID_FLOATS ((size_t)CNN_GRID * CNN_GRID * CNN_CHANNELS_MAX)
+
+static pthread_key_t grid_key;
+static pthread_once_t grid_once = PTHREAD_ONCE_INIT;
+
+static void
+grid_key_init(void)
+{
+	pthread_key_create(&grid_key, free);
+}
+
+static float *
+cnn_grids(void)
+{
+	pthread_once(&grid_once, grid_key_init);
+	float *g = pthread_getspecific(grid_key);
+	if (!g) {
+		g = calloc2(2 * CNN_GRID_FLOATS, sizeof(float));
+		pthread_setspecific(grid_key, g);
+	}
+	return g;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+#define CNN_LOAD_FLOAT(w, i)  _mm256_loadu_ps((const float *)(w) + (i))
+#ifdef __F16C__
+#define CNN_LOAD_FP16(w, i)   _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)((const uint16_t *)(w) + (i))))
+#endif
+#define CNN_LOAD_INT8(w, i)   _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)((const int8_t *)(w) + (i)))))
+
+/* Output channels co0 .. co0 + 8 * NB - 1 at point (x, y). */
+#define CNN_CONV_POINT(NB, LOAD) { \
+	__m256 acc[NB]; \
+	for (int j = 0; j < NB; j++)  acc[j] = _mm256_setzero_ps(); \
+	const float *in = grid_at(src, x - l->pad, y - l->pad); \
+	for (int ky = 0; ky < l->k; ky++) \
+		for (int kx = 0; kx < l->k; kx++) { \
+			const float *ip = in + ((size_t)ky * CNN_GRID + kx) * CNN_CHANNELS_MAX; \
+			size_t wi = ((size_t)(ky * l->k + kx) * l->cin) * l->cout8 + co0; \
+			for (int ci = 0; ci < l->cin; ci++, wi += l->cout8) { \
+				__m256 b = _mm256_broadcast_ss(&ip[ci]); \
+				for (int j = 0; j < NB; j++) \
+					acc[j] = _mm256_fmadd_ps(LOAD(l->w, wi + 8 * j), b, acc[j]); \
+			} \
+		} \
+	float *out = grid_at(dst, x, y) + co0; \
+	for (int j = 0; j < NB; j++) { \
+		__m256 v = _mm256_fmadd_ps(acc[j], _mm256_loadu_ps(l->scale + co0 + 8 * j), \
+					   _mm256_loadu_ps(l->bias + co0 + 8 * j)); \
+		if (l->relu)  v = _mm256_max_ps(v, _mm256_setzero_ps()); \
+		_mm256_storeu_ps(out + 8 * j, v); \
+	} \
+}
+
+/* 4 blocks of 8 output channels at once share the input loads. */
+#define CNN_CONV_KERNEL(name, LOAD) \
+static void \
+name(const struct cnn_layer *l, const float *src, float *dst) \
+{ \
+	for (int y = 0; y < CNN_SIZE; y++) \
+		for (int x = 0; x < CNN_SIZE; x++) { \
+			int co0 = 0; \
+			for (; co0 + 32 <= l->cout8; co0 += 32) \
+				CNN_CONV_POINT(4, LOAD); \
+			for (; co0 < l->cout8; co0 += 8) \
+				CNN_CONV_POINT(1, LOAD); \
+		} \
+}
+
+CNN_CONV_KERNEL(cnn_conv_float, CNN_LOAD_FLOAT)
+#ifdef __F16C__
+CNN_CONV_KERNEL(cnn_conv_fp16, CNN_LOAD_FP16)
+#endif
+CNN_CONV_KERNEL(cnn_conv_int8, CNN_LOAD_INT8)
+
+#endif /* __AVX2__ && __FMA__ */
+
+static inline float
+cnn_weight(const struct cnn_layer *l, size_t i)
+{
+	switch (l->wtype) {
+		case DCNN_WEIGHTS_FP16: return half_to_float(((uint16_t *)l->w)[i]);
+		case DCNN_WEIGHTS_INT8: return ((int8_t *)l->w)[i];
+		default: return ((float *)l->w)[i];
+	}
+}
+
+static void
+cnn_conv_generic(const struct cnn_layer *l, const float *src, float *dst)
+{
+	float acc[CNN_CHANNELS_MAX];
+	for (int y = 0; y < CNN_SIZE; y++)
+		for (int x = 0; x < CNN_SIZE; x++) {
+			for (int co = 0; co < l->cout8; co++)
+				acc[co] = 0;
+			const float *in = grid_at(src, x - l->pad, y - l->pad);
+			for (int ky = 0; ky < l->k; ky++)
+				for (int kx = 0; kx < l->k; kx++) {
+					const float *ip = in + ((size_t)ky * CNN_GRID + kx) * CNN_CHANNELS_MAX;
+					size_t wi = ((size_t)(ky * l->k + kx) * l->cin) * l->cout8;
+					for (int ci = 0; ci < l->cin; ci++, wi += l->cout8)
+						for (int co = 0; co < l->cout8; co++)
+							acc[co] += cnn_weight(l, wi + co) * ip[ci];
+				}
+			float *out = grid_at(dst, x, y);
+			for (int co = 0; co < l->cout8; co++) {
+				float v = acc[co] * l->scale[co] + l->bias[co];
+				out[co] = l->relu && v < 0 ? 0 : v;
+			}
+		}
+}
+
+static void
+cnn_conv(const struct cnn_layer *l, const float *src, float *dst)
+{
+#if defined(__AVX2__) && defined(__FMA__)
+	switch (l->wtype) {
+		case DCNN_WEIGHTS_FLOAT: cnn_conv_float(l, src, dst); return;
+#ifdef __F16C__
+		case DCNN_WEIGHTS_FP16: cnn_conv_fp16(l, src, dst); return;
+#endif
+		case DCNN_WEIGHTS_INT8: cnn_conv_int8(l, src, dst); return;
+		default: break;
+	}
+#endif
+	cnn_conv_generic(l, src, dst);
+}
+
+/* Evaluate one position: data is [input_planes][19][19],
+ * result gets the CNN_POINTS outputs. */
+static void
+cnn_forward(float *data, float *result)
+{
+	float *src = cnn_grids(), *dst = src + CNN_GRID_FLOATS;
+	for (int c = 0; c < input_planes; c++)
+		for (int p = 0; p < CNN_POINTS; p++)
+			grid_at(src, p % CNN_SIZE, p / CNN_SIZE)[c] = data[c * CNN_POINTS + p];
+
+	int i = 0;
+	for (; i < nlayers && layers[i].type == CNN_CONV; i++) {
+		cnn_conv(&layers[i], src, dst);
+		float *t = src;  src = dst;  dst = t;
+	}
+
+	/* Flatten, the last convolution has a single channel. */
+	int n = CNN_POINTS;
+	float out[CNN_POINTS];
+	for (int p = 0; p < CNN_POINTS; p++)
+		out[p] = grid_at(src, p % CNN_SIZE, p / CNN_SIZE)[0];
+
+	for (; i < nlayers; i++) {
+		struct cnn_layer *l = &layers[i];
+		if (l->type == CNN_RELU) {
+			for (int j = 0; j < n; j++)
+				out[j] = out[j] < 0 ? 0 : out[j];
+		} else if (l->type == CNN_BIAS) {
+			for (int j = 0; j < n; j++)
+				out[j] += l->bias[j % l->nbias];
+		} else if (l->type == CNN_SOFTMAX) {
+			float max = out[0], sum = 0;
+			for (int j = 1; j < n; j++)  max = fmaxf(max, out[j]);
+			for (int j = 0; j < n; j++)  sum += (out[j] = expf(out[j] - max));
+			for (int j = 0; j < n; j++)  out[j] /= sum;
+		}
+	}
+	memcpy(result, out, CNN_POINTS * sizeof(float));
+}
+
+
+/**************************************************************************************************/
+/* caffe.h interface */
+
+static char *
+read_file(const char *name, size_t *len)
+{
+	FILE *f = fopen(name, "rb");
+	if (!f)  return NULL;
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *buf = malloc2(*len + 1);
+	if (fread(buf, 1, *len, f) != *len)
+		die("cnn: cannot read %s\n", name);
+	buf[*len] = 0;
+	fclose(f);
+	return buf;
+}
+
+/* Build the layers from net description and weights.
+ * Returns false (with a message) if the net is not supported. */
+static bool
+cnn_load(struct pt_node *net, struct pb_layer *pbl, int npbl)
+{
+	input_planes = 0;
+	struct pt_node *shape = pt_find(net, "input_shape");
+	struct pt_node *dim = shape ? pt_find(shape->child, "dim") : pt_find(net, "input_dim");
+	if (dim && (dim = pt_find(dim->next, dim->key)))   /* second dim is channels */
+		input_planes = atoi(dim->value);
+
+	for (struct pt_node *n = net; n; n = n->next) {
+		if (strcmp(n->key, "layer") && strcmp(n->key, "layers"))
+			continue;
+		const char *type = pt_str(n->child, "type"), *name = pt_str(n->child, "name");
+		if (!strcasecmp(type, "Input") || !strcasecmp(type, "Data")) {
+			struct pt_node *p = pt_find(n->child, "input_param");
+			struct pt_node *d = p && (p = pt_find(p->child, "shape")) ? pt_find(p->child, "dim") : NULL;
+			if (d && (d = pt_find(d->next, "dim")))
+				input_planes = atoi(d->value);
+			continue;
+		}
+		if (!strcasecmp(type, "Flatten") || !strcasecmp(type, "Reshape") || !strcasecmp(type, "Dropout"))
+			continue;
+
+		layers = realloc(layers, (nlayers + 1) * sizeof(*layers));
+		struct cnn_layer *l = &layers[nlayers++];
+		memset(l, 0, sizeof(*l));
+		snprintf(l->name, sizeof(l->name), "%s", name);
+		struct pb_layer *w = NULL;
+		for (int i = 0; i < npbl; i++)
+			if (!strcmp(pbl[i].name, name))
+				w = &pbl[i];
+
+		if (!strcasecmp(type, "Convolution")) {
+			struct pt_node *cp = pt_find(n->child, "convolution_param");
+			cp = cp ? cp->child : NULL;
+			l->type = CNN_CONV;
+			l->cin = nlayers > 1 ? layers[nlayers - 2].cout : input_planes;
+			l->cout = pt_int(cp, "num_output", 0);
+			l->cout8 = (l->cout + 7) & ~7;
+			l->k = pt_int(cp, "kernel_size", 1);
+			l->pad = pt_int(cp, "pad", 0);
+			bool bias = strcasecmp(pt_str(cp, "bias_term"), "false");
+			if (nlayers > 1 && layers[nlayers - 2].type != CNN_CONV) {
+				fprintf(stderr, "cnn: %s: convolutions must come first\n", name);  return false;
+			}
+			if (pt_int(cp, "stride", 1) != 1 || 2 * l->pad != l->k - 1 || l->pad > CNN_PAD_MAX) {
+				fprintf(stderr, "cnn: %s: only 'same' convolutions up to %dx%d\n", name, 2 * CNN_PAD_MAX + 1, 2 * CNN_PAD_MAX + 1);  return false;
+			}
+			if (l->cin <= 0 || l->cout <= 0 || l->cin > CNN_CHANNELS_MAX || l->cout8 > CNN_CHANNELS_MAX) {
+				fprintf(stderr, "cnn: %s: bad channel count\n", name);  return false;
+			}
+			if (!w || w->nblobs < 1 + bias || w->blobs[0].count != (size_t)l->cout * l->cin * l->k * l->k
+			    || (bias && w->blobs[1].count != (size_t)l->cout)) {
+				fprintf(stderr, "cnn: %s: missing or mismatched weights\n", name);  return false;
+			}
+			cnn_conv_weights(l, &w->blobs[0]);
+			l->bias = calloc2(l->cout8, sizeof(float));
+			for (int co = 0; bias && co < l->cout; co++)
+				l->bias[co] = w->blobs[1].data[co];
+		} else if (!strcasecmp(type, "ReLU")) {
+			struct cnn_layer *prev = nlayers > 1 ? &layers[nlayers - 2] : NULL;
+			if (prev && prev->type == CNN_CONV && !prev->relu) {
+				prev->relu = true;
+				nlayers--;
+			} else
+				l->type = CNN_RELU;
+		} else if (!strcasecmp(type, "Bias")) {
+			if (!w || w->nblobs < 1) {
+				fprintf(stderr, "cnn: %s: missing weights\n", name);  return false;
+			}
+			l->type = CNN_BIAS;
+			l->nbias = w->blobs[0].count;
+			l->bias = malloc2(l->nbias * sizeof(float));
+			for (int i = 0; i < l->nbias; i++)
+				l->bias[i] = w->blobs[0].data[i];
+		} else if (!strcasecmp(type, "Softmax")) {
+			l->type = CNN_SOFTMAX;
+		} else {
+			fprintf(stderr, "cnn: %s: unsupported layer type %s\n", name, type);
+			return false;
+		}
+	}
+	if (!nlayers || layers[0].type != CNN_CONV) {
+		fprintf(stderr, "cnn: no convolutions\n");
+		return false;
+	}
+	int last = 0;
+	while (last + 1 < nlayers && layers[last + 1].type == CNN_CONV)
+		last++;
+	if (layers[last].cout != 1) {
+		fprintf(stderr, "cnn: %s: the last convolution must have a single output\n", layers[last].name);
+		return false;
+	}
+	return true;
+}
+
+static void
+cnn_free(void)
+{
+	for (int i = 0; i < nlayers; i++) {
+		free(layers[i].w);  free(layers[i].scale);  free(layers[i].bias);
+	}
+	free(layers);
+	layers = NULL;  nlayers = 0;
+	ready = false;
+}
+
+bool
+cnn_init(char *net_text, uint8_t *weights, size_t len)
+{
+	cnn_free();
+	char *s = net_text;
+	struct pt_node *net = pt_parse(&s);
+	struct pb_layer *pbl;
+	int npbl = pb_layers(weights, weights + len, &pbl);
+	ready = cnn_load(net, pbl, npbl);
+	pb_layers_free(pbl, npbl);
+	pt_free(net);
+	return ready;
+}
+
+bool
+caffe_ready()
+{
+	return ready;
+}
+
+void
+caffe_init()
+{
+	if (ready)  return;
+
+	char model_file[256];    get_data_file(model_file, "golast19.prototxt");
+	char trained_file[256];  get_data_file(trained_file, "golast.trained");
+	if (!file_exists(model_file) || !file_exists(trained_file)) {
+		if (DEBUGL(1))  fprintf(stderr, "No dcnn files found, will not use dcnn code.\n");
+		return;
+	}
+
+	size_t len, wlen;
+	char *text = read_file(model_file, &len);
+	uint8_t *weights = (uint8_t *) read_file(trained_file, &wlen);
+	cnn_init(text, weights, wlen);
+	free(weights);  free(text);
+	if (!ready) {
+		fprintf(stderr, "Cannot use dcnn net %s.\n", model_file);
+		return;
+	}
+
+	if (DEBUGL(1)) {
+		static const char *wstr[] = { "float", "fp16", "int8" };
+		fprintf(stderr, "Loaded Detlef's 54%% dcnn (builtin, %d layers, %s weights%s).\n", nlayers,
+			wstr[dcnn_weights],
+#if defined(__AVX2__) && defined(__FMA__)
+			", avx2"
+#else
+			""
+#endif
+			);
+	}
+}
+
+void
+caffe_get_data(float *data, float *result, int n, int planes, int size)
+{
+	assert(ready && planes == input_planes && size == CNN_SIZE);
+	for (int i = 0; i < n; i++) {
+		cnn_forward(data + i * planes * CNN_POINTS, result + i * CNN_POINTS);
+		for (int p = 0; p < CNN_POINTS; p++)
+			if (result[i * CNN_POINTS + p] < 0.00001)
+				result[i * CNN_POINTS + p] = 0.00001;
+	}
+}
@@ -1,19 +1,27 @@
 #define DEBUG
 #include <assert.h>
+#include <pthread.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "debug.h"
 #include "board.h"
 #include "engine.h"
 #include "uct/tree.h"
+#include "uct/profile.h"
 #include "caffe.h"
 #include "dcnn.h"
 #include "timeinfo.h"
 
-/* Time spent in dcnn code */
+/* Time spent in dcnn code, and cache stats */
 double dcnn_time = 0;
+static int cache_hits, cache_misses;
 double get_dcnn_time()  {  return dcnn_time;  }
-void reset_dcnn_time()  {  dcnn_time = 0;  }
+void reset_dcnn_time()  {  dcnn_time = 0;  cache_hits = cache_misses = 0;  }
+void get_dcnn_cache_stats(int *hits, int *misses)  {  *hits = cache_hits;  *misses = cache_misses;  }
+
+/* The net is shared by the evaluator thread and synchronous callers. */
+static pthread_mutex_t caffe_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 bool
 using_dcnn(struct board *b)
@@ -31,21 +39,21 @@ dcnn_init()
 void
 dcnn_quiet_caffe(int argc, char *argv[])
 {
+#ifndef DCNN_BUILTIN    /* No glog to silence otherwise */
 	if (DEBUGL(7) || getenv("GLOG_minloglevel"))
 		return;
 	
 	setenv("GLOG_minloglevel", "2", 1);
 	execvp(argv[0], argv);   /* Sucks that we have to do this */
+#endif
 }
 
 void
-dcnn_get_moves(struct board *b, enum stone color, float result[])
+dcnn_board_data(struct board *b, enum stone color, float *data)
 {
-	double time_start = time_now();
 	assert(real_board_size(b) == 19);
 
-	int dsize = 13 * 19 * 19;
-	float *data = malloc(dsize * sizeof(float));
+	int dsize = DCNN_PLANES * 19 * 19;
 	for (int i = 0; i < dsize; i++)  /* memset() not recommended for floats */
 		data[i] = 0;
 
@@ -74,11 +82,141 @@ dcnn_get_moves(struct board *b, enum stone color, float result[])
 		else if (c == b->last_move4.coord)
 			data[12*19*19 + p] = 1.0;
 	}
+}
+
+
+/* Cache of dcnn results, least recently used entries get replaced.
+ * Keys cover everything the net sees: stones (board hash), the last
+ * moves and the color to play. A position is also found if one of
+ * its 8 symmetric images is in the cache. Entries are few enough
+ * that scanning them is nothing next to a net evaluation. */
+
+#define DCNN_CACHE_SIZE 1024
+
+struct dcnn_cache_entry {
+	hash_t key;
+	unsigned long stamp;   /* last use, 0 if free */
+	float result[19 * 19];
+};
+
+static struct dcnn_cache_entry *cache;
+static unsigned long cache_clock;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Index of point p under symmetry sym: bit 2 transposes,
+ * bits 0 and 1 flip horizontally and vertically. */
+static int
+dcnn_sym_idx(int p, int sym)
+{
+	int x = p % 19, y = p / 19;
+	if (sym & 4) {  int t = x;  x = y;  y = t;  }
+	if (sym & 1)  x = 18 - x;
+	if (sym & 2)  y = 18 - y;
+	return y * 19 + x;
+}
+
+static coord_t
+dcnn_sym_coord(struct board *b, coord_t c, int sym)
+{
+	int p = dcnn_sym_idx(coord2dcnn_idx(c, b), sym);
+	return coord_xy(b, p % 19 + 1, p / 19 + 1);
+}
+
+/* Cache key of the image of the position under sym. */
+static hash_t
+dcnn_cache_key(struct board *b, enum stone color, int sym)
+{
+	hash_t key = 0;
+	if (!sym)
+		key = b->hash;
+	else
+		foreach_point(b) {
+			enum stone s = board_at(b, c);
+			if (s == S_BLACK || s == S_WHITE)
+				key ^= hash_at(b, dcnn_sym_coord(b, c, sym), s);
+		} foreach_point_end;
+
+	coord_t last[4] = { b->last_move.coord, b->last_move2.coord, b->last_move3.coord, b->last_move4.coord };
+	for (int i = 0; i < 4; i++)
+		if (!is_pass(last[i]) && !is_resign(last[i]))
+			key ^= hash_at(b, dcnn_sym_coord(b, last[i], sym), S_BLACK) * (2 * i + 3);
+	if (color == S_WHITE)
+		key = ~key;
+	return key;
+}
+
+static struct dcnn_cache_entry *
+dcnn_cache_find(hash_t key)
+{
+	for (int i = 0; i < DCNN_CACHE_SIZE; i++)
+		if (cache[i].stamp && cache[i].key == key)
+			return &cache[i];
+	return NULL;
+}
+
+/* Look up position on board b, filling result[] on hit. Returns
+ * the key to store the result with on miss. */
+static bool
+dcnn_cache_get(struct board *b, enum stone color, float result[], hash_t *key)
+{
+	pthread_mutex_lock(&cache_mutex);
+	if (!cache)
+		cache = calloc2(DCNN_CACHE_SIZE, sizeof(*cache));
+	*key = dcnn_cache_key(b, color, 0);
+	struct dcnn_cache_entry *e = dcnn_cache_find(*key);
+	int sym = 0;
+	for (int s = 1; !e && s < 8; s++)
+		if ((e = dcnn_cache_find(dcnn_cache_key(b, color, s))))
+			sym = s;
+	if (!e) {
+		cache_misses++;
+		pthread_mutex_unlock(&cache_mutex);
+		return false;
+	}
+	e->stamp = ++cache_clock;
+	/* e holds the image of our position under sym. */
+	for (int p = 0; p < 19 * 19; p++)
+		result[p] = e->result[dcnn_sym_idx(p, sym)];
+	cache_hits++;
+	pthread_mutex_unlock(&cache_mutex);
+	return true;
+}
+
+static void
+dcnn_cache_put(hash_t key, float result[])
+{
+	pthread_mutex_lock(&cache_mutex);
+	struct dcnn_cache_entry *e = dcnn_cache_find(key);
+	if (!e) {
+		e = &cache[0];
+		for (int i = 1; i < DCNN_CACHE_SIZE; i++)
+			if (cache[i].stamp < e->stamp)
+				e = &cache[i];
+	}
+	e->key = key;
+	e->stamp = ++cache_clock;
+	memcpy(e->result, result, sizeof(e->result));
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+void
+dcnn_get_moves(struct board *b, enum stone color, float result[])
+{
+	double time_start = time_now();
+	hash_t key;
+	bool cached = dcnn_cache_get(b, color, result, &key);
+	if (!cached) {
+		float *data = malloc(DCNN_PLANES * 19 * 19 * sizeof(float));
+		dcnn_board_data(b, color, data);
 
-	caffe_get_data(data, result, 13, 19);
-	free(data);
+		pthread_mutex_lock(&caffe_mutex);
+		caffe_get_data(data, result, 1, DCNN_PLANES, 19);
+		pthread_mutex_unlock(&caffe_mutex);
+		free(data);
+		dcnn_cache_put(key, result);
+	}
 	double elapsed = time_now() - time_start;
-	if (DEBUGL(2))  fprintf(stderr, "dcnn in %.2fs\n", elapsed);
+	if (DEBUGL(2))  fprintf(stderr, "dcnn in %.2fs%s\n", elapsed, cached ? " (cached)" : "");
 	dcnn_time += elapsed;
 }
 
@@ -108,3 +246,134 @@ print_dcnn_best_moves(struct board *b, coord_t *best_c, float *best_r, int nbest
 		fprintf(stderr, "%-3i ", (int)(best_r[i] * 100));
 	fprintf(stderr, "]\n");
 }
+
+
+/* Asynchronous evaluation. Requests wait in a ring buffer until the
+ * evaluator thread takes them, as many as are queued up to dcnn_batch,
+ * and runs them through the net in one call: while a batch is being
+ * evaluated the next one builds up. */
+
+#define DCNN_QUEUE_MAX 64
+
+struct dcnn_request {
+	float data[DCNN_PLANES * 19 * 19];
+	hash_t key;
+	dcnn_done_t done;
+	void *ctx;
+};
+
+static struct dcnn_request *queue;
+static int queue_head, queue_len;
+static bool evaluating;
+static int dcnn_batch;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;   /* queue not empty */
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;    /* batch done */
+static pthread_t evaluator;
+
+/* Stats since last dcnn_async_flush() */
+static int async_positions, async_batches, async_dropped;
+
+static void *
+dcnn_evaluator(void *unused)
+{
+	float *data = malloc2(dcnn_batch * DCNN_PLANES * 19 * 19 * sizeof(float));
+	float *result = malloc2(dcnn_batch * 19 * 19 * sizeof(float));
+	hash_t key[dcnn_batch];
+	dcnn_done_t done[dcnn_batch];
+	void *ctx[dcnn_batch];
+	uct_profile_thread(UCT_PROFILE_ASYNC_SLOT);
+
+	pthread_mutex_lock(&queue_mutex);
+	while (1) {
+		while (!queue_len)
+			pthread_cond_wait(&queue_cond, &queue_mutex);
+		int n = queue_len < dcnn_batch ? queue_len : dcnn_batch;
+		for (int i = 0; i < n; i++) {
+			struct dcnn_request *r = &queue[(queue_head + i) % DCNN_QUEUE_MAX];
+			memcpy(data + i * DCNN_PLANES * 19 * 19, r->data, sizeof(r->data));
+			key[i] = r->key;
+			done[i] = r->done;
+			ctx[i] = r->ctx;
+		}
+		queue_head = (queue_head + n) % DCNN_QUEUE_MAX;
+		queue_len -= n;
+		evaluating = true;
+		pthread_mutex_unlock(&queue_mutex);
+
+		pthread_mutex_lock(&caffe_mutex);
+		int prof = uct_profile_enter(UP_DCNN);
+		caffe_get_data(data, result, n, DCNN_PLANES, 19);
+		uct_profile_leave(prof);
+		pthread_mutex_unlock(&caffe_mutex);
+		for (int i = 0; i < n; i++) {
+			dcnn_cache_put(key[i], result + i * 19 * 19);
+			done[i](ctx[i], result + i * 19 * 19);
+		}
+
+		pthread_mutex_lock(&queue_mutex);
+		evaluating = false;
+		async_positions += n;
+		async_batches++;
+		pthread_cond_broadcast(&idle_cond);
+	}
+	return NULL;
+}
+
+void
+dcnn_async_start(int batch)
+{
+	if (queue)  return;
+	dcnn_batch = batch;
+	queue = malloc2(DCNN_QUEUE_MAX * sizeof(*queue));
+	pthread_create(&evaluator, NULL, dcnn_evaluator, NULL);
+}
+
+bool
+dcnn_async_submit(struct board *b, enum stone color, dcnn_done_t done, void *ctx)
+{
+	assert(queue);
+	float result[19 * 19];
+	hash_t key;
+	if (dcnn_cache_get(b, color, result, &key)) {
+		done(ctx, result);
+		return true;
+	}
+
+	pthread_mutex_lock(&queue_mutex);
+	if (queue_len == DCNN_QUEUE_MAX) {
+		pthread_mutex_unlock(&queue_mutex);
+		return false;
+	}
+	/* Fill in the slot under the lock so that the evaluator
+	 * cannot take it half written. Encoding is cheap. */
+	struct dcnn_request *r = &queue[(queue_head + queue_len) % DCNN_QUEUE_MAX];
+	dcnn_board_data(b, color, r->data);
+	r->key = key;
+	r->done = done;
+	r->ctx = ctx;
+	queue_len++;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+	return true;
+}
+
+void
+dcnn_async_flush()
+{
+	if (!queue)  return;
+	pthread_mutex_lock(&queue_mutex);
+	for (; queue_len; queue_len--, queue_head = (queue_head + 1) % DCNN_QUEUE_MAX) {
+		struct dcnn_request *r = &queue[queue_head];
+		r->done(r->ctx, NULL);
+		async_dropped++;
+	}
+	while (evaluating)
+		pthread_cond_wait(&idle_cond, &queue_mutex);
+
+	if (DEBUGL(2) && async_batches)
+		fprintf(stderr, "dcnn: %d positions in %d batches (%.1f avg), %d dropped\n",
+			async_positions, async_batches, (float)async_positions / async_batches, async_dropped);
+	async_positions = async_batches = async_dropped = 0;
+	pthread_mutex_unlock(&queue_mutex);
+}
@@ -5,17 +5,34 @@
 #ifdef DCNN
 
 #define DCNN_BEST_N 20
+#define DCNN_PLANES 13
 
 void dcnn_get_moves(struct board *b, enum stone color, float result[]);
+/* Fill data[DCNN_PLANES * 19 * 19] with the net input for board b. */
+void dcnn_board_data(struct board *b, enum stone color, float *data);
 bool using_dcnn(struct board *b);
 void dcnn_quiet_caffe(int argc, char *argv[]);
 void dcnn_init();
 void find_dcnn_best_moves(struct board *b, float *r, coord_t *best_c, float *best_r, int nbest);
 void print_dcnn_best_moves(struct board *b, coord_t *best_c, float *best_r, int nbest);
 
-/* Time spent in dcnn code */
+/* Time spent in dcnn code, and result cache hits / misses */
 double get_dcnn_time();
 void reset_dcnn_time();
+void get_dcnn_cache_stats(int *hits, int *misses);
+
+/* Asynchronous evaluation by a dedicated thread, in batches of up to
+ * @batch positions per net evaluation. Once evaluated, done() is called
+ * from the evaluator thread with the same result[] as dcnn_get_moves(),
+ * or with NULL if the request was dropped by dcnn_async_flush().
+ * Cached positions get done() called right away by dcnn_async_submit(). */
+typedef void (*dcnn_done_t)(void *ctx, float result[]);
+void dcnn_async_start(int batch);
+/* Returns false if the queue is full. */
+bool dcnn_async_submit(struct board *b, enum stone color, dcnn_done_t done, void *ctx);
+/* Drop pending requests and wait for the current batch. No done()
+ * calls happen after this returns, until new requests are submitted. */
+void dcnn_async_flush();
 
 /* Convert board coord to dcnn data index */
 static inline int coord2dcnn_idx(coord_t c, struct board *b);
@@ -38,6 +55,9 @@ coord2dcnn_idx(coord_t c, struct board *b)
 #define dcnn_init()
 #define get_dcnn_time()    (0.)
 #define reset_dcnn_time()  do { } while(0)
+#define get_dcnn_cache_stats(hits, misses)  do { *(hits) = *(misses) = 0; } while(0)
+#define dcnn_async_start(batch)
+#define dcnn_async_flush()
 
 
 #endif
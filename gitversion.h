@@ -0,0 +1,2 @@
+#define GIT_BRANCH "master"
+#define GIT_HASH   "6f556a7"
@@ -15,6 +15,7 @@
 #include "gtp.h"
 #include "mq.h"
 #include "uct/uct.h"
+#include "uct/profile.h"
 #include "version.h"
 #include "timeinfo.h"
 #include "gogui.h"
@@ -581,6 +582,18 @@ cmd_pachi_result(struct board *board, struct engine *engine, struct time_info *t
 	return P_OK;
 }
 
+static enum parse_code
+cmd_pachi_profile(struct board *board, struct engine *engine, struct time_info *ti, gtp_t *gtp)
+{
+	/* Where the last search spent its time, see uct/profile.h */
+	struct uct_profile p;
+	if (uct_search_profile(&p))
+		gtp_reply(gtp, uct_profile_str(&p), NULL);
+	else
+		gtp_error(gtp, "no search profile", NULL);
+	return P_OK;
+}
+
 static enum parse_code
 cmd_pachi_tunit(struct board *board, struct engine *engine, struct time_info *ti, gtp_t *gtp)
 {
@@ -714,6 +727,7 @@ static gtp_command_t commands[] =
 	{ "pachi-dumptbook",        cmd_pachi_dumptbook },
 	{ "pachi-evaluate",         cmd_pachi_evaluate },
 	{ "pachi-result",           cmd_pachi_result },
+	{ "pachi-profile",          cmd_pachi_profile },
 
 	/* Short aliases */
 	{ "predict",                cmd_pachi_predict },
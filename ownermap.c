@@ -48,11 +48,16 @@ board_print_ownermap(struct board *b, FILE *f, struct board_ownermap *ownermap)
 void
 board_ownermap_fill(struct board_ownermap *ownermap, struct board *b)
 {
+	struct bitboard eyes[S_MAX];
+	board_one_point_eyes(b, S_BLACK, &eyes[S_BLACK]);
+	board_one_point_eyes(b, S_WHITE, &eyes[S_WHITE]);
+
 	ownermap->playouts++;
 	foreach_point(b) {
 		enum stone color = board_at(b, c);
 		if (color == S_NONE)
-			color = board_get_one_point_eye(b, c);
+			color = (bitboard_has(&eyes[S_WHITE], c) ? S_WHITE :
+				 bitboard_has(&eyes[S_BLACK], c) ? S_BLACK : S_NONE);
 		ownermap->map[c][color]++;
 	} foreach_point_end;
 }
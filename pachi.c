@@ -28,6 +28,7 @@
 #include "network.h"
 #include "uct/tree.h"
 #include "dcnn.h"
+#include "caffe.h"
 
 int debug_level = 3;
 bool debug_boardprint = true;
@@ -95,6 +96,9 @@ usage()
 		"  -s, --seed RANDOM_SEED            set random seed \n"
 		"  -t, --time TIME_SETTINGS          force basic time settings (override kgs/gtp time settings) \n"
 		"      --fuseki-time TIME_SETTINGS   specific time settings to use during fuseki \n"
+#ifdef DCNN_BUILTIN
+		"      --dcnn-weights TYPE           dcnn weights precision: float (default), fp16, int8 \n"
+#endif
 		"  -u, --unit-test FILE              run unit tests \n"
 		"  -v, --version                     show version \n"
 		" \n"
@@ -116,9 +120,13 @@ usage()
 		" \n");
 }
 
-#define OPT_FUSEKI_TIME 256
+#define OPT_FUSEKI_TIME  256
+#define OPT_DCNN_WEIGHTS 257
 static struct option longopts[] = {
 	{ "fuseki-time", required_argument, 0, OPT_FUSEKI_TIME },
+#ifdef DCNN_BUILTIN
+	{ "dcnn-weights", required_argument, 0, OPT_DCNN_WEIGHTS },
+#endif
 	{ "chatfile",    required_argument, 0, 'c' },
 	{ "debug-level", required_argument, 0, 'd' },
 	{ "engine",      required_argument, 0, 'e' },
@@ -213,6 +221,14 @@ int main(int argc, char *argv[])
 				ti_fuseki.ignore_gtp = true;
 				assert(ti_fuseki.period != TT_NULL);
 				break;
+#ifdef DCNN_BUILTIN
+			case OPT_DCNN_WEIGHTS:
+				if      (!strcasecmp(optarg, "float"))	dcnn_weights = DCNN_WEIGHTS_FLOAT;
+				else if (!strcasecmp(optarg, "fp16"))	dcnn_weights = DCNN_WEIGHTS_FP16;
+				else if (!strcasecmp(optarg, "int8"))	dcnn_weights = DCNN_WEIGHTS_INT8;
+				else die("%s: Invalid --dcnn-weights argument %s\n", argv[0], optarg);
+				break;
+#endif
 			case 'u':
 				testfile = strdup(optarg);
 				break;
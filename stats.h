@@ -4,15 +4,28 @@
 #include <math.h>
 
 /* Move statistics; we track how good value each move has. */
-/* These operations are supposed to be atomic - reasonably
- * safe to perform by multiple threads at once on the same stats.
- * What this means in practice is that perhaps the value will get
- * slightly wrong, but not drastically corrupted. */
+/* These operations are supposed to be atomic - safe to perform by
+ * multiple threads at once on the same stats. With single precision
+ * floating_t, value and playouts fit in 64 bits and are updated
+ * together with a single compare-and-swap, so concurrent updates
+ * are exact and stats_get() returns a consistent snapshot.
+ * With DOUBLE_FLOATING we fall back to separate stores, and perhaps
+ * the value will get slightly wrong, but not drastically corrupted. */
+
+#ifndef DOUBLE_FLOATING
+#define STATS_ATOMIC
+#define STATS_ALIGN __attribute__((aligned(8)))
+#else
+#define STATS_ALIGN
+#endif
 
 struct move_stats {
 	floating_t value; // BLACK wins/playouts
 	int playouts; // # of playouts
-};
+} STATS_ALIGN;
+
+/* Consistent copy of stats other threads may be updating. */
+static struct move_stats stats_get(const struct move_stats *s);
 
 /* Add a result to the stats. */
 static void stats_add_result(struct move_stats *s, floating_t result, int playouts);
@@ -20,6 +33,12 @@ static void stats_add_result(struct move_stats *s, floating_t result, int playou
 /* Remove a result from the stats. */
 static void stats_rm_result(struct move_stats *s, floating_t result, int playouts);
 
+/* Divide the playouts count by @div, keeping the value. */
+static void stats_scale_playouts(struct move_stats *s, floating_t div);
+
+/* Count @playouts more without changing the value. */
+static void stats_add_playouts(struct move_stats *s, int playouts);
+
 /* Merge two stats together. THIS IS NOT ATOMIC! */
 static void stats_merge(struct move_stats *dest, struct move_stats *src);
 
@@ -27,6 +46,64 @@ static void stats_merge(struct move_stats *dest, struct move_stats *src);
 static void stats_reverse_parity(struct move_stats *s);
 
 
+#ifdef STATS_ATOMIC
+
+static inline struct move_stats
+stats_get(const struct move_stats *s)
+{
+	struct move_stats r;
+	__atomic_load(s, &r, __ATOMIC_RELAXED);
+	return r;
+}
+
+static inline void
+stats_add_result(struct move_stats *s, floating_t result, int playouts)
+{
+	struct move_stats old = stats_get(s), new;
+	do {
+		new.playouts = old.playouts + playouts;
+		new.value = old.value + (result - old.value) * playouts / new.playouts;
+	} while (!__atomic_compare_exchange(s, &old, &new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void
+stats_rm_result(struct move_stats *s, floating_t result, int playouts)
+{
+	struct move_stats old = stats_get(s), new;
+	do {
+		if (old.playouts > playouts) {
+			new.playouts = old.playouts - playouts;
+			new.value = old.value + (old.value - result) * playouts / new.playouts;
+		} else {
+			/* Leave the value as is with zero playouts. */
+			new.playouts = 0;
+			new.value = old.value;
+		}
+	} while (!__atomic_compare_exchange(s, &old, &new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void
+stats_scale_playouts(struct move_stats *s, floating_t div)
+{
+	struct move_stats old = stats_get(s), new;
+	do {
+		new.playouts = old.playouts / div;
+		new.value = old.value;
+	} while (!__atomic_compare_exchange(s, &old, &new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void
+stats_add_playouts(struct move_stats *s, int playouts)
+{
+	struct move_stats old = stats_get(s), new;
+	do {
+		new.playouts = old.playouts + playouts;
+		new.value = old.value;
+	} while (!__atomic_compare_exchange(s, &old, &new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+#else
+
 /* We actually do the atomicity in a pretty hackish way - we simply
  * rely on the fact that int,floating_t operations should be atomic with
  * reasonable compilers (gcc) on reasonable architectures (i386,
@@ -36,6 +113,12 @@ static void stats_reverse_parity(struct move_stats *s);
  * invalid evaluation if that's made in parallel, esp. when
  * current s->playouts is zero. */
 
+static inline struct move_stats
+stats_get(const struct move_stats *s)
+{
+	return *s;
+}
+
 static inline void
 stats_add_result(struct move_stats *s, floating_t result, int playouts)
 {
@@ -82,6 +165,20 @@ stats_rm_result(struct move_stats *s, floating_t result, int playouts)
 	}
 }
 
+static inline void
+stats_scale_playouts(struct move_stats *s, floating_t div)
+{
+	s->playouts /= div;
+}
+
+static inline void
+stats_add_playouts(struct move_stats *s, int playouts)
+{
+	__sync_fetch_and_add(&s->playouts, playouts);
+}
+
+#endif
+
 static inline void
 stats_merge(struct move_stats *dest, struct move_stats *src)
 {
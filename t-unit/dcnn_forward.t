@@ -0,0 +1,25 @@
+% Builtin dcnn backend forward pass with fixed weights
+% (skipped unless built with DCNN_BUILTIN=1)
+boardsize 19
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+. . . X . . . . . . . . . . . O . . .
+. . . . . . . . . . . . . . . . . . .
+. . O . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . X .
+. . . . . . . . . . . . . . . . . . .
+. . . O . . . . . . . . . . . X . . .
+. . . . . . . . . . . . . . . . . . .
+. . . . . . . . . . . . . . . . . . .
+X . . . . . . . . . . . . . . . . . O
+dcnn_forward
+dcnn_forward fp16
+dcnn_forward int8
@@ -1,5 +1,7 @@
 #define DEBUG
 #include <ctype.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +21,12 @@
 #include "playout/moggy.h"
 #include "engines/replay.h"
 #include "ownermap.h"
+#include "uct/internal.h"
+#include "uct/tree.h"
+#include "uct/uct.h"
+#ifdef DCNN_BUILTIN
+#include "caffe.h"
+#endif
 
 /* Running tests over gtp ? */
 static bool tunit_over_gtp = 1;
@@ -531,7 +539,240 @@ test_moggy_status(struct board *b, char *arg)
 	return ret;
 }
 
+bool ucb1rave_check_batch(struct uct_policy *p, struct tree *tree, struct tree_node *node, int parity);
+
+static void
+random_stats(struct move_stats *s, int max_playouts)
+{
+	s->value = (floating_t) fast_random(65536) / 65535;
+	/* Plenty of zero and small playouts. */
+	switch (fast_random(4)) {
+		case 0:  s->playouts = 0; break;
+		case 1:  s->playouts = fast_random(20); break;
+		default: s->playouts = fast_random(max_playouts);
+	}
+}
+
+/* Compare the batched (vectorized) urgencies of ucb1amaf with the scalar
+ * evaluation on random tree stats. Optional policy arguments.
+ *
+ * Syntax:  ucb1rave_batch [ucb1amaf args]
+ */
+static bool
+test_ucb1rave_batch(struct board *b, char *arg)
+{
+	int rounds = 200;
+	char e_arg[256];  snprintf(e_arg, sizeof(e_arg), "threads=4,policy=ucb1amaf%s%s", *arg ? ":" : "", arg);
+	struct engine *e = engine_uct_init(e_arg, b);
+	struct uct *u = e->data;
+	bool ret = true;
+
+	struct tree *t = tree_init(b, S_BLACK, 0, 0, 0, 1.0, 0, 0);
+	tree_expand_node(t, t->root, b, S_BLACK, u, 1);
+	for (int r = 0; r < rounds && ret; r++) {
+		random_stats(&node_u(t->root), 65536);
+		node_u(t->root).playouts += 1;
+		for (struct tree_node *ni = node_children(t->root); ni; ni = node_sibling(ni)) {
+			random_stats(&node_u(ni), 4000);
+			random_stats(&node_amaf(ni), 8000);
+			random_stats(&ni->prior, 40);
+			random_stats(&ni->winner_owner, 2);
+			random_stats(&ni->black_owner, 2);
+			ni->descents = fast_random(4);
+		}
+		int parity = r & 1 ? -1 : 1;
+		ret = ucb1rave_check_batch(u->policy, t, t->root, parity);
+	}
+	tree_done(t);
+	engine_done(e);
+
+	if (DEBUGL(1))
+		fprintf(stderr, "ucb1rave_batch %s: %s\n", arg, ret ? "OK" : "FAILED");
+	return ret;
+}
+
+#ifdef DCNN_BUILTIN
+
+#define TN_SIZE 19
+#define TN_POINTS (TN_SIZE * TN_SIZE)
+#define TN_PLANES 3
+#define TN_CHANNELS 40	/* One block of 32 output channels and one of 8 */
+
+static char test_net[] =
+	"input: \"data\"\n"
+	"input_dim: 1  input_dim: 3  input_dim: 19  input_dim: 19\n"
+	"layer { name: \"conv1\" type: \"Convolution\" convolution_param { num_output: 40 kernel_size: 3 pad: 1 } }\n"
+	"layer { name: \"relu1\" type: \"ReLU\" }\n"
+	"layer { name: \"conv2\" type: \"Convolution\" convolution_param { num_output: 1 kernel_size: 1 bias_term: false } }\n"
+	"layer { name: \"flat\" type: \"Flatten\" }\n"
+	"layer { name: \"bias\" type: \"Bias\" }\n"
+	"layer { name: \"softmax\" type: \"Softmax\" }\n";
+
+/* Fixed weights, Caffe layout. Multiples of 1/32 so that fp16 is exact. */
+static float tn_w1[TN_CHANNELS * TN_PLANES * 9], tn_b1[TN_CHANNELS], tn_w2[TN_CHANNELS], tn_bias[TN_POINTS];
+
+static void
+test_net_weights(void)
+{
+	for (int i = 0; i < TN_CHANNELS * TN_PLANES * 9; i++)  tn_w1[i] = ((i * 37) % 17 - 8) / 32.0;
+	for (int i = 0; i < TN_CHANNELS; i++)  tn_b1[i] = (i % 5 - 2) / 8.0;
+	for (int i = 0; i < TN_CHANNELS; i++)  tn_w2[i] = ((i * 11) % 7 - 3) / 8.0;
+	for (int i = 0; i < TN_POINTS; i++)  tn_bias[i] = (i % 9 - 4) / 16.0;
+}
+
+static void
+pb_put_varint(uint8_t **p, uint64_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*(*p)++ = v | 0x80;
+	*(*p)++ = v;
+}
+
+static void
+pb_put_bytes(uint8_t **p, int field, const void *data, size_t len)
+{
+	pb_put_varint(p, field << 3 | 2);
+	pb_put_varint(p, len);
+	memcpy(*p, data, len);  *p += len;
+}
+
+/* LayerParameter (field 100 of NetParameter): name 1, blobs 7 with
+ * packed float data 5. */
+static void
+pb_put_layer(uint8_t **p, const char *name, float *blob1, int n1, float *blob2, int n2)
+{
+	uint8_t *layer = malloc((n1 + n2) * 4 + 256), *l = layer;
+	uint8_t *blob = malloc((n1 > n2 ? n1 : n2) * 4 + 16), *b;
+	pb_put_bytes(&l, 1, name, strlen(name));
+	b = blob;  pb_put_bytes(&b, 5, blob1, n1 * 4);  pb_put_bytes(&l, 7, blob, b - blob);
+	if (blob2) {
+		b = blob;  pb_put_bytes(&b, 5, blob2, n2 * 4);  pb_put_bytes(&l, 7, blob, b - blob);
+	}
+	pb_put_bytes(p, 100, layer, l - layer);
+	free(blob);  free(layer);
+}
+
+/* Straightforward forward pass of the test net. */
+static void
+test_net_forward(float *in, float *out)
+{
+	static float h[TN_CHANNELS][TN_POINTS];
+	for (int co = 0; co < TN_CHANNELS; co++)
+		for (int y = 0; y < TN_SIZE; y++)
+			for (int x = 0; x < TN_SIZE; x++) {
+				float sum = tn_b1[co];
+				for (int ci = 0; ci < TN_PLANES; ci++)
+					for (int ky = 0; ky < 3; ky++)
+						for (int kx = 0; kx < 3; kx++) {
+							int iy = y + ky - 1, ix = x + kx - 1;
+							if (iy < 0 || iy >= TN_SIZE || ix < 0 || ix >= TN_SIZE)  continue;
+							sum += tn_w1[((co * TN_PLANES + ci) * 3 + ky) * 3 + kx] * in[ci * TN_POINTS + iy * TN_SIZE + ix];
+						}
+				h[co][y * TN_SIZE + x] = sum > 0 ? sum : 0;
+			}
+	float max = -INFINITY, sum = 0;
+	for (int p = 0; p < TN_POINTS; p++) {
+		out[p] = tn_bias[p];
+		for (int co = 0; co < TN_CHANNELS; co++)
+			out[p] += tn_w2[co] * h[co][p];
+		if (out[p] > max)  max = out[p];
+	}
+	for (int p = 0; p < TN_POINTS; p++)  sum += (out[p] = expf(out[p] - max));
+	for (int p = 0; p < TN_POINTS; p++) {
+		out[p] /= sum;
+		if (out[p] < 0.00001)  out[p] = 0.00001;
+	}
+}
+
+static float tn_input[2 * TN_PLANES * TN_POINTS];
+
+static void *
+test_net_thread(void *result)
+{
+	caffe_get_data(tn_input, result, 1, TN_PLANES, TN_SIZE);
+	return NULL;
+}
+
+#endif
+
+/* Forward pass of the builtin dcnn backend on a small net with fixed
+ * weights, against a straightforward implementation. Inputs are the
+ * stones of the test board. Two positions are evaluated at once, and
+ * the first one again in another thread.
+ *
+ * Syntax:  dcnn_forward [float|fp16|int8]
+ */
+static bool
+test_dcnn_forward(struct board *b, char *arg)
+{
+#ifdef DCNN_BUILTIN
+	if (board_size(b) - 2 != TN_SIZE)
+		die("dcnn_forward: needs a %dx%d board\n", TN_SIZE, TN_SIZE);
+	if (!*arg)  arg = "float";
+	enum dcnn_weights wtype = DCNN_WEIGHTS_FLOAT;
+	if (!strcmp(arg, "fp16"))  wtype = DCNN_WEIGHTS_FP16;
+	else if (!strcmp(arg, "int8"))  wtype = DCNN_WEIGHTS_INT8;
+	else if (strcmp(arg, "float"))  die("dcnn_forward: bad weights type '%s'\n", arg);
+	/* int8 rounds the weights, the others should agree to float precision. */
+	float tolerance = wtype == DCNN_WEIGHTS_INT8 ? 0.01 : 0.0001;
+
+	test_net_weights();
+	uint8_t *weights = malloc(sizeof(tn_w1) + sizeof(tn_b1) + sizeof(tn_w2) + sizeof(tn_bias) + 1024), *w = weights;
+	pb_put_layer(&w, "conv1", tn_w1, TN_CHANNELS * TN_PLANES * 9, tn_b1, TN_CHANNELS);
+	pb_put_layer(&w, "conv2", tn_w2, TN_CHANNELS, NULL, 0);
+	pb_put_layer(&w, "bias", tn_bias, TN_POINTS, NULL, 0);
+	enum dcnn_weights saved = dcnn_weights;
+	dcnn_weights = wtype;
+	char net[sizeof(test_net)];
+	memcpy(net, test_net, sizeof(net));
+	bool ok = cnn_init(net, weights, w - weights);
+	dcnn_weights = saved;
+	free(weights);
+	if (!ok) {
+		fprintf(stderr, "dcnn_forward %s: cannot set up the net FAILED\n", arg);
+		return false;
+	}
+
+	/* Second position: colors swapped, half the third plane. */
+	foreach_point(b) {
+		if (board_at(b, c) == S_OFFBOARD)  continue;
+		int p = (coord_y(c, b) - 1) * TN_SIZE + coord_x(c, b) - 1;
+		float *in1 = tn_input, *in2 = tn_input + TN_PLANES * TN_POINTS;
+		in1[p] = in2[TN_POINTS + p] = board_at(b, c) == S_BLACK;
+		in1[TN_POINTS + p] = in2[p] = board_at(b, c) == S_WHITE;
+		in1[2 * TN_POINTS + p] = 1;  in2[2 * TN_POINTS + p] = 0.5;
+	} foreach_point_end;
+
+	float result[3 * TN_POINTS], expected[2 * TN_POINTS];
+	caffe_get_data(tn_input, result, 2, TN_PLANES, TN_SIZE);
+	pthread_t thread;
+	pthread_create(&thread, NULL, test_net_thread, result + 2 * TN_POINTS);
+	pthread_join(thread, NULL);
+	test_net_forward(tn_input, expected);
+	test_net_forward(tn_input + TN_PLANES * TN_POINTS, expected + TN_POINTS);
+
+	float maxerr = 0;
+	for (int i = 0; i < 3 * TN_POINTS; i++) {
+		float e = expected[i % (2 * TN_POINTS)];
+		float err = fabsf(result[i] - e) / e;
+		if (err > maxerr)  maxerr = err;
+	}
+	bool ret = maxerr <= tolerance;
+	if (DEBUGL(1) || !ret)
+		fprintf(stderr, "dcnn_forward %s: max relative error %.2g %s\n", arg, maxerr, ret ? "OK" : "FAILED");
+	return ret;
+#else
+	if (DEBUGL(1))
+		fprintf(stderr, "dcnn_forward %s: no builtin dcnn, skipped\n", arg);
+	return true;
+#endif
+}
+
 bool board_undo_stress_test(struct board *orig, char *arg);
+bool board_rollback_test(struct board *orig, char *arg);
+bool test_tree_symmetry(struct board *b, char *arg);
+bool test_tree_gc(struct board *b, char *arg);
+bool test_tree_tbook(struct board *b, char *arg);
 
 typedef bool (*t_unit_func)(struct board *board, char *arg);
 
@@ -553,6 +794,12 @@ static t_unit_cmd commands[] = {
 	{ "moggy moves",            test_moggy_moves,       0 },
 	{ "moggy status",           test_moggy_status,      1 },
 	{ "board_undo_stress_test", board_undo_stress_test, 0 },
+	{ "board_rollback_test",    board_rollback_test,    0 },
+	{ "ucb1rave_batch",         test_ucb1rave_batch,    0 },
+	{ "dcnn_forward",           test_dcnn_forward,      0 },
+	{ "tree_symmetry",          test_tree_symmetry,     1 },
+	{ "tree_gc",                test_tree_gc,           0 },
+	{ "tree_tbook",             test_tree_tbook,        0 },
 	{ 0, 0, 0 }
 };
 
@@ -0,0 +1,326 @@
+#define DEBUG
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "debug.h"
+#include "engine.h"
+#include "move.h"
+#include "util.h"
+#include "uct/internal.h"
+#include "uct/tree.h"
+#include "uct/uct.h"
+#include "uct/walk.h"
+
+
+/* Expand node and its children down to depth plies below it. */
+static void
+tree_test_expand(struct tree *t, struct tree_node *node, struct board *b,
+		 enum stone color, struct uct *u, int parity, int depth)
+{
+	node->is_expanded = 1;
+	tree_expand_node(t, node, b, color, u, parity);
+	if (!depth)
+		return;
+
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni)) {
+		if (is_pass(node_coord(ni)))
+			continue;
+		struct board b2;
+		board_copy(&b2, b);
+		struct move m = { .coord = node_coord(ni), .color = color };
+		if (board_play(&b2, &m) >= 0)
+			tree_test_expand(t, ni, &b2, stone_other(color), u, -parity, depth - 1);
+		board_done_noalloc(&b2);
+	}
+}
+
+/* Check the coord index of every children block below node. */
+static bool
+tree_check_index(struct tree_node *node, struct board *b)
+{
+	struct tree_node *children = node_children(node);
+	if (!children)
+		return true;
+
+	for (struct tree_node *ni = children; ni; ni = node_sibling(ni))
+		if (tree_block_node(children, node_coord(ni)) != ni) {
+			fprintf(stderr, "%s: child %s not found in the index\n",
+				coord2sstr(node_coord(node), b), coord2sstr(node_coord(ni), b));
+			return false;
+		}
+	foreach_point(b) {
+		struct tree_node *ni = tree_block_node(children, c);
+		if (ni && node_coord(ni) != c) {
+			fprintf(stderr, "%s: index has %s for %s\n", coord2sstr(node_coord(node), b),
+				coord2sstr(node_coord(ni), b), coord2sstr(c, b));
+			return false;
+		}
+	} foreach_point_end;
+
+	for (struct tree_node *ni = children; ni; ni = node_sibling(ni))
+		if (!tree_check_index(ni, b))
+			return false;
+	return true;
+}
+
+/* Promote the root of a symmetric tree to arg, so that the tree gets
+ * flipped, and check the children lookups afterwards. */
+bool
+test_tree_symmetry(struct board *b, char *arg)
+{
+	coord_t c = str2coord(arg, board_size(b));
+	char e_arg[] = "threads=1";
+	struct engine *e = engine_uct_init(e_arg, b);
+	struct uct *u = e->data;
+
+	struct tree *t = tree_init(b, S_BLACK, 0, 0, 0, 1.0, 0, 0);
+	tree_test_expand(t, t->root, b, S_BLACK, u, 1, 2);
+	bool ret = tree_check_index(t->root, b);
+
+	if (ret && !tree_promote_at(t, b, c)) {
+		fprintf(stderr, "%s: no such node after promotion\n", arg);
+		ret = false;
+	}
+	if (ret)
+		ret = tree_check_index(t->root, b);
+	tree_done(t);
+	engine_done(e);
+
+	if (DEBUGL(1) || !ret)
+		fprintf(stderr, "tree_symmetry %s: %s\n", arg, ret ? "OK" : "FAILED");
+	return ret;
+}
+
+/* Node by node record of a subtree, depth first. */
+struct tree_test_node {
+	coord_t coord;
+	int depth, children;
+	struct move_stats u, amaf, prior;
+};
+
+struct tree_test_snap {
+	int nodes, alloc;
+	struct tree_test_node *n;
+	int parents;  // nodes with children
+	int blocks;   // distinct children blocks, fewer with shared ones
+	void **block;
+};
+
+static void
+tree_test_add_block(struct tree_test_snap *s, void *block)
+{
+	for (int i = 0; i < s->blocks; i++)
+		if (s->block[i] == block)
+			return;
+	s->block = realloc(s->block, (s->blocks + 1) * sizeof(*s->block));
+	s->block[s->blocks++] = block;
+}
+
+static void
+tree_test_snapshot(struct tree_test_snap *s, struct tree_node *node)
+{
+	if (s->nodes == s->alloc) {
+		s->alloc = s->alloc ? s->alloc * 2 : 1024;
+		s->n = realloc(s->n, s->alloc * sizeof(*s->n));
+	}
+	struct tree_test_node *r = &s->n[s->nodes++];
+	r->coord = node_coord(node);
+	r->depth = node->depth;
+	r->children = 0;
+	r->u = node_u(node);
+	r->amaf = node_amaf(node);
+	r->prior = node->prior;
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni))
+		r->children++;
+
+	if (node_children(node)) {
+		s->parents++;
+		tree_test_add_block(s, node_children(node));
+	}
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni))
+		tree_test_snapshot(s, ni);
+}
+
+static void
+tree_test_snap_done(struct tree_test_snap *s)
+{
+	free(s->n);
+	free(s->block);
+	memset(s, 0, sizeof(*s));
+}
+
+static bool
+stats_equal(struct move_stats *a, struct move_stats *b)
+{
+	return a->playouts == b->playouts && a->value == b->value;
+}
+
+/* Check that the subtree recorded in @b is the one recorded in @a. */
+static bool
+tree_test_compare(struct tree_test_snap *a, struct tree_test_snap *b, struct board *board, char *what)
+{
+	if (a->nodes != b->nodes) {
+		fprintf(stderr, "%s: %d nodes, expected %d\n", what, b->nodes, a->nodes);
+		return false;
+	}
+	for (int i = 0; i < a->nodes; i++) {
+		struct tree_test_node *x = &a->n[i], *y = &b->n[i];
+		if (x->coord != y->coord || x->depth != y->depth || x->children != y->children
+		    || !stats_equal(&x->u, &y->u) || !stats_equal(&x->amaf, &y->amaf)
+		    || !stats_equal(&x->prior, &y->prior)) {
+			fprintf(stderr, "%s: node %d %s differs\n", what, i, coord2sstr(x->coord, board));
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Search tree of the uct engine e for b grown with some playouts, with
+ * @promote promoted to the best reply so that the tree needs collecting. */
+static struct tree *
+tree_test_grow(struct engine *e, struct board *b, int games, bool promote)
+{
+	struct uct *u = e->data;
+	uct_prepare_move(u, b, S_BLACK);
+	for (int i = 0; i < games; i++)
+		uct_playout(u, b, S_BLACK, u->t);
+
+	struct tree *t = u->t;
+	if (!promote)
+		return t;
+	struct tree_node *best = node_children(t->root);
+	for (struct tree_node *ni = best; ni; ni = node_sibling(ni))
+		if (node_u(ni).playouts > node_u(best).playouts)
+			best = ni;
+	tree_promote_at(t, b, node_coord(best));
+	return t;
+}
+
+static void
+tree_test_done(struct engine *e, struct board *b)
+{
+	engine_done(e);
+	b->es = NULL;
+}
+
+/* Stop the collection of a tree at several points of the copy:
+ * it must be left as it was, pending. Then collect it for good,
+ * which must keep all of it. */
+bool
+test_tree_gc(struct board *b, char *arg)
+{
+	char e_arg[256];  snprintf(e_arg, sizeof(e_arg), "threads=1,max_tree_size=64%s%s", *arg ? "," : "", arg);
+	struct engine *e = engine_uct_init(e_arg, b);
+	struct tree *t = tree_test_grow(e, b, 10000, true);
+	t->gc_pending = true;
+	unsigned long size = tree_nodes_size(t);
+
+	struct tree_test_snap orig = { 0 }, now = { 0 };
+	tree_test_snapshot(&orig, t->root);
+	bool ret = tree_check_index(t->root, b);
+	if (t->tt && orig.blocks == orig.parents) {
+		fprintf(stderr, "tree_gc: dag tree without shared blocks\n");
+		ret = false;
+	}
+
+	int stops[] = { 1, 2, 3, 10, 50, orig.blocks / 2, orig.blocks - 1 };
+	for (unsigned int i = 0; i < sizeof(stops) / sizeof(*stops) && ret; i++) {
+		if (stops[i] < 1 || stops[i] >= orig.blocks)
+			continue;
+		t->gc_stop_blocks = stops[i];
+		struct tree_node *root = tree_garbage_collect(t, t->root, 0);
+		t->gc_stop = false;
+		t->gc_stop_blocks = 0;
+		tree_test_snapshot(&now, root);
+		if (root != t->root || !t->gc_pending || tree_nodes_size(t) != size) {
+			fprintf(stderr, "tree_gc: collection stopped after %d blocks not left pending\n", stops[i]);
+			ret = false;
+		} else {
+			ret = tree_test_compare(&orig, &now, b, "stopped collection")
+				&& orig.blocks == now.blocks && tree_check_index(root, b);
+		}
+		tree_test_snap_done(&now);
+	}
+
+	if (ret) {
+		t->root = tree_garbage_collect(t, t->root, 0);
+		tree_test_snapshot(&now, t->root);
+		if (t->gc_pending || t->gc_discarded || tree_nodes_size(t) >= size) {
+			fprintf(stderr, "tree_gc: collection incomplete, %lu nodes discarded, size %lu -> %lu\n",
+				t->gc_discarded, size, tree_nodes_size(t));
+			ret = false;
+		} else if (orig.blocks != now.blocks) {
+			fprintf(stderr, "tree_gc: %d children blocks after collection, expected %d\n", now.blocks, orig.blocks);
+			ret = false;
+		} else {
+			ret = tree_test_compare(&orig, &now, b, "collection") && tree_check_index(t->root, b);
+		}
+		tree_test_snap_done(&now);
+	}
+	if (DEBUGL(1) || !ret)
+		fprintf(stderr, "tree_gc %s: %d nodes, %d blocks, %d shared: %s\n", arg, orig.nodes, orig.blocks,
+			orig.parents - orig.blocks, ret ? "OK" : "FAILED");
+	tree_test_snap_done(&orig);
+	tree_test_done(e, b);
+	return ret;
+}
+
+/* Save a tree as opening tbook and load it in a fresh tree: both must
+ * have the same nodes, and the loaded one must keep growing. */
+bool
+test_tree_tbook(struct board *b, char *arg)
+{
+	char e_arg[256];  snprintf(e_arg, sizeof(e_arg), "threads=1,max_tree_size=64%s%s", *arg ? "," : "", arg);
+	struct engine *e = engine_uct_init(e_arg, b);
+	struct uct *u = e->data;
+	struct tree *t = tree_test_grow(e, b, 5000, false);
+
+	struct tree_test_snap orig = { 0 }, now = { 0 };
+	tree_test_snapshot(&orig, t->root);
+
+	/* Keep away from tbooks in the current directory. */
+	char dir[] = "/tmp/pachi-tbook-XXXXXX";
+	int cwd = open(".", O_RDONLY);
+	if (cwd < 0 || !mkdtemp(dir) || chdir(dir))
+		die("tree_tbook: %s: %s\n", dir, strerror(errno));
+	tree_save(t, b, 0);
+	struct tree *t2 = tree_init(b, stone_other(t->root_color), u->fast_alloc ? u->max_tree_size : 0,
+				    u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, 0, 0);
+	tree_load(t2, b);
+	unlink(tree_book_name(b));
+	if (fchdir(cwd) || rmdir(dir))
+		die("tree_tbook: %s: %s\n", dir, strerror(errno));
+	close(cwd);
+
+	tree_test_snapshot(&now, t2->root);
+	bool ret = tree_test_compare(&orig, &now, b, "loaded tbook") && tree_check_index(t2->root, b);
+	/* Shared children blocks are saved for each of their parents. */
+	if (ret && !t->tt && now.blocks != orig.blocks) {
+		fprintf(stderr, "tree_tbook: %d children blocks loaded, expected %d\n", now.blocks, orig.blocks);
+		ret = false;
+	}
+
+	int playouts = node_u(t2->root).playouts;
+	for (int i = 0; i < 1000 && ret; i++)
+		uct_playout(u, b, S_BLACK, t2);
+	if (ret && node_u(t2->root).playouts <= playouts) {
+		fprintf(stderr, "tree_tbook: no playouts in the loaded tree\n");
+		ret = false;
+	}
+	if (ret)
+		ret = tree_check_index(t2->root, b);
+
+	if (DEBUGL(1) || !ret)
+		fprintf(stderr, "tree_tbook %s: %d nodes: %s\n", arg, orig.nodes, ret ? "OK" : "FAILED");
+	tree_test_snap_done(&orig);
+	tree_test_snap_done(&now);
+	tree_done(t2);
+	tree_test_done(e, b);
+	return ret;
+}
@@ -166,3 +166,39 @@ board_undo_stress_test(struct board *board, char *arg)
 	printf("All good.\n\n");
 	return true;
 }
+
+
+/* Play some random games on a scratch board checking board_rollback()
+ * gets us back to the original board every time. */
+bool
+board_rollback_test(struct board *board, char *arg)
+{
+	int games = 1000;
+	enum stone color = S_BLACK;
+
+	board_print(board, stderr);
+	if (DEBUGL(1))
+		printf("board_rollback test.   Playing %i games on scratch board...\n", games);
+
+	struct playout_policy *policy = playout_light_init(NULL, board);
+	struct playout_setup setup = { .gamelen = MAX_GAMELEN };
+
+	struct board b, orig;
+	board_copy(&b, board);
+	board_copy(&orig, board);
+	for (int i = 0; i < games; i++)  {
+		play_random_game(&setup, &b, color, NULL, NULL, policy);
+		board_rollback(&b, board);
+
+		if (board_cmp(&b, &orig)) {
+			board_dump(&orig);
+			board_dump(&b);
+			assert(0);
+		}
+	}
+	board_done_noalloc(&b);
+	board_done_noalloc(&orig);
+
+	printf("All good.\n\n");
+	return true;
+}
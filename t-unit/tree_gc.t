@@ -0,0 +1,27 @@
+% Tree garbage collection stopped midway and completed
+boardsize 9
+. . . . . . . . .
+. . . . . . . . .
+. . X . . . O . .
+. . . . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+. . O . . . X . .
+. . . . . . . . .
+. . . . . . . . .
+
+tree_gc
+
+% DAG mode, transpositions share their children
+boardsize 9
+. . . . . . . . .
+. . . . . . . . .
+. . X . . . O . .
+. . . . . . . . .
+. . . . . X . . .
+. . . . . . . . .
+. . O . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+
+tree_gc dag,expand_p=2,force_seed=1
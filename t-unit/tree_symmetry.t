@@ -0,0 +1,19 @@
+% Children lookups after tree_promote_at() flips a symmetric tree
+boardsize 9
+. . . . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+
+tree_symmetry E5
+tree_symmetry C3
+tree_symmetry G3
+tree_symmetry C7
+tree_symmetry G7
+tree_symmetry D6
+tree_symmetry B4
@@ -0,0 +1,15 @@
+% Opening tbook saved and loaded again
+boardsize 9
+. . . . . . . . .
+. . . . . . . . .
+. . X . . . O . .
+. . . . . . . . .
+. . . . . X . . .
+. . . . . . . . .
+. . O . . . . . .
+. . . . . . . . .
+. . . . . . . . .
+
+tree_tbook
+tree_tbook fast_alloc=0
+tree_tbook dag,expand_p=2,force_seed=1
@@ -545,19 +545,35 @@ neighbor_is_safe(struct board *b, group_t g)
 }
 
 
+#ifdef BOARD_LIBSET
+static int
+libset_union(struct board *b, enum stone color, group_t g, void *data)
+{
+	bitboard_or(data, &board_group_info(b, g).libset);
+	return 0;
+}
+#else
 static int
 count_libs(struct board *b, enum stone color, coord_t c, void *data)
 {	
 	int *libs = data;
 	(*libs)++;  return 0;
 }
+#endif
 
 int
 dragon_liberties(struct board *b, enum stone color, coord_t to)
 {
+#ifdef BOARD_LIBSET
+	/* Exact, unlike going through the groups' lib[] */
+	struct bitboard libs = { { 0 } };
+	foreach_connected_group(b, color, to, libset_union, &libs);
+	return bitboard_count(&libs);
+#else
 	int libs = 0;	
 	foreach_lib_in_connected_groups(b, color, to, count_libs, &libs);
 	return libs;
+#endif
 }
 
 
@@ -42,6 +42,8 @@ struct uct {
 	bool allow_losing_pass;
 	bool territory_scoring;
 	int expand_p;
+	int leaf_playouts; /* Playouts per descent */
+#define LEAF_PLAYOUTS_MAX 16
 	bool playout_amaf;
 	bool amaf_prior;
 	int playout_amaf_cutoff;
@@ -49,9 +51,12 @@ struct uct {
 	int force_seed;
 	bool no_tbook;
 	bool fast_alloc;
+	bool dag; /* Merge transpositions (DAG mode) */
+	int dag_hbits; /* Transposition table size, 0 if no dag */
 	unsigned long max_tree_size;
 	unsigned long max_pruned_size;
 	unsigned long pruning_threshold;
+	double gc_budget; /* Max seconds spent pruning the tree on our time */
 	int mercymin;
 	int significant_threshold;
 
@@ -59,8 +64,13 @@ struct uct {
 	enum uct_thread_model {
 		TM_TREE, /* Tree parallelization w/o virtual loss. */
 		TM_TREEVL, /* Tree parallelization with virtual loss. */
+		TM_ROOT, /* Root parallelization, a tree per thread. */
+		TM_HYBRID, /* A tree per group of threads, with virtual loss. */
 	} thread_model;
+	int group_threads; /* TM_HYBRID: threads per tree */
+	int merge_depth; /* TM_ROOT, TM_HYBRID: plies merged into the main tree */
 	int virtual_loss;
+	bool pin_threads; /* Pin search threads to cpus */
 	bool pondering_opt; /* User wants pondering */
 	bool pondering; /* Actually pondering now */
 	bool slave; /* Act as slave in distributed engine. */
@@ -162,7 +172,11 @@ typedef floating_t (*uctp_evaluate)(struct uct_policy *p, struct tree *tree, str
 typedef void (*uctp_descend)(struct uct_policy *p, struct tree *tree, struct uct_descent *descent, int parity, bool allow_pass);
 typedef void (*uctp_winner)(struct uct_policy *p, struct tree *tree, struct uct_descent *descent);
 typedef void (*uctp_prior)(struct uct_policy *p, struct tree *tree, struct tree_node *node, struct board *b, enum stone color, int parity);
-typedef void (*uctp_update)(struct uct_policy *p, struct tree *tree, struct tree_node *node, enum stone node_color, enum stone player_color, struct playout_amafmap *amaf, struct board *final_board, floating_t result);
+/* Update goes along the descent path (root first), not the parent chain:
+ * in DAG mode a node may have several parents. It records the @n playouts
+ * run from the leaf of the descent at once (see leaf_playouts): playout k
+ * has result[k] and amaf[k], final_board is the board of the last one. */
+typedef void (*uctp_update)(struct uct_policy *p, struct tree *tree, struct uct_descent *descent, int dlen, enum stone node_color, enum stone player_color, struct playout_amafmap *amaf, struct board *final_board, floating_t *result, int n);
 typedef void (*uctp_done)(struct uct_policy *p);
 
 struct uct_policy {
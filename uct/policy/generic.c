@@ -15,21 +15,21 @@
 struct tree_node *
 uctp_generic_choose(struct uct_policy *p, struct tree_node *node, struct board *b, enum stone color, coord_t exclude)
 {
-	struct tree_node *nbest = node->children;
+	struct tree_node *nbest = node_children(node);
 	if (!nbest) return NULL;
-	struct tree_node *nbest2 = nbest->sibling;
+	struct tree_node *nbest2 = node_sibling(nbest);
 
 	/* This function is called while the tree is updated by other threads.
 	 * We rely on node->children being set only after the node has been fully expanded. */
-	for (struct tree_node *ni = nbest2; ni; ni = ni->sibling) {
+	for (struct tree_node *ni = nbest2; ni; ni = node_sibling(ni)) {
 		// we compare playouts and choose the best-explored
 		// child; comparing values is more brittle
 		if (node_coord(ni) == exclude || ni->hints & TREE_HINT_INVALID)
 			continue;
-		if (ni->u.playouts > nbest->u.playouts) {
+		if (node_u(ni).playouts > node_u(nbest).playouts) {
 			nbest2 = nbest;
 			nbest = ni;
-		} else if (ni->u.playouts > nbest2->u.playouts) {
+		} else if (node_u(ni).playouts > node_u(nbest2).playouts) {
 			nbest2 = ni;
 		}
 	}
@@ -25,12 +25,12 @@ void uctp_generic_winner(struct uct_policy *p, struct tree *tree, struct uct_des
 #define uctd_try_node_children(tree, descent, allow_pass, parity, tenuki_d, di, urgency) \
 	/* Information abound best children. */ \
 	/* XXX: We assume board <=25x25. */ \
-	struct uct_descent dbest[BOARD_MAX_MOVES + 1] = { { .node = descent->node->children, .lnode = NULL } }; int dbests = 1; \
+	struct uct_descent dbest[BOARD_MAX_MOVES + 1] = { { .node = node_children(descent->node), .lnode = NULL } }; int dbests = 1; \
 	floating_t best_urgency = -9999; \
 	/* Descent children iterator. */ \
-	struct uct_descent dci = { .node = descent->node->children, .lnode = descent->lnode ? descent->lnode->children : NULL }; \
+	struct uct_descent dci = { .node = node_children(descent->node), .lnode = descent->lnode ? node_children(descent->lnode) : NULL }; \
 	\
-	for (; dci.node; dci.node = dci.node->sibling) { \
+	for (; dci.node; dci.node = node_sibling(dci.node)) { \
 		floating_t urgency; \
 		/* Do not consider passing early. */ \
 		if (unlikely((!allow_pass && is_pass(node_coord(dci.node))) || (dci.node->hints & TREE_HINT_INVALID))) \
@@ -38,7 +38,7 @@ void uctp_generic_winner(struct uct_policy *p, struct tree *tree, struct uct_des
 		/* Position dci.lnode to point at or right after the local
 		 * node corresponding to dci.node. */ \
 		while (dci.lnode && node_coord(dci.lnode) < node_coord(dci.node)) \
-			dci.lnode = dci.lnode->sibling; \
+			dci.lnode = node_sibling(dci.lnode); \
 		/* Set up descent-further iterator. This is the public-accessible
 		 * one, and usually is similar to dci. However, in case of local
 		 * trees, we may keep next-candidate pointer in dci while storing
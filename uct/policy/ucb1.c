@@ -36,16 +36,17 @@ ucb1_descend(struct uct_policy *p, struct tree *tree, struct uct_descent *descen
 	 * of the explore coefficient. */
 
 	struct ucb1_policy *b = p->data;
-	floating_t xpl = log(descent->node->u.playouts + descent->node->prior.playouts);
+	floating_t xpl = log(node_u(descent->node).playouts + descent->node->prior.playouts);
 
 	uctd_try_node_children(tree, descent, allow_pass, parity, p->uct->tenuki_d, di, urgency) {
 		struct tree_node *ni = di.node;
-		int uct_playouts = ni->u.playouts + ni->prior.playouts + ni->descents;
+		struct move_stats nu = stats_get(&node_u(ni));
+		int uct_playouts = nu.playouts + ni->prior.playouts + ni->descents;
 
 		/* XXX: We don't take local-tree information into account. */
 
 		if (uct_playouts) {
-			urgency = (ni->u.playouts * tree_node_get_value(tree, parity, ni->u.value)
+			urgency = (nu.playouts * tree_node_get_value(tree, parity, nu.value)
 				   + ni->prior.playouts * tree_node_get_value(tree, parity, ni->prior.value))
 				   + (parity > 0 ? 0 : ni->descents)
 				  / uct_playouts;
@@ -59,16 +60,22 @@ ucb1_descend(struct uct_policy *p, struct tree *tree, struct uct_descent *descen
 }
 
 void
-ucb1_update(struct uct_policy *p, struct tree *tree, struct tree_node *node, enum stone node_color, enum stone player_color, struct playout_amafmap *map, struct board *final_board, floating_t result)
+ucb1_update(struct uct_policy *p, struct tree *tree, struct uct_descent *descent, int dlen, enum stone node_color, enum stone player_color, struct playout_amafmap *map, struct board *final_board, floating_t *result, int n)
 {
 	/* It is enough to iterate by a single chain; we will
 	 * update all the preceding positions properly since
 	 * they had to all occur in all branches, only in
 	 * different order. */
-	enum stone winner_color = result > 0.5 ? S_BLACK : S_WHITE;
-
-	for (; node; node = node->parent) {
-		stats_add_result(&node->u, result, 1);
+	floating_t value = 0;
+	for (int k = 0; k < n; k++)
+		value += result[k];
+	value /= n;
+	/* Criticality is sampled from the last playout only. */
+	enum stone winner_color = result[n - 1] > 0.5 ? S_BLACK : S_WHITE;
+
+	for (int di = dlen - 1; di >= 0; di--) {
+		struct tree_node *node = descent[di].node;
+		stats_add_result(&node_u(node), value, n);
 
 		if (!is_pass(node_coord(node))) {
 			stats_add_result(&node->winner_owner, board_at(final_board, node_coord(node)) == winner_color ? 1.0 : 0.0, 1);
@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 //#define DEBUG
 
@@ -109,7 +112,7 @@ ucb1rave_evaluate(struct uct_policy *p, struct tree *tree, struct uct_descent *d
 	struct tree_node *node = descent->node;
 	struct tree_node *lnode = descent->lnode;
 
-	struct move_stats n = node->u, r = node->amaf;
+	struct move_stats n = stats_get(&node_u(node)), r = stats_get(&node_amaf(node));
 	if (p->uct->amaf_prior) {
 		stats_merge(&r, &node->prior);
 	} else {
@@ -126,10 +129,10 @@ ucb1rave_evaluate(struct uct_policy *p, struct tree *tree, struct uct_descent *d
 	}
 
 	/* Local tree heuristics. */
-	assert(!lnode || lnode->parent);
+	assert(!lnode || node_parent(lnode));
 	if (p->uct->local_tree && b->ltree_rave > 0 && lnode
-	    && (p->uct->local_tree_rootchoose || lnode->parent->parent)) {
-		struct move_stats l = lnode->u;
+	    && (p->uct->local_tree_rootchoose || node_parent(node_parent(lnode)))) {
+		struct move_stats l = node_u(lnode);
 		l.playouts = ((floating_t) l.playouts) * b->ltree_rave / LTREE_PLAYOUTS_MULTIPLIER;
 		URAVE_DEBUG fprintf(stderr, "[ltree] adding [%s] %f%%%d to [%s] RAVE %f%%%d\n",
 			coord2sstr(node_coord(lnode), tree->board), l.value, l.playouts,
@@ -139,8 +142,8 @@ ucb1rave_evaluate(struct uct_policy *p, struct tree *tree, struct uct_descent *d
 
 	/* Criticality heuristics. */
 	if (b->crit_rave > 0 && (b->crit_plthres_coef > 0
-				 ? node->u.playouts > tree->root->u.playouts * b->crit_plthres_coef
-				 : node->u.playouts > b->crit_min_playouts)) {
+				 ? node_u(node).playouts > node_u(tree->root).playouts * b->crit_plthres_coef
+				 : node_u(node).playouts > b->crit_min_playouts)) {
 		floating_t crit = tree_node_criticality(tree, node);
 		if (b->crit_negative || crit > 0) {
 			floating_t val = 1.0f;
@@ -170,7 +173,7 @@ ucb1rave_evaluate(struct uct_policy *p, struct tree *tree, struct uct_descent *d
 					+ (floating_t) n.playouts * r.playouts / b->equiv_rave);
 			} else {
 				/* XXX: This can be cached in descend; but we don't use this by default. */
-				beta = sqrt(b->equiv_rave / (3 * node->parent->u.playouts + b->equiv_rave));
+				beta = sqrt(b->equiv_rave / (3 * node_u(node_parent(node)).playouts + b->equiv_rave));
 			}
 
 			value = beta * r.value + (1.f - beta) * n.value;
@@ -192,19 +195,298 @@ ucb1rave_evaluate(struct uct_policy *p, struct tree *tree, struct uct_descent *d
 	return tree_node_get_value(tree, parity, value);
 }
 
+
+/* Batched urgency computation.
+ *
+ * In the usual configuration (no local tree, no virtual wins, sylvain
+ * rave, prior merged into tree stats, single precision floating_t)
+ * ucb1rave_descend() computes the urgencies of all children at once:
+ * the inputs of ucb1rave_evaluate() are gathered into arrays (u and amaf
+ * stats already are dense in the children block), then urgencies are
+ * computed 8 children at a time with AVX2, or one at a time by
+ * urave_urgency() otherwise. Both do the same operations in the same
+ * order as ucb1rave_evaluate(). */
+
+#define URAVE_BATCH_MAX ((BOARD_MAX_MOVES + 1 + 7) & ~7)
+
+/* Per-child inputs, padded with zeroes to a multiple of 8.
+ * Arrays come first so that they are 32-byte aligned for AVX2 loads. */
+struct urave_batch {
+	float uv[URAVE_BATCH_MAX], rv[URAVE_BATCH_MAX], pv[URAVE_BATCH_MAX];
+	float wo[URAVE_BATCH_MAX], bo[URAVE_BATCH_MAX]; // winner_owner, black_owner values
+	int up[URAVE_BATCH_MAX], rp[URAVE_BATCH_MAX], pp[URAVE_BATCH_MAX];
+	int vl[URAVE_BATCH_MAX]; // virtual loss playouts
+	int crit[URAVE_BATCH_MAX]; // -1 if criticality applies
+	int n;
+} __attribute__((aligned(32)));
+
+/* Inputs shared by all children. */
+struct urave_params {
+	float vloss_value;
+	float crit_rave, crit_win, crit_loss;
+	bool crit_negative, crit_negflip;
+	float equiv_rave;
+	bool flip; // value is 1 - value for the player to move
+	bool explore;
+	float explore_c; // explore_p * nconf
+	float fpu;
+};
+
+static bool
+urave_batch_ok(struct uct_policy *p, struct uct_descent *descent, int vwin)
+{
+	struct ucb1_policy_amaf *b = p->data;
+	return sizeof(floating_t) == sizeof(float) && !descent->lnode && !vwin
+		&& b->sylvain_rave && !p->uct->amaf_prior;
+}
+
+static void
+urave_gather(struct uct_policy *p, struct tree *tree, struct tree_node *node, int parity,
+	     floating_t nconf, struct urave_params *q, struct urave_batch *c)
+{
+	struct ucb1_policy_amaf *b = p->data;
+	floating_t vloss_coeff = b->vloss_sqrt ? sqrt(p->uct->threads) / p->uct->threads : 1.;
+	q->vloss_value = parity > 0 ? 0. : 1.;
+	q->crit_rave = b->crit_rave;
+	q->crit_win = tree_node_get_value(tree, parity, 1.0f);
+	q->crit_loss = tree_node_get_value(tree, parity, 0);
+	q->crit_negative = b->crit_negative;
+	q->crit_negflip = b->crit_negflip;
+	q->equiv_rave = b->equiv_rave;
+	q->flip = tree_parity(tree, parity) < 0;
+	q->explore = b->explore_p > 0;
+	q->explore_c = b->explore_p * nconf;
+	q->fpu = b->fpu;
+
+	struct tree_node *children = node_children(node);
+	struct move_stats *u = tree_node_ustats(children), *amaf = tree_node_amafstats(children);
+	int n = c->n = children->bn;
+	for (int i = 0; i < n; i++) {
+		struct tree_node *ni = &children[i];
+		struct move_stats us = stats_get(&u[i]), as = stats_get(&amaf[i]);
+		c->uv[i] = us.value;  c->up[i] = us.playouts;
+		c->rv[i] = as.value;  c->rp[i] = as.playouts;
+		c->pv[i] = ni->prior.value;  c->pp[i] = ni->prior.playouts;
+		c->vl[i] = p->uct->virtual_loss ? (int) (ni->descents * vloss_coeff) : 0;
+		c->wo[i] = ni->winner_owner.value;  c->bo[i] = ni->black_owner.value;
+		c->crit[i] = b->crit_rave > 0 && (b->crit_plthres_coef > 0
+						  ? us.playouts > node_u(tree->root).playouts * b->crit_plthres_coef
+						  : us.playouts > b->crit_min_playouts) ? -1 : 0;
+	}
+	for (int i = n; i < ((n + 7) & ~7); i++) {
+		c->uv[i] = c->rv[i] = c->pv[i] = c->wo[i] = c->bo[i] = 0;
+		c->up[i] = c->rp[i] = c->pp[i] = c->vl[i] = c->crit[i] = 0;
+	}
+}
+
+/* Urgency of child i, scalar version. */
+static inline float
+urave_urgency(const struct urave_params *q, const struct urave_batch *c, int i)
+{
+	/* Tree stats with prior and virtual loss. */
+	int np = c->up[i];
+	float nv = c->uv[i];
+	if (c->pp[i]) {
+		np += c->pp[i];
+		nv += (c->pv[i] - nv) * c->pp[i] / np;
+	}
+	if (c->vl[i]) {
+		np += c->vl[i];
+		nv += (q->vloss_value - nv) * c->vl[i] / np;
+	}
+
+	/* RAVE stats with criticality. */
+	int rp = c->rp[i];
+	float rv = c->rv[i];
+	if (c->crit[i]) {
+		float crit = c->wo[i] - (2 * c->bo[i] * c->uv[i] - c->bo[i] - c->uv[i] + 1);
+		if (q->crit_negative || crit > 0) {
+			float val = q->crit_win;
+			if (q->crit_negflip && crit < 0) {
+				val = q->crit_loss;
+				crit = -crit;
+			}
+			int cp = crit * rp * q->crit_rave;
+			if (cp) {
+				rp += cp;
+				rv += (val - rv) * cp / rp;
+			}
+		}
+	}
+
+	float value = 0;
+	if (np) {
+		if (rp) {
+			float beta = (float) rp / (rp + np + (float) np * rp / q->equiv_rave);
+			value = beta * rv + (1.f - beta) * nv;
+		} else {
+			value = nv;
+		}
+	} else if (rp) {
+		value = rv;
+	}
+	if (q->flip)
+		value = 1 - value;
+
+	if (c->up[i] > 0 && q->explore)
+		value += q->explore_c / fast_sqrt(c->up[i]);
+	else if (c->up[i] + c->rp[i] + c->pp[i] == 0)
+		value = q->fpu;
+	return value;
+}
+
+#ifdef __AVX2__
+/* a + (b - a) * w / n where w != 0, else a. */
+static inline __m256
+urave_merge8(__m256 a, __m256 b, __m256i w, __m256i n)
+{
+	__m256 m = _mm256_div_ps(_mm256_mul_ps(_mm256_sub_ps(b, a), _mm256_cvtepi32_ps(w)), _mm256_cvtepi32_ps(n));
+	__m256 wzero = _mm256_castsi256_ps(_mm256_cmpeq_epi32(w, _mm256_setzero_si256()));
+	return _mm256_blendv_ps(_mm256_add_ps(a, m), a, wzero);
+}
+
+static void
+urave_urgencies8(const struct urave_params *q, const struct urave_batch *c, float *urgency)
+{
+	const __m256i izero = _mm256_setzero_si256();
+	const __m256 one = _mm256_set1_ps(1.f), zero = _mm256_setzero_ps();
+	for (int i = 0; i < c->n; i += 8) {
+		__m256i up = _mm256_load_si256((const __m256i *) &c->up[i]);
+		__m256i pp = _mm256_load_si256((const __m256i *) &c->pp[i]);
+		__m256i vl = _mm256_load_si256((const __m256i *) &c->vl[i]);
+		__m256i rp0 = _mm256_load_si256((const __m256i *) &c->rp[i]);
+		__m256 uv = _mm256_load_ps(&c->uv[i]);
+		__m256 rv0 = _mm256_load_ps(&c->rv[i]);
+
+		/* Tree stats with prior and virtual loss. */
+		__m256i np = _mm256_add_epi32(up, pp);
+		__m256 nv = urave_merge8(uv, _mm256_load_ps(&c->pv[i]), pp, np);
+		np = _mm256_add_epi32(np, vl);
+		nv = urave_merge8(nv, _mm256_set1_ps(q->vloss_value), vl, np);
+
+		/* RAVE stats with criticality. */
+		__m256 bo = _mm256_load_ps(&c->bo[i]);
+		__m256 crit = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(2.f), bo), uv), bo), uv), one);
+		crit = _mm256_sub_ps(_mm256_load_ps(&c->wo[i]), crit);
+		__m256 on = _mm256_castsi256_ps(_mm256_load_si256((const __m256i *) &c->crit[i]));
+		if (!q->crit_negative)
+			on = _mm256_and_ps(on, _mm256_cmp_ps(crit, zero, _CMP_GT_OQ));
+		__m256 val = _mm256_set1_ps(q->crit_win);
+		if (q->crit_negflip) {
+			__m256 neg = _mm256_cmp_ps(crit, zero, _CMP_LT_OQ);
+			val = _mm256_blendv_ps(val, _mm256_set1_ps(q->crit_loss), neg);
+			crit = _mm256_blendv_ps(crit, _mm256_sub_ps(zero, crit), neg);
+		}
+		__m256i cp = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_mul_ps(crit, _mm256_cvtepi32_ps(rp0)), _mm256_set1_ps(q->crit_rave)));
+		cp = _mm256_and_si256(cp, _mm256_castps_si256(on));
+		__m256i rp = _mm256_add_epi32(rp0, cp);
+		__m256 rv = urave_merge8(rv0, val, cp, rp);
+
+		/* Value. */
+		__m256 npf = _mm256_cvtepi32_ps(np), rpf = _mm256_cvtepi32_ps(rp);
+		__m256 beta = _mm256_div_ps(rpf, _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(rp, np)),
+							       _mm256_div_ps(_mm256_mul_ps(npf, rpf), _mm256_set1_ps(q->equiv_rave))));
+		__m256 both = _mm256_add_ps(_mm256_mul_ps(beta, rv), _mm256_mul_ps(_mm256_sub_ps(one, beta), nv));
+		__m256 nzero = _mm256_castsi256_ps(_mm256_cmpeq_epi32(np, izero));
+		__m256 rzero = _mm256_castsi256_ps(_mm256_cmpeq_epi32(rp, izero));
+		__m256 value = _mm256_blendv_ps(_mm256_blendv_ps(both, nv, rzero),
+						_mm256_blendv_ps(rv, zero, rzero), nzero);
+		if (q->flip)
+			value = _mm256_sub_ps(one, value);
+
+		/* Exploration and first play urgency. */
+		__m256 fpu = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_add_epi32(_mm256_add_epi32(up, rp0), pp), izero));
+		if (q->explore) {
+			__m256 explored = _mm256_castsi256_ps(_mm256_cmpgt_epi32(up, izero));
+			__m256 bonus = _mm256_div_ps(_mm256_set1_ps(q->explore_c), _mm256_sqrt_ps(_mm256_cvtepi32_ps(up)));
+			value = _mm256_blendv_ps(value, _mm256_add_ps(value, bonus), explored);
+			fpu = _mm256_andnot_ps(explored, fpu);
+		}
+		value = _mm256_blendv_ps(value, _mm256_set1_ps(q->fpu), fpu);
+		_mm256_storeu_ps(&urgency[i], value);
+	}
+}
+#endif
+
+static void
+urave_urgencies(const struct urave_params *q, const struct urave_batch *c, float *urgency)
+{
+#ifdef __AVX2__
+	urave_urgencies8(q, c, urgency);
+#else
+	for (int i = 0; i < c->n; i++)
+		urgency[i] = urave_urgency(q, c, i);
+#endif
+}
+
+/* Check that the batched urgencies of the children of node match
+ * ucb1rave_evaluate() and ucb1rave_descend(). For the unit tests. */
+bool
+ucb1rave_check_batch(struct uct_policy *p, struct tree *tree, struct tree_node *node, int parity)
+{
+	struct ucb1_policy_amaf *b = p->data;
+	floating_t nconf = 1.f;
+	if (b->explore_p > 0)
+		nconf = sqrt(log(node_u(node).playouts + node->prior.playouts));
+
+	static struct urave_batch c;
+	struct urave_params q;
+	float urgency[URAVE_BATCH_MAX];
+	urave_gather(p, tree, node, parity, nconf, &q, &c);
+	urave_urgencies(&q, &c, urgency);
+
+	bool ok = true;
+	for (int i = 0; i < c.n; i++) {
+		struct tree_node *ni = &node_children(node)[i];
+		struct uct_descent di = { .node = ni };
+		floating_t expected = ucb1rave_evaluate(p, tree, &di, parity);
+		if (node_u(ni).playouts > 0 && b->explore_p > 0)
+			expected += b->explore_p * nconf / fast_sqrt(node_u(ni).playouts);
+		else if (node_u(ni).playouts + node_amaf(ni).playouts + ni->prior.playouts == 0)
+			expected = b->fpu;
+
+		float scalar = urave_urgency(&q, &c, i);
+		floating_t tolerance = 1e-5 * (fabs(expected) > 1 ? fabs(expected) : 1);
+		if (fabs(urgency[i] - expected) > tolerance || fabs(scalar - expected) > tolerance) {
+			fprintf(stderr, "urgency mismatch for %s: %.9g (scalar %.9g), expected %.9g\n",
+				coord2sstr(node_coord(ni), tree->board), urgency[i], scalar, expected);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
 void
 ucb1rave_descend(struct uct_policy *p, struct tree *tree, struct uct_descent *descent, int parity, bool allow_pass)
 {
 	struct ucb1_policy_amaf *b = p->data;
 	floating_t nconf = 1.f;
 	if (b->explore_p > 0)
-		nconf = sqrt(log(descent->node->u.playouts + descent->node->prior.playouts));
+		nconf = sqrt(log(node_u(descent->node).playouts + descent->node->prior.playouts));
 	struct uct *u = p->uct;
 	int vwin = 0;
 	if (u->max_slaves > 0 && u->slave_index >= 0)
 		vwin = descent->node == tree->root ? b->root_virtual_win : b->virtual_win;
 	int child = 0;
 
+	if (urave_batch_ok(p, descent, vwin)) {
+		struct tree_node *children = node_children(descent->node);
+		struct urave_batch c;
+		struct urave_params q;
+		float urgencies[URAVE_BATCH_MAX];
+		urave_gather(p, tree, descent->node, parity, nconf, &q, &c);
+		urave_urgencies(&q, &c, urgencies);
+
+		uctd_try_node_children(tree, descent, allow_pass, parity, u->tenuki_d, di, urgency) {
+			urgency = urgencies[di.node - children];
+		} uctd_set_best_child(di, urgency);
+
+		uctd_get_best_child(descent);
+		/* Fill in descent->value. */
+		ucb1rave_evaluate(p, tree, descent, parity);
+		return;
+	}
+
 	uctd_try_node_children(tree, descent, allow_pass, parity, u->tenuki_d, di, urgency) {
 		struct tree_node *ni = di.node;
 		urgency = ucb1rave_evaluate(p, tree, &di, parity);
@@ -212,13 +494,13 @@ ucb1rave_descend(struct uct_policy *p, struct tree *tree, struct uct_descent *de
 		/* In distributed mode, encourage different slaves to work on different
 		 * parts of the tree. We rely on the fact that children (if they exist)
 		 * are the same and in the same order in all slaves. */
-		if (vwin > 0 && ni->u.playouts > b->vwin_min_playouts && (child - u->slave_index) % u->max_slaves == 0)
-			urgency += vwin / (ni->u.playouts + vwin);
+		if (vwin > 0 && node_u(ni).playouts > b->vwin_min_playouts && (child - u->slave_index) % u->max_slaves == 0)
+			urgency += vwin / (node_u(ni).playouts + vwin);
 
-		if (ni->u.playouts > 0 && b->explore_p > 0) {
-			urgency += b->explore_p * nconf / fast_sqrt(ni->u.playouts);
+		if (node_u(ni).playouts > 0 && b->explore_p > 0) {
+			urgency += b->explore_p * nconf / fast_sqrt(node_u(ni).playouts);
 
-		} else if (ni->u.playouts + ni->amaf.playouts + ni->prior.playouts == 0) {
+		} else if (node_u(ni).playouts + node_amaf(ni).playouts + ni->prior.playouts == 0) {
 			/* assert(!u->even_eqex); */
 			urgency = b->fpu;
 		}
@@ -245,93 +527,138 @@ static inline int ko_length(bool *ko_capture_map, int map_length)
 }
 
 void
-ucb1amaf_update(struct uct_policy *p, struct tree *tree, struct tree_node *node,
-		enum stone node_color, enum stone player_color,
-		struct playout_amafmap *map, struct board *final_board,
-		floating_t result)
+ucb1amaf_update(struct uct_policy *p, struct tree *tree,
+		struct uct_descent *descent, int dlen, enum stone node_color, enum stone player_color,
+		struct playout_amafmap *maps, struct board *final_board,
+		floating_t *result, int n)
 {
 	struct ucb1_policy_amaf *b = p->data;
-	enum stone winner_color = result > 0.5 ? S_BLACK : S_WHITE;
-
-	/* Record of the random playout - for each intersection coord,
-	 * first_move[coord] is the index map->game of the first move
-	 * at this coordinate, or INT_MAX if the move was not played.
-	 * The parity gives the color of this move.
+	floating_t value = 0;
+	for (int k = 0; k < n; k++)
+		value += result[k];
+	value /= n;
+	/* Criticality is sampled from the last playout only. */
+	enum stone winner_color = result[n - 1] > 0.5 ? S_BLACK : S_WHITE;
+
+	/* Record of the random playouts - for each intersection coord,
+	 * first_move[k][coord] is the index in maps[k].game of the first
+	 * move at this coordinate, or INT_MAX if the move was not played.
+	 * The parity gives the color of this move. The moves of the
+	 * descent, up to game_baselen, are the same in all maps.
 	 */
-	int first_map[board_size2(final_board)+1];
-	int *first_move = &first_map[1]; // +1 for pass
+	int first_map[n][board_size2(final_board)+1];
 
 #if 0
 	struct board bb; bb.size = 9+2;
-	for (struct tree_node *ni = node; ni; ni = ni->parent)
-		fprintf(stderr, "%s ", coord2sstr(node_coord(ni), &bb));
-	fprintf(stderr, "[color %d] update result %d (color %d)\n",
-			node_color, result, player_color);
+	for (int di = dlen - 1; di >= 0; di--)
+		fprintf(stderr, "%s ", coord2sstr(node_coord(descent[di].node), &bb));
+	fprintf(stderr, "[color %d] update result %f (color %d)\n",
+			node_color, value, player_color);
 #endif
 
 	/* Initialize first_move */
-	for (int i = pass; i < board_size2(final_board); i++) first_move[i] = INT_MAX;
-	int move;
-	assert(map->gamelen > 0);
-	for (move = map->gamelen - 1; move >= map->game_baselen; move--)
-		first_move[map->game[move]] = move;
+	for (int k = 0; k < n; k++) {
+		int *first_move = &first_map[k][1]; // +1 for pass
+		for (int i = pass; i < board_size2(final_board); i++) first_move[i] = INT_MAX;
+		assert(maps[k].gamelen > 0);
+		assert(maps[k].game_baselen == maps[0].game_baselen);
+		for (int move = maps[k].gamelen - 1; move >= maps[k].game_baselen; move--)
+			first_move[maps[k].game[move]] = move;
+	}
+	int move = maps[0].game_baselen - 1;
 
-	while (node) {
+	for (int di = dlen - 1; di >= 0; di--) {
+		struct tree_node *node = descent[di].node;
 		if (!b->crit_amaf && !is_pass(node_coord(node))) {
 			stats_add_result(&node->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), winner_color), 1);
 			stats_add_result(&node->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(node), S_BLACK), 1);
 		}
-		stats_add_result(&node->u, result, 1);
+		stats_add_result(&node_u(node), value, n);
 
-		bool *ko_capture_map = &map->is_ko_capture[move+1];
-		int max_threat_dist = b->threat_rave <= 0 ? ko_length(ko_capture_map, map->gamelen - (move+1)) : -1;
+		int max_threat_dist[n];
+		for (int k = 0; k < n; k++) {
+			bool *ko_capture_map = &maps[k].is_ko_capture[move+1];
+			max_threat_dist[k] = b->threat_rave <= 0 ? ko_length(ko_capture_map, maps[k].gamelen - (move+1)) : -1;
+		}
 
 		/* This loop ignores symmetry considerations, but they should
 		 * matter only at a point when AMAF doesn't help much. */
-		assert(map->game_baselen >= 0);
-		for (struct tree_node *ni = node->children; ni; ni = ni->sibling) {
-			if (is_pass(node_coord(ni))) continue;
-
-			/* Use the child move only if it was first played by the same color. */
-			int first = first_move[node_coord(ni)];
-			if (first == INT_MAX) continue;
-			assert(first > move && first < map->gamelen);
-			int distance = first - (move + 1);
-			if (distance & 1) continue;
-
-			int weight = 1;
-			floating_t res = result;
-
-			/* Don't give amaf bonus to a ko threat before taking the ko.
-			 * http://www.grappa.univ-lille3.fr/~coulom/Aja_PhD_Thesis.pdf
-			 */
-			if (distance <= max_threat_dist && distance % 6 == 4) {
-				weight = - b->threat_rave;
-				res = 1.0 - res;
-			} else if (b->distance_rave != 0) {
-				/* Give more weight to moves played earlier */
-				weight += b->distance_rave * (map->gamelen - first) / (map->gamelen - move);
-			}
-			stats_add_result(&ni->amaf, res, weight);
-
-			if (b->crit_amaf) {
-				stats_add_result(&ni->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), winner_color), 1);
-				stats_add_result(&ni->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), S_BLACK), 1);
-			}
+		assert(maps[0].game_baselen >= 0);
+		/* Go through the moves played after node by the color of its
+		 * children and update each child found in the index of the
+		 * children block, with all playouts at once: the first time
+		 * its move shows up, which is in the first playout where it
+		 * was first played by that color. */
+		struct tree_node *children = node_children(node);
+		struct move_stats *amaf = children ? tree_node_amafstats(children) : NULL;
+		for (int k = 0; children && k < n; k++) {
+			for (int m = move + 1; m < maps[k].gamelen; m += 2) {
+				coord_t c = maps[k].game[m];
+				if (is_pass(c) || first_map[k][1 + c] != m)
+					continue;
+				int j;
+				for (j = 0; j < k; j++)
+					if (first_map[j][1 + c] != INT_MAX && !((first_map[j][1 + c] - (move + 1)) & 1))
+						break;
+				if (j < k)
+					continue;
+				struct tree_node *ni = tree_block_node(children, c);
+				if (!ni)
+					continue;
+
+				/* Weights are never negative, so adding the weighted
+				 * mean of all playouts at once comes to the same as
+				 * adding them one by one. */
+				int weights = 0;
+				floating_t sum = 0;
+				for (j = k; j < n; j++) {
+					struct playout_amafmap *map = &maps[j];
+					/* Use the child move only if it was first played by the same color. */
+					int first = first_map[j][1 + c];
+					if (first == INT_MAX) continue;
+					assert(first > move && first < map->gamelen);
+					int distance = first - (move + 1);
+					if (distance & 1) continue;
+
+					int weight = 1;
+					floating_t res = result[j];
+
+					/* Don't give amaf bonus to a ko threat before taking the ko.
+					 * http://www.grappa.univ-lille3.fr/~coulom/Aja_PhD_Thesis.pdf
+					 */
+					if (distance <= max_threat_dist[j] && distance % 6 == 4) {
+						weight = - b->threat_rave;
+						res = 1.0 - res;
+					} else if (b->distance_rave != 0) {
+						/* Give more weight to moves played earlier */
+						weight += b->distance_rave * (map->gamelen - first) / (map->gamelen - move);
+					}
+					weights += weight;
+					sum += res * weight;
+
+					if (b->crit_amaf && j == n - 1) {
+						stats_add_result(&ni->winner_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), winner_color), 1);
+						stats_add_result(&ni->black_owner, board_local_value(b->crit_lvalue, final_board, node_coord(ni), S_BLACK), 1);
+					}
+				}
+				if (weights > 0)
+					stats_add_result(&amaf[ni->bi], sum / weights, weights);
 #if 0
-			struct board bb; bb.size = 9+2;
-			fprintf(stderr, "* %s<%"PRIhash"> -> %s<%"PRIhash"> [%d/%f => %d/%f]\n",
-				coord2sstr(node_coord(node), &bb), node->hash,
-				coord2sstr(node_coord(ni), &bb), ni->hash,
-				player_color, result, move, res);
+				struct board bb; bb.size = 9+2;
+				fprintf(stderr, "* %s<%p> -> %s<%p> [%d/%f => %d/%d]\n",
+					coord2sstr(node_coord(node), &bb), node,
+					coord2sstr(node_coord(ni), &bb), ni,
+					player_color, value, move, weights);
 #endif
+			}
 		}
-		if (node->parent) {
-			assert(move >= 0 && map->game[move] == node_coord(node) && first_move[node_coord(node)] > move);
-			first_move[node_coord(node)] = move;
+		if (di > 0) {
+			for (int k = 0; k < n; k++) {
+				assert(move >= 0 && maps[k].game[move] == node_coord(node) && first_map[k][1 + node_coord(node)] > move);
+				first_map[k][1 + node_coord(node)] = move;
+			}
 			move--;
 		}
-		node = node->parent;
 	}
 }
 
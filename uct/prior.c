@@ -15,6 +15,7 @@
 #include "uct/internal.h"
 #include "uct/plugins.h"
 #include "uct/prior.h"
+#include "uct/profile.h"
 #include "uct/tree.h"
 #include "dcnn.h"
 
@@ -24,6 +25,18 @@
 /* TODO: Introduce foreach_fpoint() to iterate only over non-occupied
  * positions. */
 
+/* Cache of position priors (see uct_prior_position()), so that positions
+ * expanded again (after tree pruning, in another thread group's tree, or
+ * by transposition) skip ladder and playout policy checks. Direct mapped and lock-free: each entry has
+ * a sequence count, odd while the entry is being written. A read racing
+ * with a write is simply a miss, and writers skip busy entries. */
+struct prior_cache_entry {
+	volatile unsigned int seq;
+	hash_t key;
+	struct move_stats *prior;  // [size2 + 1], pass first
+	bool *consider;            // [size2 + 1], pass first
+};
+
 struct uct_prior {
 	/* Equivalent experience for prior knowledge. MoGo paper recommends
 	 * 50 playouts per source; in practice, esp. with RAVE, about 6
@@ -31,8 +44,18 @@ struct uct_prior {
 	int eqex;
 	int even_eqex, policy_eqex, b19_eqex, eye_eqex, ko_eqex, plugin_eqex, joseki_eqex, pattern_eqex;
 	int dcnn_eqex;
+	/* Use dcnn priors for nodes up to dcnn_depth moves below the root,
+	 * evaluated asynchronously in batches of up to dcnn_batch positions. */
+	int dcnn_depth, dcnn_batch;
 	int cfgdn; int *cfgd_eqex;
 	bool prune_ladders;
+
+	/* Prior cache, cache_mask + 1 entries for boards of size2. */
+	int cache_size;  // requested, -1 for default
+	struct prior_cache_entry *cache;
+	hash_t cache_mask;
+	int cache_size2;
+	int cache_hits, cache_misses;
 };
 
 void
@@ -59,13 +82,13 @@ uct_prior_eye(struct uct *u, struct tree_node *node, struct prior_map *map)
 	 * XOOOXX#
 	 * X.OOOO#
 	 * .XXXX.# */
-	foreach_free_point(map->b) {
+	struct bitboard eyes;
+	board_one_point_eyes(map->b, map->to_play, &eyes);
+	foreach_bitboard(&eyes) {
 		if (!map->consider[c])
 			continue;
-		if (!board_is_one_point_eye(map->b, c, map->to_play))
-			continue;
 		add_prior_value(map, c, 0, u->prior->eye_eqex);
-	} foreach_free_point_end;
+	} foreach_bitboard_end;
 }
 
 #ifdef DCNN
@@ -76,7 +99,9 @@ uct_prior_dcnn(struct uct *u, struct tree_node *node, struct prior_map *map)
 	float r[19 * 19];
 	float best_r[DCNN_BEST_N] = { 0.0, };
 	coord_t best_moves[DCNN_BEST_N];
+	int prof = uct_profile_enter(UP_DCNN);
 	dcnn_get_moves(map->b, map->to_play, r);
+	uct_profile_leave(prof);
 	find_dcnn_best_moves(map->b, r, best_moves, best_r, DCNN_BEST_N);
 	if (UDEBUGL(2))
 		print_dcnn_best_moves(map->b, best_moves, best_r, DCNN_BEST_N);
@@ -92,6 +117,84 @@ uct_prior_dcnn(struct uct *u, struct tree_node *node, struct prior_map *map)
 		assert(val >= 0.0 && val <= 1.0);
 		add_prior_value(map, c, 1, sqrt(val) * u->prior->dcnn_eqex);
 	} foreach_free_point_end;
+	node->hints |= TREE_HINT_DCNN;
+}
+
+/* Add dcnn priors to the children of an expanded node, like
+ * uct_prior_dcnn() does in the prior map. Search threads may be
+ * descending through them meanwhile. */
+static void
+uct_prior_dcnn_add(struct uct *u, struct tree_node *node, struct board *b, float r[], int parity)
+{
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni)) {
+		if (is_pass(node_coord(ni)))
+			continue;
+		float val = r[coord2dcnn_idx(node_coord(ni), b)];
+		if (isnan(val) || val < 0.001)
+			continue;
+		stats_add_result(&ni->prior, parity > 0 ? 1 : 0, sqrt(val) * u->prior->dcnn_eqex);
+	}
+	__sync_fetch_and_or(&node->hints, TREE_HINT_DCNN);
+}
+
+struct dcnn_prior_ctx {
+	struct uct *u;
+	struct board *b;
+	struct tree_node *node;
+	int parity;
+};
+
+/* Called by the dcnn evaluator thread. */
+static void
+uct_prior_dcnn_done(void *ctx_, float r[])
+{
+	struct dcnn_prior_ctx *ctx = ctx_;
+	struct tree_node *node = ctx->node;
+	if (r)
+		uct_prior_dcnn_add(ctx->u, node, ctx->b, r, ctx->parity);
+	__sync_fetch_and_sub(&node->descents, ctx->u->virtual_loss);
+	free(ctx);
+}
+
+void
+uct_prior_dcnn_async(struct uct *u, struct tree_node *node, struct board *b, enum stone color, int parity)
+{
+	struct dcnn_prior_ctx *ctx = malloc2(sizeof(*ctx));
+	ctx->u = u;
+	ctx->b = u->t->board;
+	ctx->node = node;
+	ctx->parity = parity;
+	/* Virtual loss keeps the search in other branches
+	 * until the priors are there. */
+	__sync_fetch_and_add(&node->descents, u->virtual_loss);
+	if (!dcnn_async_submit(b, color, uct_prior_dcnn_done, ctx)) {
+		__sync_fetch_and_sub(&node->descents, u->virtual_loss);
+		free(ctx);
+	}
+}
+
+void
+uct_prior_dcnn_root(struct uct *u, struct tree *t, struct board *b, enum stone color)
+{
+	if (!u->prior->dcnn_eqex)
+		return;
+	/* When pondering, the replies to the opponent's likely moves
+	 * get their dcnn priors in the background, see uct_prior(). */
+	if (u->pondering)
+		dcnn_async_start(u->prior->dcnn_batch);
+
+	struct tree_node *root = t->root;
+	if (!node_children(root) || (root->hints & TREE_HINT_DCNN))
+		return;
+	if (u->pondering) {
+		uct_prior_dcnn_async(u, root, b, color, tree_parity(t, 1));
+		return;
+	}
+	float r[19 * 19];
+	int prof = uct_profile_enter(UP_DCNN);
+	dcnn_get_moves(b, color, r);
+	uct_profile_leave(prof);
+	uct_prior_dcnn_add(u, root, t->board, r, tree_parity(t, 1));
 }
 
 #else
@@ -205,11 +308,76 @@ uct_prior_pattern(struct uct *u, struct tree_node *node, struct prior_map *map)
 	}
 }
 
-void
-uct_prior(struct uct *u, struct tree_node *node, struct prior_map *map)
+/* The cached part of the prior map depends on the position, the player
+ * to move and the ko only. */
+static hash_t
+prior_cache_key(struct prior_map *map)
 {
 	struct board *b = map->b;
-	
+	hash_t key = b->hash;
+	key ^= (hash_t)(map->to_play * 2 + (map->parity > 0)) << 60;
+	key ^= (hash_t)(b->ko.coord + 2) * 0x165667b19e3779f9ULL;
+	return key;
+}
+
+static bool
+prior_cache_get(struct uct_prior *p, hash_t key, struct prior_map *map)
+{
+	struct prior_cache_entry *e = &p->cache[key & p->cache_mask];
+	int n = p->cache_size2 + 1;
+	struct move_stats prior[n];
+	bool consider[n];
+
+	unsigned int seq = e->seq;
+	__sync_synchronize();
+	if ((seq & 1) || e->key != key)
+		return false;
+	memcpy(prior, e->prior, sizeof(prior));
+	memcpy(consider, e->consider, sizeof(consider));
+	__sync_synchronize();
+	if (e->seq != seq)
+		return false;
+
+	memcpy(map->prior - 1, prior, sizeof(prior));
+	memcpy(map->consider - 1, consider, sizeof(consider));
+	return true;
+}
+
+static void
+prior_cache_put(struct uct_prior *p, hash_t key, struct prior_map *map)
+{
+	struct prior_cache_entry *e = &p->cache[key & p->cache_mask];
+	int n = p->cache_size2 + 1;
+
+	unsigned int seq = e->seq;
+	if ((seq & 1) || !__sync_bool_compare_and_swap(&e->seq, seq, seq + 1))
+		return;
+	e->key = key;
+	memcpy(e->prior, map->prior - 1, n * sizeof(*e->prior));
+	memcpy(e->consider, map->consider - 1, n * sizeof(*e->consider));
+	__sync_synchronize();
+	e->seq = seq + 2;
+}
+
+/* Whether @node gets dcnn priors: right away at the root, asynchronously
+ * up to dcnn_depth moves below it. */
+static bool
+uct_prior_wants_dcnn(struct uct *u, struct tree_node *node)
+{
+	if (!u->prior->dcnn_eqex)
+		return false;
+	/* When pondering, our replies are the next root. */
+	int dcnn_depth = u->prior->dcnn_depth;
+	if (u->pondering && dcnn_depth < 1)  dcnn_depth = 1;
+	return !node_parent(node) || node->depth - u->t->root->depth <= dcnn_depth;
+}
+
+/* The priors which look at the position alone. */
+static void
+uct_prior_position(struct uct *u, struct tree_node *node, struct prior_map *map)
+{
+	struct board *b = map->b;
+
 	if (u->prior->prune_ladders && !board_playing_ko_threat(b)) {
 		foreach_free_point(b) {
 			if (!map->consider[c])
@@ -234,27 +402,66 @@ uct_prior(struct uct *u, struct tree_node *node, struct prior_map *map)
 		uct_prior_even(u, node, map);
 	if (u->prior->eye_eqex)
 		uct_prior_eye(u, node, map);
-	if (u->prior->ko_eqex)
-		uct_prior_ko(u, node, map);
 	if (u->prior->b19_eqex)
 		uct_prior_b19(u, node, map);
+	if (u->prior->policy_eqex)
+		uct_prior_playout(u, node, map);
+	if (u->prior->joseki_eqex)
+		uct_prior_joseki(u, node, map);
+}
+
+void
+uct_prior(struct uct *u, struct tree_node *node, struct prior_map *map)
+{
+	struct board *b = map->b;
+
+	/* Position priors come from the cache when the position was
+	 * expanded before, whatever the move order; the priors depending
+	 * on the recent moves (ko age, cfg distances, patterns) and dcnn
+	 * are added on top. Root expansions are rare: not cached. */
+	if (node_parent(node) && u->prior->cache && board_size2(b) == u->prior->cache_size2) {
+		hash_t key = prior_cache_key(map);
+		if (prior_cache_get(u->prior, key, map)) {
+			__sync_fetch_and_add(&u->prior->cache_hits, 1);
+		} else {
+			__sync_fetch_and_add(&u->prior->cache_misses, 1);
+			uct_prior_position(u, node, map);
+			prior_cache_put(u->prior, key, map);
+		}
+	} else
+		uct_prior_position(u, node, map);
+
+	if (u->prior->ko_eqex)
+		uct_prior_ko(u, node, map);
 	
-	if (!node->parent)  // Use dcnn for root priors
-		if (u->prior->dcnn_eqex)
+	if (uct_prior_wants_dcnn(u, node)) {
+		if (!node_parent(node))  // Use dcnn for root priors
 			uct_prior_dcnn(u, node, map);
+		else
+			map->dcnn_async = true;  // once the children exist, see tree_expand_node()
+	}
 	
-	if (u->prior->policy_eqex)
-		uct_prior_playout(u, node, map);
 	if (u->prior->cfgd_eqex)
 		uct_prior_cfgd(u, node, map);
-	if (u->prior->joseki_eqex)
-		uct_prior_joseki(u, node, map);
 	if (u->prior->pattern_eqex)
 		uct_prior_pattern(u, node, map);
 	if (u->prior->plugin_eqex)
 		plugin_prior(u->plugins, node, map, u->prior->plugin_eqex);
 }
 
+void
+uct_prior_cache_stats(struct uct_prior *p, int *hits, int *misses)
+{
+	*hits = p->cache_hits;
+	*misses = p->cache_misses;
+}
+
+void
+uct_prior_cache_reset_stats(struct uct_prior *p)
+{
+	p->cache_hits = p->cache_misses = 0;
+}
+
 struct uct_prior *
 uct_prior_init(char *arg, struct board *b, struct uct *u)
 {
@@ -269,6 +476,7 @@ uct_prior_init(char *arg, struct board *b, struct uct *u)
 	 * against regular pachi. Below 1200 is bad (50% winrate and worse), more
 	 * gives diminishing returns (1500 -> 78%, 2000 -> 70% ...) */
 	p->dcnn_eqex    = 1300;
+	p->dcnn_batch   = 8;
 	p->joseki_eqex = -200;
 	p->cfgdn = -1;
 
@@ -276,6 +484,7 @@ uct_prior_init(char *arg, struct board *b, struct uct *u)
 	p->eqex = board_large(b) ? 20 : 14;
 
 	p->prune_ladders = true;
+	p->cache_size = -1;
 
 	if (arg) {
 		char *optspec, *next = arg;
@@ -336,9 +545,22 @@ uct_prior_init(char *arg, struct board *b, struct uct *u)
 				p->plugin_eqex = atoi(optval);
 			} else if (!strcasecmp(optname, "prune_ladders")) {
 				p->prune_ladders = !optval || atoi(optval);
+			} else if (!strcasecmp(optname, "cache") && optval) {
+				/* Number of position prior maps to cache
+				 * (rounded down to a power of two), 0 to
+				 * disable. Default 4096 with thread_model=root
+				 * or hybrid, off otherwise. */
+				p->cache_size = atoi(optval);
 #ifdef DCNN
 			} else if (!strcasecmp(optname, "dcnn") && optval) {
 				p->dcnn_eqex = atoi(optval);
+			} else if (!strcasecmp(optname, "dcnn_depth") && optval) {
+				/* Also use dcnn below the root, up to this many
+				 * moves deep. Default 0 (root only). */
+				p->dcnn_depth = atoi(optval);
+			} else if (!strcasecmp(optname, "dcnn_batch") && optval) {
+				/* Max positions per dcnn evaluation below the root. */
+				p->dcnn_batch = atoi(optval);
 #endif
 			} else {
 				fprintf(stderr, "uct: Invalid prior argument %s or missing value\n", optname);
@@ -359,6 +581,8 @@ uct_prior_init(char *arg, struct board *b, struct uct *u)
 
 	if (!using_dcnn(b))
 		p->dcnn_eqex = 0;
+	if (p->dcnn_eqex && p->dcnn_depth)
+		dcnn_async_start(p->dcnn_batch);
 	
 	if (p->cfgdn < 0) {
 		static int large_bonuses[] = { 0, 55, 50, 15 };
@@ -378,10 +602,39 @@ uct_prior_init(char *arg, struct board *b, struct uct *u)
 	return p;
 }
 
+void
+uct_prior_cache_init(struct uct_prior *p, struct board *b, bool tree_per_group)
+{
+	/* With a single tree, positions seldom get expanded twice. */
+	int cache_size = p->cache_size;
+	if (cache_size < 0)
+		cache_size = tree_per_group ? 4096 : 0;
+	if (cache_size <= 0)
+		return;
+
+	int entries = 1;
+	while (entries * 2 <= cache_size)  entries *= 2;
+	int n = board_size2(b) + 1;
+	p->cache = calloc2(entries, sizeof(*p->cache));
+	p->cache_mask = entries - 1;
+	p->cache_size2 = board_size2(b);
+	struct move_stats *prior = calloc2(entries * n, sizeof(*prior));
+	bool *consider = calloc2(entries * n, sizeof(*consider));
+	for (int i = 0; i < entries; i++) {
+		p->cache[i].prior = prior + i * n;
+		p->cache[i].consider = consider + i * n;
+	}
+}
+
 void
 uct_prior_done(struct uct_prior *p)
 {
 	assert(p->cfgd_eqex);
 	free(p->cfgd_eqex);
+	if (p->cache) {
+		free(p->cache[0].prior);
+		free(p->cache[0].consider);
+		free(p->cache);
+	}
 	free(p);
 }
@@ -22,16 +22,37 @@ struct prior_map {
 	bool *consider;
 	/* [board_size2(b)] array from cfg_distances() */
 	int *distances;
+	/* Set by uct_prior() if dcnn priors are to be added
+	 * asynchronously, see uct_prior_dcnn_async(). */
+	bool dcnn_async;
 };
 
 /* @value is the value, @playouts is its weight. */
 static void add_prior_value(struct prior_map *map, coord_t c, floating_t value, int playouts);
 
 void uct_prior(struct uct *u, struct tree_node *node, struct prior_map *map);
+#ifdef DCNN
+/* Queue node position for dcnn evaluation, its children
+ * get the dcnn priors when the result comes back. */
+void uct_prior_dcnn_async(struct uct *u, struct tree_node *node, struct board *b, enum stone color, int parity);
+/* Called at search start: give dcnn priors to the root children if it
+ * was expanded below the root (reused tree). In the background when
+ * pondering. */
+void uct_prior_dcnn_root(struct uct *u, struct tree *t, struct board *b, enum stone color);
+#else
+#define uct_prior_dcnn_async(u, node, b, color, parity)
+#define uct_prior_dcnn_root(u, t, b, color)
+#endif
 
 struct uct_prior;
 struct uct_prior *uct_prior_init(char *arg, struct board *b, struct uct *u);
 void uct_prior_done(struct uct_prior *p);
+/* Set up the prior cache once the thread model is known. */
+void uct_prior_cache_init(struct uct_prior *p, struct board *b, bool tree_per_group);
+
+/* Prior cache stats since the last reset. */
+void uct_prior_cache_stats(struct uct_prior *p, int *hits, int *misses);
+void uct_prior_cache_reset_stats(struct uct_prior *p);
 
 
 static inline void
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timeinfo.h"
+#include "util.h"
+#include "uct/profile.h"
+
+static char *phase_names[UP_MAX] = {
+	[UP_IDLE] = "idle",
+	[UP_WALK] = "walk",
+	[UP_DESCENT] = "descent",
+	[UP_PLAY] = "play",
+	[UP_EXPAND] = "expand",
+	[UP_PRIOR] = "prior",
+	[UP_DCNN] = "dcnn",
+	[UP_PLAYOUT] = "playout",
+	[UP_UPDATE] = "update",
+	[UP_LTREE] = "ltree",
+};
+
+static struct uct_profile last;
+static bool have_last;
+
+#ifdef SEARCH_PROFILE
+
+struct uct_profile_slot uct_profile_slots[UCT_PROFILE_SLOTS];
+__thread int uct_profile_slot = 0;
+
+static uint64_t start_ticks;
+static double start_time;
+
+void
+uct_profile_start(void)
+{
+	start_ticks = uct_profile_ticks();
+	start_time = time_now();
+	for (int i = 0; i < UCT_PROFILE_SLOTS; i++) {
+		struct uct_profile_slot *s = &uct_profile_slots[i];
+		memset(s->cycles, 0, sizeof(s->cycles));
+		memset(s->calls, 0, sizeof(s->calls));
+		s->last = start_ticks;
+		s->phase = UP_IDLE;
+	}
+}
+
+void
+uct_profile_stop(void)
+{
+	struct uct_profile *p = &last;
+	memset(p, 0, sizeof(*p));
+	for (int i = 0; i < UCT_PROFILE_SLOTS; i++) {
+		struct uct_profile_slot *s = &uct_profile_slots[i];
+		if (i == UCT_PROFILE_ASYNC_SLOT) {
+			p->async_cycles = s->cycles[UP_DCNN];
+			p->async_calls = s->calls[UP_DCNN];
+			continue;
+		}
+		if (s->calls[UP_PLAYOUT])
+			p->threads++;
+		for (int ph = UP_WALK; ph < UP_MAX; ph++) {
+			p->cycles[ph] += s->cycles[ph];
+			p->calls[ph] += s->calls[ph];
+		}
+	}
+	p->time = time_now() - start_time;
+	p->hz = p->time > 0 ? (uct_profile_ticks() - start_ticks) / p->time : 0;
+	have_last = true;
+}
+
+#endif
+
+bool
+uct_profile_last(struct uct_profile *p)
+{
+	if (have_last)
+		*p = last;
+	return have_last;
+}
+
+char *
+uct_profile_str(struct uct_profile *p)
+{
+	static char buffer[2048];
+	strbuf_t strbuf;
+	strbuf_t *buf = strbuf_init(&strbuf, buffer, sizeof(buffer));
+
+	uint64_t total = 0;
+	for (int ph = UP_WALK; ph < UP_MAX; ph++)
+		total += p->cycles[ph];
+	double ms = p->hz > 0 ? 1000 / p->hz : 0;
+
+	sbprintf(buf, "%.2fs, %d threads, %.0f Mcycles/s\n", p->time, p->threads, p->hz / 1000000);
+	sbprintf(buf, "%-8s %6s %10s %10s %9s\n", "phase", "share", "ms", "calls", "cyc/call");
+	for (int ph = UP_WALK; ph < UP_MAX; ph++)
+		sbprintf(buf, "%-8s %5.1f%% %10.1f %10llu %9llu\n", phase_names[ph],
+			 total ? p->cycles[ph] * 100.0 / total : 0, p->cycles[ph] * ms,
+			 (unsigned long long)p->calls[ph],
+			 (unsigned long long)(p->calls[ph] ? p->cycles[ph] / p->calls[ph] : 0));
+	if (p->async_calls)
+		sbprintf(buf, "%-8s %6s %10.1f %10llu %9llu\n", "dcnn-bg", "",
+			 p->async_cycles * ms, (unsigned long long)p->async_calls,
+			 (unsigned long long)(p->async_cycles / p->async_calls));
+	buf->cur[-1] = 0;  /* remove last \n */
+	return buf->str;
+}
+
+void
+uct_profile_json(FILE *f, struct uct_profile *p)
+{
+	double ms = p->hz > 0 ? 1000 / p->hz : 0;
+	fprintf(f, "{\"time\": %.3f, \"threads\": %d", p->time, p->threads);
+	for (int ph = UP_WALK; ph < UP_MAX; ph++)
+		fprintf(f, ", \"%s\": {\"ms\": %.1f, \"calls\": %llu}", phase_names[ph],
+			p->cycles[ph] * ms, (unsigned long long)p->calls[ph]);
+	if (p->async_calls)
+		fprintf(f, ", \"dcnn-bg\": {\"ms\": %.1f, \"calls\": %llu}",
+			p->async_cycles * ms, (unsigned long long)p->async_calls);
+	fprintf(f, "}");
+}
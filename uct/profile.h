@@ -0,0 +1,141 @@
+#ifndef PACHI_UCT_PROFILE_H
+#define PACHI_UCT_PROFILE_H
+
+/* Per-phase search profiler: each search thread charges the cycles
+ * spent in the main parts of a playout (tree descent, expansion,
+ * random game, ...) to its own counters, summed up when the search
+ * ends. Shown by the pachi-profile gtp command and in the final json
+ * progress line. Build with NO_SEARCH_PROFILE=1 to compile it out. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "uct/tree.h"
+
+#ifndef NO_SEARCH_PROFILE
+#define SEARCH_PROFILE
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/* Phases are exclusive: time spent in a nested phase (say uct_prior()
+ * within tree_expand_node()) is not counted in the outer one. */
+enum uct_phase {
+	UP_IDLE,	/* Outside of a playout, not reported. */
+	UP_WALK,	/* Rest of the tree walk: amaf map, virtual loss, stats. */
+	UP_DESCENT,	/* Choosing the child to descend to. */
+	UP_PLAY,	/* board_play() along the tree path. */
+	UP_EXPAND,	/* tree_expand_node(), without the priors. */
+	UP_PRIOR,	/* uct_prior(), without dcnn. */
+	UP_DCNN,	/* dcnn evaluation, synchronous or in the evaluator thread. */
+	UP_PLAYOUT,	/* play_random_game() */
+	UP_UPDATE,	/* Policy update of the tree path. */
+	UP_LTREE,	/* Local tree sequence recording. */
+	UP_MAX,
+};
+
+struct uct_profile {
+	uint64_t cycles[UP_MAX];
+	uint64_t calls[UP_MAX];
+	/* Cycles of the dcnn evaluator thread, which runs alongside
+	 * the search threads. */
+	uint64_t async_cycles, async_calls;
+	int threads;	/* Threads which did any playouts. */
+	double time;	/* Wall time of the search. */
+	double hz;	/* Cycle counter frequency. */
+};
+
+#ifdef SEARCH_PROFILE
+
+/* One slot per thread, set up by uct_profile_thread(): 0 for the main
+ * thread, tid + 1 for search threads (like tree arenas), then one each
+ * for the thread manager, the background gc and the dcnn evaluator. */
+#define UCT_PROFILE_MANAGER_SLOT TREE_ARENAS
+#define UCT_PROFILE_GC_SLOT (TREE_ARENAS + 1)
+#define UCT_PROFILE_ASYNC_SLOT (TREE_ARENAS + 2)
+#define UCT_PROFILE_SLOTS (TREE_ARENAS + 3)
+
+struct uct_profile_slot {
+	uint64_t cycles[UP_MAX];
+	uint64_t calls[UP_MAX];
+	uint64_t last;
+	int phase;
+} __attribute__((aligned(64)));
+
+extern struct uct_profile_slot uct_profile_slots[UCT_PROFILE_SLOTS];
+extern __thread int uct_profile_slot;
+
+static inline uint64_t
+uct_profile_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Switch the calling thread to phase @ph, charging the cycles since
+ * its last switch to the phase it was in. Returns that phase, to be
+ * passed to uct_profile_leave() when @ph is over. */
+static inline int
+uct_profile_enter(enum uct_phase ph)
+{
+	struct uct_profile_slot *s = &uct_profile_slots[uct_profile_slot];
+	uint64_t now = uct_profile_ticks();
+	s->cycles[s->phase] += now - s->last;
+	s->last = now;
+	s->calls[ph]++;
+	int prev = s->phase;
+	s->phase = ph;
+	return prev;
+}
+
+static inline void
+uct_profile_leave(int ph)
+{
+	struct uct_profile_slot *s = &uct_profile_slots[uct_profile_slot];
+	uint64_t now = uct_profile_ticks();
+	s->cycles[s->phase] += now - s->last;
+	s->last = now;
+	s->phase = ph;
+}
+
+static inline void
+uct_profile_thread(int slot)
+{
+	uct_profile_slot = slot;
+}
+
+/* Reset the counters when a search starts, sum them up when it ends.
+ * The thread manager calls uct_profile_stop() holding the search lock,
+ * see uct_search_profile(). */
+void uct_profile_start(void);
+void uct_profile_stop(void);
+
+#else
+
+#define uct_profile_enter(ph) UP_IDLE
+#define uct_profile_leave(ph) ((void)(ph))
+#define uct_profile_thread(slot)
+#define uct_profile_start()
+#define uct_profile_stop()
+
+#endif
+
+/* Copy the profile of the last search to @p, false if there is none.
+ * Use uct_search_profile() unless holding the search lock. */
+bool uct_profile_last(struct uct_profile *p);
+/* Human readable table of @p, for the pachi-profile gtp command. */
+char *uct_profile_str(struct uct_profile *p);
+/* @p as a json object, for the json progress reporter. */
+void uct_profile_json(FILE *f, struct uct_profile *p);
+
+#endif
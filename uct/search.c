@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #define DEBUG
 
@@ -17,10 +18,13 @@
 #include "timeinfo.h"
 #include "uct/dynkomi.h"
 #include "uct/internal.h"
+#include "uct/prior.h"
+#include "uct/profile.h"
 #include "uct/search.h"
 #include "uct/tree.h"
 #include "uct/uct.h"
 #include "uct/walk.h"
+#include "dcnn.h"
 
 
 /* Default time settings for the UCT engine. In distributed mode, slaves are
@@ -60,13 +64,14 @@ static const struct time_info unlimited_ti = {
  *   |         starts and stops the search managed by thread_manager
  *   |
  * thread_manager
- *   |         spawns and collects worker threads
+ *   |         wakes up and collects worker threads
  *   |
  * worker0
  * worker1
  * ...
  * workerK
- *             uct_playouts() loop, doing descend-playout until uct_halt
+ *             uct_playouts() loop, doing descend-playout until uct_halt;
+ *             the workers are created once and park between searches
  *
  * Another way to look at it is by functions (lines denote thread boundaries):
  *
@@ -75,7 +80,7 @@ static const struct time_info unlimited_ti = {
  * | -----------------------
  * | spawn_thread_manager()
  * | -----------------------
- * | spawn_worker()
+ * | worker_loop(), run_worker()
  * V uct_playouts() */
 
 /* Set in thread manager in case the workers should stop. */
@@ -89,21 +94,139 @@ static pthread_cond_t finish_cond = PTHREAD_COND_INITIALIZER;
 static volatile int finish_thread;
 static pthread_mutex_t finish_serializer = PTHREAD_MUTEX_INITIALIZER;
 
-static void *
-spawn_worker(void *ctx_)
+/* Worker pool: worker threads are created on first use and then
+ * park in worker_loop() until the thread manager hands them a job. */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct uct_thread_ctx *pool_job[TREE_ARENAS];
+static int pool_size;
+
+static void
+run_worker(struct uct_thread_ctx *ctx, struct board *b2)
 {
-	struct uct_thread_ctx *ctx = ctx_;
 	/* Setup */
 	fast_srandom(ctx->seed);
 	/* Run */
-	ctx->games = uct_playouts(ctx->u, ctx->b, ctx->color, ctx->t, ctx->ti);
+	ctx->games = uct_playouts(ctx->u, ctx->b, ctx->color, ctx->t, ctx->ti, b2);
 	/* Finish */
 	pthread_mutex_lock(&finish_serializer);
 	pthread_mutex_lock(&finish_mutex);
 	finish_thread = ctx->tid;
 	pthread_cond_signal(&finish_cond);
 	pthread_mutex_unlock(&finish_mutex);
-	return ctx;
+}
+
+static void *
+worker_loop(void *arg)
+{
+	int tid = (intptr_t)arg;
+	tree_arena_slot = tid + 1;
+	uct_profile_thread(tid + 1);
+	/* Scratch board, kept warm between searches. */
+	struct board *b2 = NULL;
+	while (true) {
+		pthread_mutex_lock(&pool_mutex);
+		while (!pool_job[tid])
+			pthread_cond_wait(&pool_cond, &pool_mutex);
+		struct uct_thread_ctx *ctx = pool_job[tid];
+		pool_job[tid] = NULL;
+		pthread_mutex_unlock(&pool_mutex);
+
+		if (b2 && b2->size != ctx->b->size) {
+			board_done_noalloc(b2);
+			free(b2);
+			b2 = NULL;
+		}
+		if (!b2)
+			b2 = board_copy(malloc2(sizeof(*b2)), ctx->b);
+		run_worker(ctx, b2);
+	}
+	return NULL;
+}
+
+/* Set @a to pin worker @tid to the tid-th cpu we may run on, wrapping
+ * around. Returns false if the workers cannot be pinned. */
+static bool
+pin_worker(pthread_attr_t *a, int tid)
+{
+#ifdef __linux__
+	cpu_set_t allowed, cpus;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) || !CPU_COUNT(&allowed))
+		return false;
+	int cpu = -1;
+	for (int i = tid % CPU_COUNT(&allowed); i >= 0; i--)
+		do cpu++; while (!CPU_ISSET(cpu, &allowed));
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	return !pthread_attr_setaffinity_np(a, sizeof(cpus), &cpus);
+#else
+	return false;
+#endif
+}
+
+/* Make sure we have u->threads workers. */
+static void
+pool_grow(struct uct *u)
+{
+	for (; pool_size < u->threads; pool_size++) {
+		pthread_t thread;
+		pthread_attr_t a;
+		pthread_attr_init(&a);
+		pthread_attr_setstacksize(&a, 1048576);
+		bool pinned = u->pin_threads && pin_worker(&a, pool_size);
+		if (pthread_create(&thread, &a, worker_loop, (void *)(intptr_t)pool_size)) {
+			if (!pinned)
+				die("pthread_create() failed\n");
+			/* Not allowed to run there after all. */
+			fprintf(stderr, "Warning: cannot pin search threads, turned off.\n");
+			u->pin_threads = false;
+			pthread_attr_destroy(&a);
+			pthread_attr_init(&a);
+			pthread_attr_setstacksize(&a, 1048576);
+			if (pthread_create(&thread, &a, worker_loop, (void *)(intptr_t)pool_size))
+				die("pthread_create() failed\n");
+		}
+		pthread_attr_destroy(&a);
+		pthread_detach(thread);
+		if (UDEBUGL(4))
+			fprintf(stderr, "Spawned worker %d\n", pool_size);
+	}
+}
+
+/* Threads per tree in current thread model. */
+static int
+group_threads(struct uct *u)
+{
+	switch (u->thread_model) {
+		case TM_ROOT:   return 1;
+		case TM_HYBRID: return u->group_threads;
+		default:        return u->threads;
+	}
+}
+
+int
+uct_thread_groups(struct uct *u)
+{
+	int gsize = group_threads(u);
+	return (u->threads + gsize - 1) / gsize;
+}
+
+/* Private tree for a thread group, searching the same position as @t. */
+static struct tree *
+group_tree_init(struct uct *u, struct tree *t, struct board *b, enum stone color)
+{
+	struct tree *gt = tree_init(b, color, u->fast_alloc ? u->max_tree_size : 0,
+				    u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, 0,
+				    u->dag_hbits);
+	gt->merge_to = t;
+	/* Same root move, children need it for their cfg distance. */
+	gt->root->coord = t->root->coord;
+	gt->root->depth = t->root->depth;
+	gt->use_extra_komi = t->use_extra_komi;
+	gt->extra_komi = t->extra_komi;
+	gt->root->is_expanded = true;
+	tree_expand_node(gt, gt->root, b, color, u, 1);
+	return gt;
 }
 
 /* Thread manager, controlling worker threads. It must be called with
@@ -124,14 +247,22 @@ spawn_thread_manager(void *ctx_)
 	fast_srandom(mctx->seed);
 
 	int played_games = 0;
-	pthread_t threads[u->threads];
+	struct uct_thread_ctx ctxs[u->threads];
 	int joined = 0;
 
+	uct_profile_thread(UCT_PROFILE_MANAGER_SLOT);
 	uct_halt = 0;
-
-	/* Garbage collect the tree by preference when pondering. */
-	if (u->pondering && t->nodes && t->nodes_size >= t->pruning_threshold) {
-		t->root = tree_garbage_collect(t, t->root);
+	uct_profile_start();
+
+	/* Garbage collect the tree by preference when pondering, this
+	 * costs us nothing and can be interrupted by uct_pondering_stop().
+	 * On our own time, only if we run out of memory and within
+	 * the gc_budget. */
+	if (t->nodes && t->gc_pending) {
+		if (u->pondering)
+			t->root = tree_garbage_collect(t, t->root, 0);
+		else if (tree_nodes_size(t) >= t->pruning_threshold)
+			t->root = tree_garbage_collect(t, t->root, u->gc_budget);
 	}
 
 	/* Make sure the root node is expanded. */
@@ -143,22 +274,35 @@ spawn_thread_manager(void *ctx_)
 		
 		if (tree_leaf_node(n) && !__sync_lock_test_and_set(&n->is_expanded, 1))
 			tree_expand_node(t, n, mctx->b, player_color, u, 1);
+		uct_prior_dcnn_root(u, t, mctx->b, player_color);
 	}
+
+	/* Root / hybrid thread models: all thread groups but the
+	 * first one search trees of their own. These only live for
+	 * one search: all they found is merged into the main tree,
+	 * which is kept for the next move, while keeping them too
+	 * would mean pruning each of them after every move. */
+	int gsize = group_threads(u);
+	int groups = uct_thread_groups(u);
+	struct tree *gtrees[groups];
+	gtrees[0] = t;
+	for (int g = 1; g < groups; g++)
+		gtrees[g] = group_tree_init(u, t, mctx->b, mctx->color);
 	
-	/* Spawn threads... */
+	/* Wake up workers... */
+	pool_grow(u);
+	pthread_mutex_lock(&pool_mutex);
 	for (int ti = 0; ti < u->threads; ti++) {
-		struct uct_thread_ctx *ctx = malloc2(sizeof(*ctx));
+		struct uct_thread_ctx *ctx = &ctxs[ti];
 		ctx->u = u; ctx->b = mctx->b; ctx->color = mctx->color;
-		mctx->t = ctx->t = t;
+		mctx->t = t;
+		ctx->t = gtrees[ti / gsize];
 		ctx->tid = ti; ctx->seed = fast_random(65536) + ti;
 		ctx->ti = mctx->ti;
-		pthread_attr_t a;
-		pthread_attr_init(&a);
-		pthread_attr_setstacksize(&a, 1048576);
-		pthread_create(&threads[ti], &a, spawn_worker, ctx);
-		if (UDEBUGL(4))
-			fprintf(stderr, "Spawned worker %d\n", ti);
+		pool_job[ti] = ctx;
 	}
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_mutex);
 
 	/* ...and collect them back: */
 	while (joined < u->threads) {
@@ -176,18 +320,25 @@ spawn_thread_manager(void *ctx_)
 			continue;
 		}
 		/* ...and gather its remnants. */
-		struct uct_thread_ctx *ctx;
-		pthread_join(threads[finish_thread], (void **) &ctx);
-		played_games += ctx->games;
+		played_games += ctxs[finish_thread].games;
 		joined++;
-		free(ctx);
 		if (UDEBUGL(4))
 			fprintf(stderr, "Joined worker %d\n", finish_thread);
 		pthread_mutex_unlock(&finish_serializer);
 	}
 
+	/* No dcnn results must come back once the search is over,
+	 * the tree may change. */
+	dcnn_async_flush();
+	uct_profile_stop();
+
 	pthread_mutex_unlock(&finish_mutex);
 
+	for (int g = 1; g < groups; g++) {
+		tree_merge(t, gtrees[g], u->merge_depth, true);
+		tree_done(gtrees[g]);
+	}
+
 	mctx->games = played_games;
 	return mctx;
 }
@@ -198,10 +349,63 @@ spawn_thread_manager(void *ctx_)
 /*** Search infrastructure: */
 
 
+volatile int uct_wake_games = INT_MAX;
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static bool wake_pending;
+
+void
+uct_search_wake(void)
+{
+	pthread_mutex_lock(&wake_mutex);
+	uct_wake_games = INT_MAX;
+	wake_pending = true;
+	pthread_cond_signal(&wake_cond);
+	pthread_mutex_unlock(&wake_mutex);
+}
+
+void
+uct_search_wait(struct uct_search_state *s, struct time_info *ti, int i)
+{
+	double timeout = TREE_BUSYWAIT_INTERVAL;
+	int games = INT_MAX;
+	if (ti->dim == TD_WALLTIME) {
+		/* Wake up just past the next time limit. */
+		double elapsed = time_now() - ti->len.t.timer_start;
+		double next = (elapsed <= s->stop.desired.time ? s->stop.desired.time : s->stop.worst.time);
+		if (next > elapsed && next - elapsed + 0.001 < timeout)
+			timeout = next - elapsed + 0.001;
+	} else {
+		if (i <= s->stop.desired.playouts)
+			games = s->stop.desired.playouts + 1;
+		else if (i <= s->stop.worst.playouts)
+			games = s->stop.worst.playouts + 1;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	double sec;
+	ts.tv_nsec += (long)(modf(timeout, &sec) * 1000000000.0);
+	ts.tv_sec += (time_t)sec + ts.tv_nsec / 1000000000;
+	ts.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&wake_mutex);
+	wake_pending = false;
+	uct_wake_games = games;
+	/* Threads check root playouts after each simulation. */
+	if (node_u(s->ctx->t->root).playouts < games)
+		while (!wake_pending)
+			if (pthread_cond_timedwait(&wake_cond, &wake_mutex, &ts))
+				break;
+	uct_wake_games = INT_MAX;
+	pthread_mutex_unlock(&wake_mutex);
+}
+
+
 int
 uct_search_games(struct uct_search_state *s)
 {
-	return s->ctx->t->root->u.playouts;
+	return node_u(s->ctx->t->root).playouts;
 }
 
 void
@@ -210,7 +414,7 @@ uct_search_start(struct uct *u, struct board *b, enum stone color,
 		 struct uct_search_state *s)
 {
 	/* Set up search state. */
-	s->base_playouts = s->last_dynkomi = s->last_print = t->root->u.playouts;
+	s->base_playouts = s->last_dynkomi = s->last_print = node_u(t->root).playouts;
 	s->print_interval = u->reportfreq;
 	s->fullmem = false;
 
@@ -239,6 +443,16 @@ uct_search_start(struct uct *u, struct board *b, enum stone color,
 	thread_manager_running = true;
 }
 
+bool
+uct_search_profile(struct uct_profile *p)
+{
+	/* The thread manager sums it up holding finish_mutex. */
+	pthread_mutex_lock(&finish_mutex);
+	bool have = uct_profile_last(p);
+	pthread_mutex_unlock(&finish_mutex);
+	return have;
+}
+
 struct uct_thread_ctx *
 uct_search_stop(void)
 {
@@ -284,10 +498,12 @@ uct_search_progress(struct uct *u, struct board *b, enum stone color,
 		uct_progress_status(u, ctx->t, color, s->last_print, NULL);
 	}
 
-	if (!s->fullmem && ctx->t->nodes_size > u->max_tree_size) {
-		if (UDEBUGL(2))
-			fprintf(stderr, "memory limit hit (%lu > %lu)\n",
-				ctx->t->nodes_size, u->max_tree_size);
+	if (!s->fullmem && tree_full(ctx->t, u->max_tree_size)) {
+		if (UDEBUGL(2)) {
+			fprintf(stderr, "memory limit hit (%lu/%lu)\n",
+				tree_nodes_size(ctx->t), u->max_tree_size);
+			tree_pool_stats(ctx->t, stderr);
+		}
 		s->fullmem = true;
 	}
 }
@@ -328,19 +544,19 @@ uct_search_stop_early(struct uct *u, struct tree *t, struct board *b,
 		double remaining = stop->worst.time - elapsed;
 		double pps = ((double)played) / elapsed;
 		double estplayouts = remaining * pps + PLAYOUT_DELTA_SAFEMARGIN;
-		if (best->u.playouts > best2->u.playouts + estplayouts) {
+		if (node_u(best).playouts > node_u(best2).playouts + estplayouts) {
 			if (UDEBUGL(2))
 				fprintf(stderr, "Early stop, result cannot change: "
 					"best %d, best2 %d, estimated %f simulations to go (%d/%f=%f pps)\n",
-					best->u.playouts, best2->u.playouts, estplayouts, played, elapsed, pps);
+					node_u(best).playouts, node_u(best2).playouts, estplayouts, played, elapsed, pps);
 			return true;
 		}
 	}
 
 	/* Early break in won situation. */
-	if (best->u.playouts >= PLAYOUT_EARLY_BREAK_MIN
+	if (node_u(best).playouts >= PLAYOUT_EARLY_BREAK_MIN
 	    && (ti->dim != TD_WALLTIME || elapsed > TIME_EARLY_BREAK_MIN)
-	    && tree_node_get_value(t, 1, best->u.value) >= u->sure_win_threshold) {
+	    && tree_node_get_value(t, 1, node_u(best).value) >= u->sure_win_threshold) {
 		return true;
 	}
 
@@ -362,7 +578,7 @@ uct_search_keep_looking(struct uct *u, struct tree *t, struct board *b,
 
 	/* Do not waste time if we are winning. Spend up to worst time if
 	 * we are unsure, but only desired time if we are sure of winning. */
-	floating_t beta = 2 * (tree_node_get_value(t, 1, best->u.value) - 0.5);
+	floating_t beta = 2 * (tree_node_get_value(t, 1, node_u(best).value) - 0.5);
 	if (ti->dim == TD_WALLTIME && beta > 0) {
 		double good_enough = stop->desired.time * beta + stop->worst.time * (1 - beta);
 		double elapsed = time_now() - ti->len.t.timer_start;
@@ -373,11 +589,11 @@ uct_search_keep_looking(struct uct *u, struct tree *t, struct board *b,
 		/* Check best/best2 simulations ratio. If the
 		 * two best moves give very similar results,
 		 * keep simulating. */
-		if (best2 && best2->u.playouts
-		    && (double)best->u.playouts / best2->u.playouts < u->best2_ratio) {
+		if (best2 && node_u(best2).playouts
+		    && (double)node_u(best).playouts / node_u(best2).playouts < u->best2_ratio) {
 			if (UDEBUGL(3))
 				fprintf(stderr, "Best2 ratio %f < threshold %f\n",
-					(double)best->u.playouts / best2->u.playouts,
+					(double)node_u(best).playouts / node_u(best2).playouts,
 					u->best2_ratio);
 			return true;
 		}
@@ -387,11 +603,11 @@ uct_search_keep_looking(struct uct *u, struct tree *t, struct board *b,
 		/* Check best, best_best value difference. If the best move
 		 * and its best child do not give similar enough results,
 		 * keep simulating. */
-		if (bestr && bestr->u.playouts
-		    && fabs((double)best->u.value - bestr->u.value) > u->bestr_ratio) {
+		if (bestr && node_u(bestr).playouts
+		    && fabs((double)node_u(best).value - node_u(bestr).value) > u->bestr_ratio) {
 			if (UDEBUGL(3))
 				fprintf(stderr, "Bestr delta %f > threshold %f\n",
-					fabs((double)best->u.value - bestr->u.value),
+					fabs((double)node_u(best).value - node_u(bestr).value),
 					u->bestr_ratio);
 			return true;
 		}
@@ -403,9 +619,9 @@ uct_search_keep_looking(struct uct *u, struct tree *t, struct board *b,
 		if (UDEBUGL(3))
 			fprintf(stderr, "[%d] best %3s [%d] %f != winner %3s [%d] %f\n", i,
 				coord2sstr(node_coord(best), t->board),
-				best->u.playouts, tree_node_get_value(t, 1, best->u.value),
+				node_u(best).playouts, tree_node_get_value(t, 1, node_u(best).value),
 				coord2sstr(node_coord(winner), t->board),
-				winner->u.playouts, tree_node_get_value(t, 1, winner->u.value));
+				node_u(winner).playouts, tree_node_get_value(t, 1, node_u(winner).value));
 		return true;
 	}
 
@@ -490,19 +706,19 @@ uct_search_result(struct uct *u, struct board *b, enum stone color,
 	if (UDEBUGL(1))
 		fprintf(stderr, "*** WINNER is %s (%d,%d) with score %1.4f (%d/%d:%d/%d games), extra komi %f\n",
 			coord2sstr(node_coord(best), b), coord_x(node_coord(best), b), coord_y(node_coord(best), b),
-			tree_node_get_value(u->t, 1, best->u.value), best->u.playouts,
-			u->t->root->u.playouts, u->t->root->u.playouts - base_playouts, played_games,
+			tree_node_get_value(u->t, 1, node_u(best).value), node_u(best).playouts,
+			node_u(u->t->root).playouts, node_u(u->t->root).playouts - base_playouts, played_games,
 			u->t->extra_komi);
 
 	/* Do not resign if we're so short of time that evaluation of best
 	 * move is completely unreliable, we might be winning actually.
 	 * In this case best is almost random but still better than resign. */
-	if (tree_node_get_value(u->t, 1, best->u.value) < u->resign_threshold
+	if (tree_node_get_value(u->t, 1, node_u(best).value) < u->resign_threshold
 	    && !is_pass(node_coord(best))
 	    // If only simulated node has been a pass and no other node has
 	    // been simulated but pass won't win, an unsimulated node has
 	    // been returned; test therefore also for #simulations at root.
-	    && (best->u.playouts > GJ_MINGAMES || u->t->root->u.playouts > GJ_MINGAMES * 2)
+	    && (node_u(best).playouts > GJ_MINGAMES || node_u(u->t->root).playouts > GJ_MINGAMES * 2)
 	    && !u->t->untrustworthy_tree) {
 		*best_coord = resign;
 		return NULL;
@@ -520,7 +736,7 @@ uct_search_result(struct uct *u, struct board *b, enum stone color,
 					(score > 0 ? "B+" : "W+"), fabs(score));
 			}
 			*best_coord = pass;
-			best = u->t->root->children; // pass is the first child
+			best = node_children(u->t->root); // pass is the first child
 			assert(is_pass(node_coord(best)));
 			return best;
 		}
@@ -26,11 +26,24 @@ struct tree_node;
  * stop, progress reports, etc. (in seconds) */
 #define TREE_BUSYWAIT_INTERVAL 0.1 /* 100ms */
 
+/* How often a thread group merges its tree into the main tree in the root
+ * and hybrid thread models (in playouts of one of its threads). */
+#define TREE_MERGE_INTERVAL 256
+
 
 /* Thread manager state */
 extern volatile sig_atomic_t uct_halt;
 extern bool thread_manager_running;
 
+/* Root playouts at which search threads wake up the main thread
+ * waiting in uct_search_wait() (INT_MAX if nobody waits). */
+extern volatile int uct_wake_games;
+void uct_search_wake(void);
+
+/* Number of trees searched in parallel, one per thread group
+ * in the root / hybrid thread models, 1 otherwise. */
+int uct_thread_groups(struct uct *u);
+
 /* Search thread context */
 struct uct_thread_ctx {
 	int tid;
@@ -68,6 +81,11 @@ int uct_search_games(struct uct_search_state *s);
 void uct_search_start(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, struct uct_search_state *s);
 struct uct_thread_ctx *uct_search_stop(void);
 
+/* Wait until the next search check is due: TREE_BUSYWAIT_INTERVAL at most,
+ * less if a time limit comes earlier, and until the search threads reach
+ * the next playouts limit with TD_GAMES. @i are the root playouts now. */
+void uct_search_wait(struct uct_search_state *s, struct time_info *ti, int i);
+
 void uct_search_progress(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, struct uct_search_state *s, int i);
 
 bool uct_search_check_stop(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, struct uct_search_state *s, int i);
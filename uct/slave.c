@@ -128,8 +128,8 @@ tree_find_node(struct tree *t, struct incr_stats *is, struct tree_node *prev)
 	if (parent) {
 		/* Search for the node in parent's children. */
 		coord_t leaf = leaf_coord(path, t->board);
-		node = (prev && prev->parent == parent ? prev->sibling : parent->children);
-		while (node && node_coord(node) != leaf) node = node->sibling;
+		node = (prev && node_parent(prev) == parent ? node_sibling(prev) : node_children(parent));
+		while (node && node_coord(node) != leaf) node = node_sibling(node);
 
 		if (DEBUG_MODE) parent_leaf += !parent->is_expanded;
 	} else {
@@ -233,7 +233,7 @@ receive_stats(struct uct *u, int size)
 		if (!node) continue;
 
 		/* node_total += others_incr */
-		stats_add_result(&node->u, is.incr.value, is.incr.playouts);
+		stats_add_result(&node_u(node), is.incr.value, is.incr.playouts);
 
 		/* last_total += others_incr */
 		stats_add_result(&node->pu, is.incr.value, is.incr.playouts);
@@ -272,12 +272,12 @@ append_stats(struct stats_candidate *stats_queue, struct tree_node *node, int st
 {
 	/* The children field is set only after all children are created
 	 * so we can traverse the the tree while it is updated. */
-	for (struct tree_node *ni = node->children; ni; ni = ni->sibling) {
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni)) {
 
 		if (is_pass(node_coord(ni))) continue;
 		if (ni->hints & TREE_HINT_INVALID) continue;
 
-		int incr = ni->u.playouts - ni->pu.playouts;
+		int incr = stats_get(&node_u(ni)).playouts - ni->pu.playouts;
 		if (incr < min_increment) continue;
 
 		/* min_increment should be tuned to avoid overflow. */
@@ -339,16 +339,17 @@ select_best_stats(struct stats_candidate *stats_queue, int stats_count,
 		if (delta < 0 || (delta == 0 && --min_count < 0)) continue;
 
 		struct tree_node *node = stats_queue[count].node;
-		os->incr = node->u;
+		struct move_stats now = stats_get(&node_u(node));
+		os->incr = now;
 		stats_rm_result(&os->incr, node->pu.value, node->pu.playouts);
 
 		/* With virtual loss os->incr.playouts might be <= 0; we only
 		 * send positive increments to other slaves so a virtual loss
 		 * can be propagated to other machines (good). The undo of the
-		 * virtual loss will be propagated later when node->u gets
+		 * virtual loss will be propagated later when node_u(node) gets
 		 * above node->pu. */
 		if (os->incr.playouts > 0) {
-			node->pu = node->u;
+			node->pu = now;
 			os->coord_path = stats_queue[count].coord_path;
 			assert(os->coord_path > 0);
 			os++;
@@ -408,14 +409,15 @@ report_incr_stats(struct uct *u, int *stats_size)
 				   max_parent_path(u, b), min_increment, b);
 
 	void *buf = select_best_stats(stats_queue, stats_count, u->shared_nodes, stats_size);
+	struct move_stats now = stats_get(&node_u(root));
 
 	if (DEBUGVV(2))
 		fprintf(stderr,
 			"min_incr %d games %d stats_queue %d/%d sending %d/%d in %.3fms\n",
-			min_increment, root->u.playouts - root->pu.playouts, stats_count,
+			min_increment, now.playouts - root->pu.playouts, stats_count,
 			max_nodes, *stats_size / (int)sizeof(struct incr_stats), u->shared_nodes,
 			(time_now() - start_time)*1000);
-	root->pu = root->u;
+	root->pu = now;
 	return buf;
 }
 
@@ -436,23 +438,24 @@ report_stats(struct uct *u, struct board *b, coord_t c,
 	char *r = reply;
 	char *end = reply + sizeof(reply);
 	struct tree_node *root = u->t->root;
-	r += snprintf(r, end - r, "%d %d %d %d @%d", u->played_own, root->u.playouts,
+	r += snprintf(r, end - r, "%d %d %d %d @%d", u->played_own, node_u(root).playouts,
 		      u->threads, keep_looking, bin_size);
-	int min_playouts = root->u.playouts / 100;
+	int min_playouts = node_u(root).playouts / 100;
 	if (min_playouts < GJ_MINGAMES)
 		min_playouts = GJ_MINGAMES;
 	int max_playouts = 1;
 
 	/* We rely on the fact that root->children is set only
 	 * after all children are created. */
-	for (struct tree_node *ni = root->children; ni; ni = ni->sibling) {
+	for (struct tree_node *ni = node_children(root); ni; ni = node_sibling(ni)) {
 
 		if (is_pass(node_coord(ni))) continue;
 		assert(node_coord(ni) > 0 && node_coord(ni) < board_size2(b));
 
-		if (ni->u.playouts > max_playouts)
-			max_playouts = ni->u.playouts;
-		if (ni->u.playouts <= min_playouts || ni->hints & TREE_HINT_INVALID)
+		struct move_stats u_ni = stats_get(&node_u(ni));
+		if (u_ni.playouts > max_playouts)
+			max_playouts = u_ni.playouts;
+		if (u_ni.playouts <= min_playouts || ni->hints & TREE_HINT_INVALID)
 			continue;
 		/* A book move is only added at the end: */
 		if (node_coord(ni) == c) continue;
@@ -460,7 +463,7 @@ report_stats(struct uct *u, struct board *b, coord_t c,
 		char buf[4];
 		/* We return the values as stored in the tree, so from black's view. */
 		r += snprintf(r, end - r, "\n%s %d %.16f", coord2bstr(buf, node_coord(ni), b),
-			      ni->u.playouts, ni->u.value);
+			      u_ni.playouts, u_ni.value);
 	}
 	/* Give a large but not infinite weight to pass, resign or book move, to avoid
 	 * forcing resign if other slaves don't like it. */
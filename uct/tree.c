@@ -5,6 +5,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 
 #define DEBUG
 #include "board.h"
@@ -16,44 +25,429 @@
 #include "timeinfo.h"
 #include "uct/internal.h"
 #include "uct/prior.h"
+#include "uct/profile.h"
 #include "uct/tree.h"
 #include "uct/slave.h"
 
 
-/* Allocate tree node(s). The returned nodes are initialized with zeroes.
- * Returns NULL if not enough memory.
+__thread int tree_arena_slot = 0;
+
+enum tree_pages tree_pages = TREE_PAGES_DEFAULT;
+int tree_numa = TREE_NUMA_DEFAULT;
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#ifdef __linux__
+/* Mask of online NUMA nodes, 0 if unknown. */
+static unsigned long
+numa_online_nodes(void)
+{
+	FILE *f = fopen("/sys/devices/system/node/online", "r");
+	if (!f)
+		return 0;
+	unsigned long mask = 0;
+	int a, b, c;
+	/* Format is like "0-3,8" */
+	while (fscanf(f, "%d", &a) == 1) {
+		b = a;
+		c = fgetc(f);
+		if (c == '-' && fscanf(f, "%d", &b) == 1)
+			c = fgetc(f);
+		for (int i = a; i <= b && i < 64; i++)
+			mask |= 1UL << i;
+		if (c != ',')
+			break;
+	}
+	fclose(f);
+	return mask;
+}
+#endif
+
+/* Allocate the nodes buffer for fast_alloc, with the page size and
+ * NUMA placement given by tree_pages and tree_numa. Memory is mapped
+ * but not touched, pages are placed as search threads fault them in.
+ * Sets t->nodes_mapped to the mapped length, 0 if we used malloc. */
+static void *
+tree_pool_alloc(struct tree *t, size_t size)
+{
+#ifdef __linux__
+	if (tree_pages == TREE_PAGES_DEFAULT && tree_numa == TREE_NUMA_DEFAULT)
+		return malloc2(size);
+
+	size_t len = (size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+	void *p = MAP_FAILED;
+	t->pool_pages = TREE_PAGES_DEFAULT;
+	if (tree_pages == TREE_PAGES_HUGETLB) {
+		/* Fails unless enough pages are reserved in /proc/sys/vm/nr_hugepages. */
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			t->pool_pages = TREE_PAGES_HUGETLB;
+		else if (DEBUGL(1))
+			fprintf(stderr, "tree: no explicit huge pages (%s), trying transparent ones\n", strerror(errno));
+	}
+	if (p == MAP_FAILED) {
+		/* Align on a huge page boundary so that THP can back all of it. */
+		size_t maplen = len + HUGE_PAGE_SIZE;
+		char *m = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (m == MAP_FAILED)
+			die("tree: mmap(%lu): %s\n", (unsigned long) maplen, strerror(errno));
+		char *a = (char *) (((uintptr_t) m + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+		if (a > m)
+			munmap(m, a - m);
+		if (a + len < m + maplen)
+			munmap(a + len, m + maplen - (a + len));
+		p = a;
+		if (tree_pages != TREE_PAGES_DEFAULT) {
+			if (!madvise(p, len, MADV_HUGEPAGE))
+				t->pool_pages = TREE_PAGES_THP;
+			else if (DEBUGL(1))
+				fprintf(stderr, "tree: no transparent huge pages (%s)\n", strerror(errno));
+		}
+	}
+	t->nodes_mapped = len;
+
+	if (tree_numa != TREE_NUMA_DEFAULT) {
+		unsigned long mask = tree_numa == TREE_NUMA_INTERLEAVE ? numa_online_nodes() : 1UL << tree_numa;
+		int mode = tree_numa == TREE_NUMA_INTERLEAVE ? MPOL_INTERLEAVE : MPOL_BIND;
+		if (!mask || syscall(SYS_mbind, p, len, mode, &mask, sizeof(mask) * 8 + 1, 0))
+			fprintf(stderr, "tree: cannot set NUMA policy (%s)\n", mask ? strerror(errno) : "no nodes");
+	}
+	return p;
+#else
+	return malloc2(size);
+#endif
+}
+
+static void
+tree_pool_free(struct tree *t)
+{
+#ifdef __linux__
+	if (t->nodes_mapped) {
+		munmap(t->nodes, t->nodes_mapped);
+		return;
+	}
+#endif
+	free(t->nodes);
+}
+
+/* Print page size and NUMA placement of the nodes buffer: the
+ * policy and pages per NUMA node from /proc/self/numa_maps, and
+ * how much of it is backed by transparent huge pages. */
+void
+tree_pool_stats(struct tree *t, FILE *f)
+{
+	static const char *pages_str[] = { "default pages", "transparent huge pages", "explicit huge pages" };
+	if (!t->nodes)
+		return;
+	fprintf(f, "tree pool: %lu MiB, %s", t->max_tree_size / 1048576,
+		t->nodes_mapped ? pages_str[t->pool_pages] : "malloc");
+#ifdef __linux__
+	/* Find the mapping containing the buffer. */
+	unsigned long start = 0, end = 0, thp_kb = 0, pagesize_kb = 0;
+	char line[4096];
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	bool found = false;
+	while (smaps && fgets(line, sizeof(line), smaps)) {
+		unsigned long s, e;
+		if (sscanf(line, "%lx-%lx ", &s, &e) == 2) {
+			if (found)
+				break;
+			if ((unsigned long) t->nodes >= s && (unsigned long) t->nodes < e) {
+				found = true;
+				start = s; end = e;
+			}
+		} else if (found) {
+			sscanf(line, "AnonHugePages: %lu kB", &thp_kb);
+			sscanf(line, "KernelPageSize: %lu kB", &pagesize_kb);
+		}
+	}
+	if (smaps)
+		fclose(smaps);
+	if (found)
+		fprintf(f, ", mapping %lu MiB, page size %lu kB, %lu MiB in huge pages",
+			(end - start) / 1048576, pagesize_kb, thp_kb / 1024);
+
+	FILE *numa_maps = found ? fopen("/proc/self/numa_maps", "r") : NULL;
+	while (numa_maps && fgets(line, sizeof(line), numa_maps)) {
+		char *rest;
+		if (strtoul(line, &rest, 16) != start)
+			continue;
+		rest[strcspn(rest, "\n")] = 0;
+		fprintf(f, ", numa:%s", rest);
+		break;
+	}
+	if (numa_maps)
+		fclose(numa_maps);
+#endif
+	fprintf(f, "\n");
+}
+
+/* The tree heap holds all nodes which are not in the fast_alloc
+ * buffer. It is a single reservation of address space so that these
+ * nodes are close enough to each other for tree_ref_t; memory is
+ * committed as the heap grows. Freed blocks are kept in free lists
+ * by block length, linked through their first bytes. */
+struct tree_heap {
+	pthread_mutex_t lock;
+	char *base;
+	size_t reserved, committed, used;
+	void *free[BOARD_MAX_MOVES + 2];
+};
+
+#define TREE_HEAP_COMMIT (1 << 20)
+
+static void *
+tree_heap_reserve(size_t size)
+{
+#ifdef _WIN32
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	void *p = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+static bool
+tree_heap_commit(void *p, size_t size)
+{
+#ifdef _WIN32
+	return VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+	return !mprotect(p, size, PROT_READ | PROT_WRITE);
+#endif
+}
+
+static struct tree_heap *
+tree_heap_init(void)
+{
+	struct tree_heap *h = calloc2(1, sizeof(*h));
+	pthread_mutex_init(&h->lock, NULL);
+	/* Only address space, settle for less if we cannot get it all. */
+	size_t size = sizeof(size_t) > 4 ? TREE_REF_SPAN : (size_t) 1 << 30;
+	for (; !h->base && size >= 64 * TREE_HEAP_COMMIT; size /= 2)
+		if ((h->base = tree_heap_reserve(size)))
+			h->reserved = size;
+	if (!h->base)
+		die("tree: cannot reserve memory for the tree heap: %s\n", strerror(errno));
+	return h;
+}
+
+static void
+tree_heap_done(struct tree_heap *h)
+{
+#ifdef _WIN32
+	VirtualFree(h->base, 0, MEM_RELEASE);
+#else
+	munmap(h->base, h->reserved);
+#endif
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+/* Allocate a zeroed block of count nodes of nsize bytes in all.
+ * Exits the main program if the heap is full. */
+static void *
+tree_heap_alloc(struct tree_heap *h, int count, size_t nsize)
+{
+	assert(count < BOARD_MAX_MOVES + 2);
+	pthread_mutex_lock(&h->lock);
+	void *p = h->free[count];
+	if (p) {
+		h->free[count] = *(void **) p;
+		pthread_mutex_unlock(&h->lock);
+		memset(p, 0, nsize);
+		return p;
+	}
+	if (h->used + nsize > h->committed) {
+		size_t size = (h->used + nsize - h->committed + TREE_HEAP_COMMIT - 1) & ~(size_t) (TREE_HEAP_COMMIT - 1);
+		if (h->committed + size > h->reserved || !tree_heap_commit(h->base + h->committed, size))
+			die("tree: out of memory in the tree heap (%lu bytes used)\n", (unsigned long) h->used);
+		h->committed += size;
+	}
+	p = h->base + h->used;
+	h->used += nsize;
+	pthread_mutex_unlock(&h->lock);
+	return p;
+}
+
+static void
+tree_heap_free(struct tree_heap *h, void *p, int count)
+{
+	pthread_mutex_lock(&h->lock);
+	*(void **) p = h->free[count];
+	h->free[count] = p;
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* Map the first size bytes of file f at the top of the heap, private
+ * copy-on-write: its pages are only read in when touched. */
+static void *
+tree_heap_map(struct tree_heap *h, FILE *f, size_t size)
+{
+	pthread_mutex_lock(&h->lock);
+	size_t len = (size + TREE_HEAP_COMMIT - 1) & ~(size_t) (TREE_HEAP_COMMIT - 1);
+	if (h->committed + len > h->reserved)
+		die("tree: out of memory in the tree heap (%lu bytes used)\n", (unsigned long) h->used);
+	void *p = h->base + h->committed;
+#ifndef _WIN32
+	if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fileno(f), 0) == MAP_FAILED)
+		die("tree: cannot map tbook: %s\n", strerror(errno));
+	/* Commit the rest of the last chunk for the next allocations. */
+	size_t mapped = (size + getpagesize() - 1) & ~(size_t) (getpagesize() - 1);
+	if (mapped < len && !tree_heap_commit(p + mapped, len - mapped))
+		die("tree: out of memory in the tree heap (%lu bytes used)\n", (unsigned long) h->used);
+#else
+	if (!tree_heap_commit(p, len))
+		die("tree: out of memory in the tree heap (%lu bytes used)\n", (unsigned long) h->used);
+	rewind(f);
+	checked_fread(p, size, 1, f);
+#endif
+	h->committed += len;
+	h->used = h->committed - len + size;
+	pthread_mutex_unlock(&h->lock);
+	return p;
+}
+
+/* Take nsize bytes from the nodes buffer, through the arena of the
+ * calling thread. Returns NULL if not enough memory. */
+static void *
+tree_arena_alloc(struct tree *t, size_t nsize)
+{
+	assert(tree_arena_slot < TREE_ARENAS);
+	struct tree_arena *a = &t->arenas[tree_arena_slot];
+	if (unlikely(!a->next || nsize > (size_t) (a->end - a->next))) {
+		/* Refill. The rest of the current chunk is lost, this is
+		 * at most one block. Once the buffer is exhausted nodes_carved
+		 * may grow beyond max_tree_size, but it is reset at the next
+		 * garbage collection. */
+		size_t chunk = nsize > t->arena_chunk ? nsize : t->arena_chunk;
+		unsigned long old_size = __sync_fetch_and_add(&t->nodes_carved, chunk);
+		if (old_size + nsize > t->max_tree_size) {
+			t->nodes_full = true;
+			return NULL;
+		}
+		a->next = t->nodes + old_size;
+		a->end = t->nodes + (old_size + chunk < t->max_tree_size ? old_size + chunk : t->max_tree_size);
+	}
+	void *p = a->next;
+	a->next += nsize;
+	a->used += nsize;
+	return p;
+}
+
+/* Forget all nodes allocated from the nodes buffer. */
+static void
+tree_arenas_reset(struct tree *t)
+{
+	memset(t->arenas, 0, TREE_ARENAS * sizeof(*t->arenas));
+	t->nodes_carved = 0;
+	t->nodes_full = false;
+}
+
+/* Byte size of all allocated nodes. */
+unsigned long
+tree_nodes_size(struct tree *t)
+{
+	unsigned long size = t->nodes_size;
+	if (t->arenas)
+		for (int i = 0; i < TREE_ARENAS; i++)
+			size += t->arenas[i].used;
+	return size;
+}
+
+/* Bytes taken by a block of count nodes, see the layout in tree.h. */
+static size_t
+tree_block_size(struct tree *t, int count)
+{
+	size_t size = count * TREE_NODE_SIZE;
+	if (count > 1)
+		size += (board_size2(t->board) * sizeof(unsigned short) + TREE_REF_UNIT - 1) & ~(size_t) (TREE_REF_UNIT - 1);
+	return size;
+}
+
+/* Empty the index of the block of n. */
+static void
+tree_clear_index(struct tree *t, struct tree_node *n)
+{
+	if (n->bn > 1)
+		memset(tree_node_index(n), 0xff, board_size2(t->board) * sizeof(unsigned short));
+}
+
+/* Set the position of the count nodes starting at n within their
+ * block, the index of the block is empty. */
+static void
+tree_init_block(struct tree *t, struct tree_node *n, int count)
+{
+	for (int i = 0; i < count; i++) {
+		n[i].bi = i;
+		n[i].bn = count;
+	}
+	tree_clear_index(t, n);
+}
+
+/* Record the coord of n in the index of its block. */
+static void
+tree_index_node(struct tree_node *n)
+{
+	if (n->bn > 1 && !is_pass(node_coord(n)))
+		tree_node_index(n)[node_coord(n)] = n->bi;
+}
+
+/* Allocate a block of tree node(s) together with their u and amaf
+ * stats. The returned nodes are initialized with zeroes, except for
+ * their position within the block. Returns NULL if not enough memory.
  * This function may be called by multiple threads in parallel. */
 static struct tree_node *
 tree_alloc_node(struct tree *t, int count, bool fast_alloc)
 {
-	struct tree_node *n = NULL;
-	size_t nsize = count * sizeof(*n);
-	unsigned long old_size = __sync_fetch_and_add(&t->nodes_size, nsize);
+	void *block;
+	size_t nsize = tree_block_size(t, count);
 
 	if (fast_alloc) {
-		if (old_size + nsize > t->max_tree_size)
-			return NULL;
 		assert(t->nodes != NULL);
-		n = (struct tree_node *)(t->nodes + old_size);
-		memset(n, 0, nsize);
+		block = tree_arena_alloc(t, nsize);
+		if (!block)
+			return NULL;
+		memset(block, 0, nsize);
 	} else {
-		n = calloc2(count, sizeof(*n));
+		__sync_fetch_and_add(&t->nodes_size, nsize);
+		block = tree_heap_alloc(t->heap, count, nsize);
 	}
+	struct tree_node *n = block + 2 * count * sizeof(struct move_stats);
+	tree_init_block(t, n, count);
 	return n;
 }
 
+/* Start of the memory block containing node n. */
+static void *
+tree_node_block(struct tree_node *n)
+{
+	return tree_node_ustats(n) - n->bi;
+}
+
+/* Copy node contents and stats from src to dest, keeping dest
+ * position within its block. References are cleared, they are
+ * relative to the node and must be set again by the caller. */
+static void
+tree_copy_node(struct tree_node *dest, struct tree_node *src)
+{
+	unsigned short bi = dest->bi, bn = dest->bn;
+	*dest = *src;
+	dest->parent = dest->sibling = dest->children = (tree_ref_t) { 0 };
+	dest->bi = bi; dest->bn = bn;
+	tree_index_node(dest);
+	node_u(dest) = node_u(src);
+	node_amaf(dest) = node_amaf(src);
+}
+
 /* Initialize a node at a given place in memory.
  * This function may be called by multiple threads in parallel. */
 static void
 tree_setup_node(struct tree *t, struct tree_node *n, coord_t coord, int depth)
 {
-	static volatile unsigned int hash = 0;
 	n->coord = coord;
+	tree_index_node(n);
 	n->depth = depth;
-	/* n->hash is used only for debugging. It is very likely (but not
-	 * guaranteed) to be unique. */
-	hash_t h = n - (struct tree_node *)0;
-	n->hash = (h << 32) + (hash++ & 0xffffffff);
 	if (depth > t->max_depth)
 		t->max_depth = depth;
 }
@@ -71,18 +465,30 @@ tree_init_node(struct tree *t, coord_t coord, int depth, bool fast_alloc)
 	return n;
 }
 
-/* Create a tree structure. Pre-allocate all nodes if max_tree_size is > 0. */
+/* Create a tree structure. Pre-allocate all nodes if max_tree_size is > 0.
+ * tt_bits > 0 enables the DAG mode with a transposition table of
+ * 2^tt_bits entries (fast_alloc only). */
 struct tree *
 tree_init(struct board *board, enum stone color, unsigned long max_tree_size,
-	  unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits)
+	  unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits,
+	  int tt_bits)
 {
 	struct tree *t = calloc2(1, sizeof(*t));
 	t->board = board;
 	t->max_tree_size = max_tree_size;
 	t->max_pruned_size = max_pruned_size;
 	t->pruning_threshold = pruning_threshold;
+	t->heap = tree_heap_init();
 	if (max_tree_size != 0) {
-		t->nodes = malloc2(max_tree_size);
+		t->nodes = tree_pool_alloc(t, max_tree_size);
+		t->arenas = calloc2(TREE_ARENAS, sizeof(*t->arenas));
+		/* Keep the memory held in partially used arenas small
+		 * for small trees. */
+		t->arena_chunk = TREE_ARENA_CHUNK;
+		if (t->arena_chunk > max_tree_size / TREE_ARENAS)
+			t->arena_chunk = max_tree_size / TREE_ARENAS;
+		/* Node sizes are multiples of TREE_REF_UNIT, keep chunks so. */
+		t->arena_chunk &= ~(size_t) (TREE_REF_UNIT - 1);
 		/* The nodes buffer doesn't need initialization. This is currently
 		 * done by tree_init_node to spread the load. Doing a memset for the
 		 * entire buffer here would be too slow for large trees (>10 GB). */
@@ -98,26 +504,45 @@ tree_init(struct board *board, enum stone color, unsigned long max_tree_size,
 
 	t->hbits = hbits;
 	if (hbits) t->htable = uct_htable_alloc(hbits);
+
+	if (tt_bits) {
+		assert(t->nodes);
+		assert(tt_bits >= DAG_HBITS_MIN && tt_bits <= DAG_HBITS_MAX);
+		t->tt_bits = tt_bits;
+		t->tt = calloc2((size_t) 1 << tt_bits, sizeof(*t->tt));
+	}
 	return t;
 }
 
 
 /* This function may be called by multiple threads in parallel on the
  * same tree, but not on node n. n may be detached from the tree but
- * must have been created in this tree originally.
+ * must have been created in this tree originally. The block holding n
+ * is freed together with its last node, so n must be the only node of
+ * its block unless it is freed as part of its siblings.
  * It returns the remaining size of the tree after n has been freed. */
 static unsigned long
 tree_done_node(struct tree *t, struct tree_node *n)
 {
-	struct tree_node *ni = n->children;
+	struct tree_node *ni = node_children(n);
 	while (ni) {
-		struct tree_node *nj = ni->sibling;
+		struct tree_node *nj = node_sibling(ni);
 		tree_done_node(t, ni);
 		ni = nj;
 	}
-	free(n);
-	unsigned long old_size = __sync_fetch_and_sub(&t->nodes_size, sizeof(*n));
-	return old_size - sizeof(*n);
+	if (n->bi != n->bn - 1)
+		return t->nodes_size;
+	size_t nsize = tree_block_size(t, n->bn);
+	tree_heap_free(t->heap, tree_node_block(n), n->bn);
+	unsigned long old_size = __sync_fetch_and_sub(&t->nodes_size, nsize);
+	return old_size - nsize;
+}
+
+static void
+tree_free(struct tree *t)
+{
+	tree_heap_done(t->heap);
+	free(t);
 }
 
 struct subtree_ctx {
@@ -134,7 +559,7 @@ tree_done_node_worker(void *ctx_)
 
 	unsigned long tree_size = tree_done_node(ctx->t, ctx->n);
 	if (!tree_size)
-		free(ctx->t);
+		tree_free(ctx->t);
 	if (DEBUGL(2))
 		fprintf(stderr, "done freeing node at %s, tree size %lu\n", str, tree_size);
 	free(str);
@@ -147,9 +572,9 @@ tree_done_node_worker(void *ctx_)
 static void
 tree_done_node_detached(struct tree *t, struct tree_node *n)
 {
-	if (n->u.playouts < 1000) { // no thread for small tree
+	if (node_u(n).playouts < 1000) { // no thread for small tree
 		if (!tree_done_node(t, n))
-			free(t);
+			tree_free(t);
 		return;
 	}
 	pthread_attr_t attr;
@@ -171,11 +596,13 @@ tree_done(struct tree *t)
 	tree_done_node(t, t->ltree_white);
 
 	if (t->htable) free(t->htable);
+	if (t->tt) free(t->tt);
 	if (t->nodes) {
-		free(t->nodes);
-		free(t);
+		free(t->arenas);
+		tree_pool_free(t);
+		tree_free(t);
 	} else if (!tree_done_node(t, t->root)) {
-		free(t);
+		tree_free(t);
 		/* A tree_done_node_worker might still be running on this tree but
 		 * it will free the tree later. It is also freeing nodes faster than
 		 * we will create new ones. */
@@ -183,38 +610,82 @@ tree_done(struct tree *t)
 }
 
 
+static void
+tree_merge_node(struct tree_node *dst, struct tree_node *src, int depth, bool amaf)
+{
+	struct move_stats now = stats_get(&node_u(src));
+	int playouts = now.playouts - src->pu.playouts;
+	if (playouts > 0) {
+		floating_t value = (now.value * now.playouts - src->pu.value * src->pu.playouts) / playouts;
+		stats_add_result(&node_u(dst), value, playouts);
+		src->pu = now;
+	}
+	if (amaf) {
+		struct move_stats a = stats_get(&node_amaf(src));
+		if (a.playouts > 0)
+			stats_add_result(&node_amaf(dst), a.value, a.playouts);
+	}
+	if (!depth)
+		return;
+
+	/* Children of both nodes come in the same order unless a
+	 * expansion failed, so look for each match from the last one. */
+	struct tree_node *dfirst = node_children(dst), *dj = dfirst;
+	if (!dfirst)
+		return;
+	for (struct tree_node *si = node_children(src); si; si = node_sibling(si)) {
+		struct tree_node *start = dj;
+		while (node_coord(dj) != node_coord(si)) {
+			dj = node_sibling(dj);
+			if (!dj) dj = dfirst;
+			if (dj == start) break;
+		}
+		if (node_coord(dj) == node_coord(si))
+			tree_merge_node(dj, si, depth - 1, amaf);
+	}
+}
+
+void
+tree_merge(struct tree *dst, struct tree *src, int depth, bool amaf)
+{
+	tree_merge_node(dst->root, src->root, depth, amaf);
+	/* Dynkomi adjustments happen on the main tree. */
+	src->extra_komi = dst->extra_komi;
+}
+
+
 static void
 tree_node_dump(struct tree *tree, struct tree_node *node, int treeparity, int l, int thres)
 {
 	for (int i = 0; i < l; i++) fputc(' ', stderr);
 	int children = 0;
-	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni))
 		children++;
 	/* We use 1 as parity, since for all nodes we want to know the
 	 * win probability of _us_, not the node color. */
-	fprintf(stderr, "[%s] %.3f/%d [prior %.3f/%d amaf %.3f/%d crit %.3f vloss %d] h=%x c#=%d <%"PRIhash">\n",
+	fprintf(stderr, "[%s] %.3f/%d [prior %.3f/%d amaf %.3f/%d crit %.3f vloss %d] h=%x c#=%d <%p>\n",
 		coord2sstr(node_coord(node), tree->board),
-		tree_node_get_value(tree, treeparity, node->u.value), node->u.playouts,
+		tree_node_get_value(tree, treeparity, node_u(node).value), node_u(node).playouts,
 		tree_node_get_value(tree, treeparity, node->prior.value), node->prior.playouts,
-		tree_node_get_value(tree, treeparity, node->amaf.value), node->amaf.playouts,
+		tree_node_get_value(tree, treeparity, node_amaf(node).value), node_amaf(node).playouts,
 		tree_node_criticality(tree, node), node->descents,
-		node->hints, children, node->hash);
+		node->hints, children, node);
 
 	/* Print nodes sorted by #playouts. */
 
 	struct tree_node *nbox[1000]; int nboxl = 0;
-	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
-		if (ni->u.playouts > thres)
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni))
+		if (node_u(ni).playouts > thres)
 			nbox[nboxl++] = ni;
 
 	while (true) {
 		int best = -1;
 		for (int i = 0; i < nboxl; i++)
-			if (nbox[i] && (best < 0 || nbox[i]->u.playouts > nbox[best]->u.playouts))
+			if (nbox[i] && (best < 0 || node_u(nbox[i]).playouts > node_u(nbox[best]).playouts))
 				best = i;
 		if (best < 0)
 			break;
-		tree_node_dump(tree, nbox[best], treeparity, l + 1, /* node->u.value < 0.1 ? 0 : */ thres);
+		tree_node_dump(tree, nbox[best], treeparity, l + 1, /* node_u(node).value < 0.1 ? 0 : */ thres);
 		nbox[best] = NULL;
 	}
 }
@@ -222,7 +693,7 @@ tree_node_dump(struct tree *tree, struct tree_node *node, int treeparity, int l,
 void
 tree_dump(struct tree *tree, double thres)
 {
-	int thres_abs = thres > 0 ? tree->root->u.playouts * thres : thres;
+	int thres_abs = thres > 0 ? node_u(tree->root).playouts * thres : thres;
 	fprintf(stderr, "(UCT tree; root %s; extra komi %f; max depth %d)\n",
 	        stone2str(tree->root_color), tree->extra_komi,
 		tree->max_depth - tree->root->depth);
@@ -237,7 +708,7 @@ tree_dump(struct tree *tree, double thres)
 }
 
 
-static char *
+char *
 tree_book_name(struct board *b)
 {
 	static char buf[256];
@@ -249,28 +720,85 @@ tree_book_name(struct board *b)
 	return buf;
 }
 
-static void
-tree_node_save(FILE *f, struct tree_node *node, int thres)
-{
-	bool save_children = node->u.playouts >= thres;
+/* Opening tbook file: a header followed by an image of the saved nodes,
+ * in blocks laid out as in memory. References within the image are
+ * relative (see tree_ref_t), so tree_load() can use it as it is wherever
+ * it lands: copied into the nodes buffer in fast_alloc mode, mapped into
+ * the tree heap otherwise. Files without the header, such as tbooks
+ * of the older node by node format, are ignored. */
+#define TBOOK_MAGIC "pachitbk"
+#define TBOOK_VERSION 3
+
+struct tbook_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t endian; // TBOOK_ENDIAN as written by the host
+	uint32_t node_size, stats_size; // the image is only valid with the same structs
+	uint64_t size; // bytes of the image following the header
+	uint64_t root; // offset of the root node in the image
+	uint32_t nodes, max_depth;
+	char padding[16];
+};
+#define TBOOK_ENDIAN 0x01020304
 
-	if (!save_children)
-		node->is_expanded = 0;
+/* Keep values in sane scale, otherwise we start overflowing. */
+#define MAX_PLAYOUTS	10000000
+
+/* Bytes taken in the image by the children of node and their
+ * subtrees. Only nodes with at least thres playouts have their
+ * children saved. */
+static size_t
+tbook_children_size(struct tree *tree, struct tree_node *node, int thres, int *num)
+{
+	if (node_u(node).playouts < thres || !node_children(node))
+		return 0;
+	size_t size = tree_block_size(tree, node_children(node)->bn);
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni)) {
+		(*num)++;
+		size += tbook_children_size(tree, ni, thres, num);
+	}
+	return size;
+}
 
-	fputc(1, f);
-	fwrite(((void *) node) + offsetof(struct tree_node, u),
-	       sizeof(struct tree_node) - offsetof(struct tree_node, u),
-	       1, f);
+static void
+tbook_copy_node(struct tree_node *dest, struct tree_node *src)
+{
+	tree_copy_node(dest, src);
+	if (node_u(dest).playouts > MAX_PLAYOUTS)
+		node_u(dest).playouts = MAX_PLAYOUTS;
+	if (node_amaf(dest).playouts > MAX_PLAYOUTS)
+		node_amaf(dest).playouts = MAX_PLAYOUTS;
+	dest->pu = node_u(dest);
+	dest->descents = 0;
+	dest->hints &= ~TREE_HINT_MOVED;
+	dest->is_expanded = false;
+}
 
-	if (save_children) {
-		for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
-			tree_node_save(f, ni, thres);
-	} else {
-		if (node->children)
-			node->is_expanded = 1;
+/* Copy the children of src below dest, recursively, allocating their
+ * blocks at *end in the image. */
+static void
+tbook_copy_children(struct tree *tree, struct tree_node *dest, struct tree_node *src, int thres, char **end)
+{
+	if (node_u(src).playouts < thres || !node_children(src))
+		return;
+	int count = node_children(src)->bn;
+	struct tree_node *ni = (struct tree_node *) (*end + 2 * count * sizeof(struct move_stats));
+	*end += tree_block_size(tree, count);
+	tree_init_block(tree, ni, count);
+
+	struct tree_node *si = node_children(src);
+	for (int i = 0; i < count; i++, si = node_sibling(si)) {
+		tbook_copy_node(&ni[i], si);
+		node_set_parent(&ni[i], dest);
+		if (i + 1 < count)
+			node_set_sibling(&ni[i], &ni[i + 1]);
 	}
+	node_set_children(dest, ni);
+	dest->is_expanded = true;
 
-	fputc(0, f);
+	si = node_children(src);
+	for (int i = 0; i < count; i++, si = node_sibling(si))
+		tbook_copy_children(tree, &ni[i], si, thres, end);
 }
 
 void
@@ -282,41 +810,53 @@ tree_save(struct tree *tree, struct board *b, int thres)
 		perror("fopen");
 		return;
 	}
-	tree_node_save(f, tree->root, thres);
-	fputc(0, f);
+
+	int num = 1;
+	size_t size = TREE_NODE_SIZE + tbook_children_size(tree, tree->root, thres, &num);
+	char *image = calloc2(1, size);
+	char *end = image + TREE_NODE_SIZE;
+	struct tree_node *root = (struct tree_node *) (image + 2 * sizeof(struct move_stats));
+	root->bi = 0; root->bn = 1;
+	tbook_copy_node(root, tree->root);
+	tbook_copy_children(tree, root, tree->root, thres, &end);
+	assert(end == image + size);
+
+	struct tbook_header h = {
+		.magic = TBOOK_MAGIC, .version = TBOOK_VERSION, .endian = TBOOK_ENDIAN,
+		.node_size = sizeof(struct tree_node), .stats_size = sizeof(struct move_stats),
+		.size = size, .root = (char *) root - image,
+		.nodes = num, .max_depth = tree->max_depth,
+	};
+	if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(image, size, 1, f) != 1)
+		perror("fwrite");
 	fclose(f);
+	free(image);
 }
 
 
-void
-tree_node_load(FILE *f, struct tree_node *node, int *num)
+/* Put the tbook image of f in the tree, returns its root node. */
+static struct tree_node *
+tree_load_image(struct tree *tree, FILE *f, struct tbook_header *h)
 {
-	(*num)++;
-
-	checked_fread(((void *) node) + offsetof(struct tree_node, u),
-		      sizeof(struct tree_node) - offsetof(struct tree_node, u),
-		      1, f);
-
-	/* Keep values in sane scale, otherwise we start overflowing. */
-#define MAX_PLAYOUTS	10000000
-	if (node->u.playouts > MAX_PLAYOUTS) {
-		node->u.playouts = MAX_PLAYOUTS;
-	}
-	if (node->amaf.playouts > MAX_PLAYOUTS) {
-		node->amaf.playouts = MAX_PLAYOUTS;
-	}
-	memcpy(&node->pu, &node->u, sizeof(node->u));
-
-	struct tree_node *ni = NULL, *ni_prev = NULL;
-	while (fgetc(f)) {
-		ni_prev = ni; ni = calloc2(1, sizeof(*ni));
-		if (!node->children)
-			node->children = ni;
-		else
-			ni_prev->sibling = ni;
-		ni->parent = node;
-		tree_node_load(f, ni, num);
+	void *image;
+	if (tree->nodes) {
+		image = tree_arena_alloc(tree, h->size);
+		if (!image)
+			die("tbook does not fit in max_tree_size\n");
+#ifndef _WIN32
+		void *map = mmap(NULL, sizeof(*h) + h->size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if (map == MAP_FAILED)
+			die("tree: cannot map tbook: %s\n", strerror(errno));
+		memcpy(image, map + sizeof(*h), h->size);
+		munmap(map, sizeof(*h) + h->size);
+#else
+		checked_fread(image, h->size, 1, f);
+#endif
+	} else {
+		image = tree_heap_map(tree->heap, f, sizeof(*h) + h->size) + sizeof(*h);
+		__sync_fetch_and_add(&tree->nodes_size, h->size);
 	}
+	return image + h->root;
 }
 
 void
@@ -329,63 +869,126 @@ tree_load(struct tree *tree, struct board *b)
 
 	fprintf(stderr, "Loading opening tbook %s...\n", filename);
 
-	int num = 0;
-	if (fgetc(f))
-		tree_node_load(f, tree->root, &num);
-	fprintf(stderr, "Loaded %d nodes.\n", num);
+	struct tbook_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, TBOOK_MAGIC, sizeof(h.magic))) {
+		fprintf(stderr, "Warning: %s is not a tbook of this Pachi version, ignored.\n", filename);
+		fclose(f);
+		return;
+	}
+	if (h.version != TBOOK_VERSION || h.endian != TBOOK_ENDIAN
+	    || h.node_size != sizeof(struct tree_node) || h.stats_size != sizeof(struct move_stats)) {
+		fprintf(stderr, "Warning: tbook %s was saved by an incompatible Pachi build, ignored.\n", filename);
+		fclose(f);
+		return;
+	}
+	struct tree_node *old_root = tree->root;
+	tree->root = tree_load_image(tree, f, &h);
+	if (!tree->nodes)
+		tree_done_node(tree, old_root);
+	if ((int) h.max_depth > tree->max_depth)
+		tree->max_depth = h.max_depth;
+	fprintf(stderr, "Loaded %d nodes.\n", (int) h.nodes);
 
 	fclose(f);
 }
 
 
-/* Copy the subtree rooted at node: all nodes at or below depth
- * or with at least threshold playouts. Only for fast_alloc.
- * The code is destructive on src. The relative order of children of
- * a given node is preserved (assumed by tree_get_node in particular).
- * Returns the copy of node in the destination tree, or NULL
- * if we could not copy it. */
-static struct tree_node *
-tree_prune(struct tree *dest, struct tree *src, struct tree_node *node,
-	   int threshold, int depth)
+/* Copy the children of src node n into dest node n2, and recursively
+ * their subtrees: all nodes at or below depth or with at least threshold
+ * playouts. The children block is copied as a whole so the relative
+ * order of children is preserved (assumed by tree_get_node in particular).
+ * If dest becomes full, or if we run out of time (dest->gc_deadline
+ * passed or src->gc_stop set), the remaining nodes are left unexpanded;
+ * dest->gc_dropped counts those cut short by time. */
+static void
+tree_prune_children(struct tree *dest, struct tree *src, struct tree_node *n2, struct tree_node *node,
+		    int threshold, int depth)
 {
-	assert(dest->nodes && node);
-	struct tree_node *n2 = tree_alloc_node(dest, 1, true);
-	if (!n2)
-		return NULL;
-	*n2 = *node;
 	if (n2->depth > dest->max_depth)
 		dest->max_depth = n2->depth;
-	n2->children = NULL;
+	node_set_children(n2, NULL);
 	n2->is_expanded = false;
 
-	if (node->depth >= depth && node->u.playouts < threshold)
-		return n2;
+	/* Use the stats of n2: those of node may have been overwritten
+	 * by a forwarding pointer, see below. */
+	if (n2->depth >= depth && node_u(n2).playouts < threshold)
+		return;
 	/* For deep nodes with many playouts, we must copy all children,
 	 * even those with zero playouts, because partially expanded
 	 * nodes are not supported. Considering them as fully expanded
 	 * would degrade the playing strength. The only exception is
 	 * when dest becomes full, but this should never happen in practice
 	 * if threshold is chosen to limit the number of nodes traversed. */
-	struct tree_node *ni = node->children;
+	struct tree_node *ni = node_children(node);
 	if (!ni)
-		return n2;
-	struct tree_node **prev2 = &(n2->children);
-	while (ni) {
-		struct tree_node *ni2 = tree_prune(dest, src, ni, threshold, depth);
-		if (!ni2) break;
-		*prev2 = ni2;
-		prev2 = &(ni2->sibling);
-		ni2->parent = n2;
-		ni = ni->sibling;
-	}
-	if (!ni) {
+		return;
+	/* In DAG mode, a children block may be shared by several nodes.
+	 * Once copied, the block is marked TREE_HINT_MOVED and the u stats
+	 * of its first node are overwritten with the address of the copy
+	 * in dest, so that we copy it only once. (dest may be too far for
+	 * a tree_ref_t.) */
+	if (ni->hints & TREE_HINT_MOVED) {
+		node_set_children(n2, *(struct tree_node **) &node_u(ni));
 		n2->is_expanded = true;
-	} else {
-		n2->children = NULL; // avoid partially expanded nodes
+		return;
+	}
+	if (src->gc_stop || (dest->gc_deadline && time_now() > dest->gc_deadline)) {
+		dest->gc_dropped++;
+		return;
 	}
+	int count = ni->bn;
+	struct tree_node *ni2 = tree_alloc_node(dest, count, true);
+	if (!ni2)
+		return;
+	for (int i = 0; i < count; i++, ni = node_sibling(ni)) {
+		tree_copy_node(&ni2[i], ni);
+		node_set_parent(&ni2[i], n2);
+		node_set_sibling(&ni2[i], i + 1 < count ? &ni2[i + 1] : NULL);
+	}
+	ni = node_children(node);
+	ni->hints |= TREE_HINT_MOVED;
+	*(struct tree_node **) &node_u(ni) = ni2;
+	if (src->gc_stop_blocks && !--src->gc_stop_blocks)
+		src->gc_stop = true;
+	for (int i = 0; i < count; i++, ni = node_sibling(ni))
+		tree_prune_children(dest, src, &ni2[i], ni, threshold, depth);
+	node_set_children(n2, ni2);
+	n2->is_expanded = true;
+}
+
+/* Copy the subtree rooted at node, see tree_prune_children().
+ * Only for fast_alloc. The code is destructive on src.
+ * Returns the copy of node in the destination tree, or NULL
+ * if we could not copy it. */
+static struct tree_node *
+tree_prune(struct tree *dest, struct tree *src, struct tree_node *node,
+	   int threshold, int depth)
+{
+	assert(dest->nodes && node);
+	struct tree_node *n2 = tree_alloc_node(dest, 1, true);
+	if (!n2)
+		return NULL;
+	tree_copy_node(n2, node);
+	tree_prune_children(dest, src, n2, node, threshold, depth);
 	return n2;
 }
 
+/* Put back the stats of the blocks tree_prune_children() copied from
+ * the subtree of node, where it left forwarding pointers: the subtree
+ * is as it was before the copy. */
+static void
+tree_prune_undo(struct tree_node *node)
+{
+	struct tree_node *ni = node_children(node);
+	if (!ni || !(ni->hints & TREE_HINT_MOVED))
+		return;
+	struct tree_node *ni2 = *(struct tree_node **) &node_u(ni);
+	node_u(ni) = node_u(ni2);
+	ni->hints &= ~TREE_HINT_MOVED;
+	for (; ni; ni = node_sibling(ni))
+		tree_prune_undo(ni);
+}
+
 /* The following constants are used for garbage collection of nodes.
  * A tree is considered large if the top node has >= 40K playouts.
  * For such trees, we copy deep nodes only if they have enough
@@ -410,24 +1013,33 @@ tree_prune(struct tree *dest, struct tree *src, struct tree_node *node,
 /* Free all the tree, keeping only the subtree rooted at node.
  * Prune the subtree if necessary to fit in memory or
  * to save time scanning the tree.
+ * Copying to the temp tree stops as soon as tree->gc_stop is set: the
+ * tree is then left as it was, with the collection still pending, to
+ * be done again at the next opportunity (at the latest on our own time
+ * once the tree reaches pruning_threshold). This is what makes it
+ * possible to run the collection in the background: the copy back is
+ * bounded by the temp tree size. Copying also stops after budget
+ * seconds (if > 0), in which case whatever was not copied by then is
+ * dropped, counted in tree->gc_discarded.
  * Returns the moved node. Only for fast_alloc. */
 struct tree_node *
-tree_garbage_collect(struct tree *tree, struct tree_node *node)
+tree_garbage_collect(struct tree *tree, struct tree_node *node, double budget)
 {
-	assert(tree->nodes && !node->parent && !node->sibling);
+	assert(tree->nodes && !node_parent(node) && !node_sibling(node));
 	double start_time = time_now();
-	unsigned long orig_size = tree->nodes_size;
+	unsigned long orig_size = tree_nodes_size(tree);
 
 	struct tree *temp_tree = tree_init(tree->board,  tree->root_color,
-					   tree->max_pruned_size, 0, 0, tree->ltree_aging, 0);
-	temp_tree->nodes_size = 0; // We do not want the dummy pass node
+					   tree->max_pruned_size, 0, 0, tree->ltree_aging, 0, 0);
+	tree_arenas_reset(temp_tree); // We do not want the dummy pass node
+	temp_tree->gc_deadline = budget > 0 ? start_time + budget : 0;
         struct tree_node *temp_node;
 
 	/* Find the maximum depth at which we can copy all nodes. */
 	int max_nodes = 1;
-	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni))
 		max_nodes++;
-	unsigned long nodes_size = max_nodes * sizeof(*node);
+	unsigned long nodes_size = max_nodes * TREE_NODE_SIZE;
 	int max_depth = node->depth;
 	while (nodes_size < tree->max_pruned_size && max_nodes > 1) {
 		max_nodes--;
@@ -441,14 +1053,29 @@ tree_garbage_collect(struct tree *tree, struct tree_node *node)
 	 * to save time scanning the source tree. It can take over 20s to traverse
 	 * completely a large source tree (20 GB) even without copying because
 	 * the traversal is not friendly at all with the memory cache. */
-	int threshold = (node->u.playouts - LARGE_TREE_PLAYOUTS) * DEEP_PLAYOUTS_THRESHOLD / LARGE_TREE_PLAYOUTS;
+	int threshold = (node_u(node).playouts - LARGE_TREE_PLAYOUTS) * DEEP_PLAYOUTS_THRESHOLD / LARGE_TREE_PLAYOUTS;
 	if (threshold < 0) threshold = 0;
 	if (threshold > DEEP_PLAYOUTS_THRESHOLD) threshold = DEEP_PLAYOUTS_THRESHOLD; 
 	temp_node = tree_prune(temp_tree, tree, node, threshold, max_depth);
 	assert(temp_node);
 
+	if (temp_tree->gc_dropped && tree->gc_stop) {
+		tree_prune_undo(node);
+		tree_done(temp_tree);
+		if (DEBUGL(2))
+			fprintf(stderr, "tree pruning stopped after %0.3g s, left pending\n", time_now() - start_time);
+		return node;
+	}
+	if (temp_tree->gc_dropped) {
+		tree->gc_discarded += temp_tree->gc_dropped;
+		fprintf(stderr, "tree pruning out of time after %0.3g s, dropped the children of %d nodes (%lu so far)\n",
+			time_now() - start_time, temp_tree->gc_dropped, tree->gc_discarded);
+	}
+
 	/* Now copy back to original tree. */
-	tree->nodes_size = 0;
+	unsigned long temp_size = tree_nodes_size(temp_tree) - temp_tree->nodes_size;
+	tree_arenas_reset(tree);
+	tree->gc_pending = false;
 	tree->max_depth = 0;
 	struct tree_node *new_node = tree_prune(tree, temp_tree, temp_node, 0, temp_tree->max_depth);
 
@@ -458,21 +1085,27 @@ tree_garbage_collect(struct tree *tree, struct tree_node *node)
 		if (!prev_time) prev_time = start_time;
 		fprintf(stderr,
 			"tree pruned in %0.6g s, prev %0.3g s ago, dest depth %d wanted %d,"
-			" size %lu->%lu/%lu, playouts %d\n",
+			" size %lu->%lu/%lu, playouts %d%s\n",
 			now - start_time, start_time - prev_time, temp_tree->max_depth, max_depth,
-			orig_size, temp_tree->nodes_size, tree->max_pruned_size, new_node->u.playouts);
+			orig_size, temp_size, tree->max_pruned_size, node_u(new_node).playouts,
+			temp_tree->gc_dropped ? " (out of time)" : "");
 		prev_time = start_time;
 	}
-	if (temp_tree->nodes_size >= temp_tree->max_tree_size) {
+	if (temp_tree->nodes_full) {
 		fprintf(stderr, "temp tree overflow, max_tree_size %lu, pruning_threshold %lu\n",
 			tree->max_tree_size, tree->pruning_threshold);
 		/* This is not a serious problem, we will simply recompute the discarded nodes
 		 * at the next move if necessary. This is better than frequently wasting memory. */
 	} else {
-		assert(tree->nodes_size == temp_tree->nodes_size);
+		assert(tree_nodes_size(tree) - tree->nodes_size == temp_size);
 		assert(tree->max_depth == temp_tree->max_depth);
 	}
 	tree_done(temp_tree);
+
+	/* All blocks moved. Transpositions of the kept nodes are merged
+	 * already, new ones will be recorded again as we expand. */
+	if (tree->tt)
+		memset(tree->tt, 0, ((size_t) 1 << tree->tt_bits) * sizeof(*tree->tt));
 	return new_node;
 }
 
@@ -483,34 +1116,34 @@ tree_garbage_collect(struct tree *tree, struct tree_node *node)
 struct tree_node *
 tree_get_node(struct tree *t, struct tree_node *parent, coord_t c, bool create)
 {
-	if (!parent->children || node_coord(parent->children) >= c) {
+	if (!node_children(parent) || node_coord(node_children(parent)) >= c) {
 		/* Special case: Insertion at the beginning. */
-		if (parent->children && node_coord(parent->children) == c)
-			return parent->children;
+		if (node_children(parent) && node_coord(node_children(parent)) == c)
+			return node_children(parent);
 		if (!create)
 			return NULL;
 
 		struct tree_node *nn = tree_init_node(t, c, parent->depth + 1, false);
-		nn->parent = parent; nn->sibling = parent->children;
-		parent->children = nn;
+		node_set_parent(nn, parent); node_set_sibling(nn, node_children(parent));
+		node_set_children(parent, nn);
 		return nn;
 	}
 
 	/* No candidate at the beginning, look through all the children. */
 
 	struct tree_node *ni;
-	for (ni = parent->children; ni->sibling; ni = ni->sibling)
-		if (node_coord(ni->sibling) >= c)
+	for (ni = node_children(parent); node_sibling(ni); ni = node_sibling(ni))
+		if (node_coord(node_sibling(ni)) >= c)
 			break;
 
-	if (ni->sibling && node_coord(ni->sibling) == c)
-		return ni->sibling;
+	if (node_sibling(ni) && node_coord(node_sibling(ni)) == c)
+		return node_sibling(ni);
 	assert(node_coord(ni) < c);
 	if (!create)
 		return NULL;
 
 	struct tree_node *nn = tree_init_node(t, c, parent->depth + 1, false);
-	nn->parent = parent; nn->sibling = ni->sibling; ni->sibling = nn;
+	node_set_parent(nn, parent); node_set_sibling(nn, node_sibling(ni)); node_set_sibling(ni, nn);
 	return nn;
 }
 
@@ -543,9 +1176,9 @@ tree_lnode_for_node(struct tree *tree, struct tree_node *ni, struct tree_node *l
 
 	if (ni->d >= tenuki_d) {
 		/* Tenuki, pick a pass lsibling if available. */
-		assert(lni->parent && lni->parent->children);
-		if (is_pass(node_coord(lni->parent->children))) {
-			return lni->parent->children;
+		assert(node_parent(lni) && node_children(node_parent(lni)));
+		if (is_pass(node_coord(node_children(node_parent(lni))))) {
+			return node_children(node_parent(lni));
 		} else {
 			return NULL;
 		}
@@ -556,6 +1189,59 @@ tree_lnode_for_node(struct tree *tree, struct tree_node *ni, struct tree_node *l
 }
 
 
+/* Transposition table for the DAG mode. Lookups and stores are lock-free;
+ * if two threads expand the same position at once, one of the blocks
+ * just doesn't get shared. */
+
+#define TREE_TT_PROBES 8
+
+/* Key of the position on board b reached by node at given depth.
+ * Depth is included so that the DAG cannot have cycles, and all
+ * parents of a shared block are at the same depth. The last move is
+ * left out on purpose, or transpositions (same moves in a different
+ * order) would hardly ever match: a shared block keeps the priors and
+ * cfg distances computed for the move order which expanded it first. */
+static hash_t
+tree_tt_key(struct board *b, int depth)
+{
+	hash_t key = b->hash ^ (depth * 0x9e3779b97f4a7c15ULL);
+	if (!is_pass(b->ko.coord))
+		key ^= hash_at(b, b->ko.coord, b->ko.color) * 3;
+	return key ? key : 1;
+}
+
+static struct tree_node *
+tree_tt_lookup(struct tree *t, hash_t key)
+{
+	hash_t mask = ((hash_t) 1 << t->tt_bits) - 1;
+	for (int i = 0; i < TREE_TT_PROBES; i++) {
+		struct tree_tt_entry *e = &t->tt[(key + i) & mask];
+		hash_t k = e->key;
+		if (!k)
+			return NULL;
+		if (k == key)
+			return e->children; // NULL if being stored right now
+	}
+	return NULL;
+}
+
+static void
+tree_tt_store(struct tree *t, hash_t key, struct tree_node *children)
+{
+	hash_t mask = ((hash_t) 1 << t->tt_bits) - 1;
+	for (int i = 0; i < TREE_TT_PROBES; i++) {
+		struct tree_tt_entry *e = &t->tt[(key + i) & mask];
+		if (__sync_bool_compare_and_swap(&e->key, 0, key)) {
+			e->children = children;
+			return;
+		}
+		if (e->key == key)
+			return;
+	}
+	/* Table full around key, don't share this one. */
+}
+
+
 /* Tree symmetry: When possible, we will localize the tree to a single part
  * of the board in tree_expand_node() and possibly flip along symmetry axes
  * to another part of the board in tree_promote_at(). We follow b->symmetry
@@ -566,6 +1252,21 @@ tree_lnode_for_node(struct tree *tree, struct tree_node *ni, struct tree_node *l
 void
 tree_expand_node(struct tree *t, struct tree_node *node, struct board *b, enum stone color, struct uct *u, int parity)
 {
+	/* In DAG mode, reuse the children of a transposition if we have
+	 * one. Not while the root is symmetric: tree_fix_symmetry() would
+	 * flip shared nodes several times. */
+	int prof = uct_profile_enter(UP_EXPAND);
+	hash_t key = 0;
+	if (t->tt && t->root_symmetry.type == SYM_NONE) {
+		key = tree_tt_key(b, node->depth);
+		struct tree_node *children = tree_tt_lookup(t, key);
+		if (children) {
+			node_set_children(node, children);
+			uct_profile_leave(prof);
+			return;
+		}
+	}
+
 	/* Get a Common Fate Graph distance map from parent node. */
 	int distances[board_size2(b)];
 	if (!is_pass(b->last_move.coord) && !is_resign(b->last_move.coord)) {
@@ -588,30 +1289,19 @@ tree_expand_node(struct tree *t, struct tree_node *node, struct board *b, enum s
 	memset(map_prior, 0, sizeof(map_prior));
 	memset(map_consider, 0, sizeof(map_consider));
 	map.consider[pass] = true;
-	int child_count = 1; // for pass
 	foreach_free_point(b) {
 		assert(board_at(b, c) == S_NONE);
 		if (!board_is_valid_play_no_suicide(b, color, c))
 			continue;
 		map.consider[c] = true;
-		child_count++;
 	} foreach_free_point_end;
+	node->hints &= ~TREE_HINT_DCNN;
+	int pprof = uct_profile_enter(UP_PRIOR);
 	uct_prior(u, node, &map);
+	uct_profile_leave(pprof);
 
-	/* Now, create the nodes (all at once if fast_alloc) */
-	struct tree_node *ni = t->nodes ? tree_alloc_node(t, child_count, true) : tree_alloc_node(t, 1, false);
-	/* In fast_alloc mode we might temporarily run out of nodes but this should be rare. */
-	if (!ni) {
-		node->is_expanded = false;
-		return;
-	}
-	tree_setup_node(t, ni, pass, node->depth + 1);
-
-	struct tree_node *first_child = ni;
-	ni->parent = node;
-	ni->prior = map.prior[pass]; ni->d = TREE_NODE_D_MAX + 1;
-
-	/* The loop considers only the symmetry playground. */
+	/* Collect the children, pass first. The loop considers only
+	 * the symmetry playground. */
 	if (UDEBUGL(6)) {
 		fprintf(stderr, "expanding %s within [%d,%d],[%d,%d] %d-%d\n",
 				coord2sstr(node_coord(node), b),
@@ -619,7 +1309,9 @@ tree_expand_node(struct tree *t, struct tree_node *node, struct board *b, enum s
 				b->symmetry.x2, b->symmetry.y2,
 				b->symmetry.type, b->symmetry.d);
 	}
-	int child = 1;
+	coord_t children[board_size2(b) + 1];
+	int child_count = 0;
+	children[child_count++] = pass;
 	for (int j = b->symmetry.y1; j <= b->symmetry.y2; j++) {
 		for (int i = b->symmetry.x1; i <= b->symmetry.x2; i++) {
 			if (b->symmetry.d) {
@@ -635,16 +1327,33 @@ tree_expand_node(struct tree *t, struct tree_node *node, struct board *b, enum s
 			if (!map.consider[c]) // Filter out invalid moves
 				continue;
 			assert(c != node_coord(node)); // I have spotted "C3 C3" in some sequence...
-
-			struct tree_node *nj = t->nodes ? first_child + child++ : tree_alloc_node(t, 1, false);
-			tree_setup_node(t, nj, c, node->depth + 1);
-			nj->parent = node; ni->sibling = nj; ni = nj;
-
-			ni->prior = map.prior[c];
-			ni->d = distances[c];
+			children[child_count++] = c;
 		}
 	}
-	node->children = first_child; // must be done at the end to avoid race
+
+	/* Now, create the nodes, all at once. */
+	struct tree_node *ni = tree_alloc_node(t, child_count, t->nodes);
+	/* In fast_alloc mode we might temporarily run out of nodes but this should be rare. */
+	if (!ni) {
+		node->is_expanded = false;
+		uct_profile_leave(prof);
+		return;
+	}
+	for (int i = 0; i < child_count; i++) {
+		coord_t c = children[i];
+		tree_setup_node(t, &ni[i], c, node->depth + 1);
+		node_set_parent(&ni[i], node);
+		if (i + 1 < child_count)
+			node_set_sibling(&ni[i], &ni[i + 1]);
+		ni[i].prior = map.prior[c];
+		ni[i].d = is_pass(c) ? TREE_NODE_D_MAX + 1 : distances[c];
+	}
+	node_set_children(node, ni); // must be done at the end to avoid race
+	if (key)
+		tree_tt_store(t, key, ni);
+	if (map.dcnn_async)
+		uct_prior_dcnn_async(u, node, b, color, map.parity);
+	uct_profile_leave(prof);
 }
 
 
@@ -666,14 +1375,24 @@ flip_coord(struct board *b, coord_t c,
 }
 
 static void
-tree_fix_node_symmetry(struct board *b, struct tree_node *node,
+tree_fix_node_symmetry(struct tree *t, struct board *b, struct tree_node *node,
                        bool flip_horiz, bool flip_vert, int flip_diag)
 {
 	if (!is_pass(node_coord(node)))
 		node->coord = flip_coord(b, node_coord(node), flip_horiz, flip_vert, flip_diag);
 
-	for (struct tree_node *ni = node->children; ni; ni = ni->sibling)
-		tree_fix_node_symmetry(b, ni, flip_horiz, flip_vert, flip_diag);
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni))
+		tree_fix_node_symmetry(t, b, ni, flip_horiz, flip_vert, flip_diag);
+
+	/* The children moved, index their new coords. */
+	struct tree_node *block = NULL;
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni))
+		if (ni - ni->bi != block) {
+			block = ni - ni->bi;
+			tree_clear_index(t, ni);
+		}
+	for (struct tree_node *ni = node_children(node); ni; ni = node_sibling(ni))
+		tree_index_node(ni);
 }
 
 static void
@@ -712,24 +1431,24 @@ tree_fix_symmetry(struct tree *tree, struct board *b, coord_t c)
 			s->type, s->d, b->symmetry.type, b->symmetry.d);
 	}
 	if (flip_horiz || flip_vert || flip_diag)
-		tree_fix_node_symmetry(b, tree->root, flip_horiz, flip_vert, flip_diag);
+		tree_fix_node_symmetry(tree, b, tree->root, flip_horiz, flip_vert, flip_diag);
 }
 
 
 static void
 tree_unlink_node(struct tree_node *node)
 {
-	struct tree_node *ni = node->parent;
-	if (ni->children == node) {
-		ni->children = node->sibling;
+	struct tree_node *ni = node_parent(node);
+	if (node_children(ni) == node) {
+		node_set_children(ni, node_sibling(node));
 	} else {
-		ni = ni->children;
-		while (ni->sibling != node)
-			ni = ni->sibling;
-		ni->sibling = node->sibling;
+		ni = node_children(ni);
+		while (node_sibling(ni) != node)
+			ni = node_sibling(ni);
+		node_set_sibling(ni, node_sibling(node));
 	}
-	node->sibling = NULL;
-	node->parent = NULL;
+	node_set_sibling(node, NULL);
+	node_set_parent(node, NULL);
 }
 
 /* Reduce weight of statistics on promotion. Remove nodes that
@@ -738,36 +1457,53 @@ tree_unlink_node(struct tree_node *node)
 static struct tree_node *
 tree_age_node(struct tree *tree, struct tree_node *node)
 {
-	node->u.playouts /= tree->ltree_aging;
-	if (node->parent && !node->u.playouts) {
-		struct tree_node *sibling = node->sibling;
+	stats_scale_playouts(&node_u(node), tree->ltree_aging);
+	if (node_parent(node) && !node_u(node).playouts) {
+		struct tree_node *sibling = node_sibling(node);
 		/* Delete node, no playouts. */
 		tree_unlink_node(node);
 		tree_done_node(tree, node);
 		return sibling;
 	}
 
-	struct tree_node *ni = node->children;
+	struct tree_node *ni = node_children(node);
 	while (ni) ni = tree_age_node(tree, ni);
-	return node->sibling;
+	return node_sibling(node);
 }
 
 /* Promotes the given node as the root of the tree. In the fast_alloc
- * mode, the node may be moved and some of its subtree may be pruned. */
+ * mode, this does not garbage collect the tree, which would take time
+ * proportional to the tree size; it only sets tree->gc_pending and the
+ * caller is expected to run tree_garbage_collect() when convenient. */
 void
 tree_promote_node(struct tree *tree, struct tree_node **node)
 {
-	assert((*node)->parent == tree->root);
-	tree_unlink_node(*node);
+	/* In DAG mode the children of root may have been created by
+	 * a transposition left over from an earlier move. */
+	assert(node_parent(*node) == tree->root || tree->tt);
 	if (!tree->nodes) {
+		/* The node shares its block with its siblings. Move it to a
+		 * block of its own, leaving an empty leaf in the old tree. */
+		struct tree_node *n2 = tree_alloc_node(tree, 1, false);
+		tree_copy_node(n2, *node);
+		node_set_children(n2, node_children(*node));
+		for (struct tree_node *ni = node_children(n2); ni; ni = node_sibling(ni))
+			node_set_parent(ni, n2);
+		node_set_children(*node, NULL);
+		*node = n2;
 		/* Freeing the rest of the tree can take several seconds on large
 		 * trees, so we must do it asynchronously: */
 		tree_done_node_detached(tree, tree->root);
 	} else {
+		/* The rest of the tree is just left behind, no need to unlink
+		 * node from its siblings. */
+		node_set_parent(*node, NULL);
+		node_set_sibling(*node, NULL);
 		/* Garbage collect if we run out of memory, or it is cheap to do so now: */
-		if (tree->nodes_size >= tree->pruning_threshold
-		    || (tree->nodes_size >= tree->max_tree_size / 10 && (*node)->u.playouts < SMALL_TREE_PLAYOUTS))
-			*node = tree_garbage_collect(tree, *node);
+		unsigned long nodes_size = tree_nodes_size(tree);
+		if (nodes_size >= tree->pruning_threshold
+		    || (nodes_size >= tree->max_tree_size / 10 && node_u(*node).playouts < SMALL_TREE_PLAYOUTS))
+			tree->gc_pending = true;
 	}
 	tree->root = *node;
 	tree->root_color = stone_other(tree->root_color);
@@ -775,10 +1511,9 @@ tree_promote_node(struct tree *tree, struct tree_node **node)
 	board_symmetry_update(tree->board, &tree->root_symmetry, node_coord(*node));
 	tree->avg_score.playouts = 0;
 
-	/* If the tree deepest node was under node, or if we called tree_garbage_collect,
-	 * tree->max_depth is correct. Otherwise we could traverse the tree
-         * to recompute max_depth but it's not worth it: it's just for debugging
-	 * and soon the tree will grow and max_depth will become correct again. */
+	/* If the tree deepest node was under node, tree->max_depth is correct.
+	 * Otherwise we could traverse the tree to recompute max_depth but
+	 * it's not worth it: it's just for debugging and soon the tree will grow and max_depth will become correct again. */
 
 	if (tree->ltree_aging != 1.0f) { // XXX: != should work here even with the floating_t
 		tree_age_node(tree, tree->ltree_black);
@@ -791,7 +1526,7 @@ tree_promote_at(struct tree *tree, struct board *b, coord_t c)
 {
 	tree_fix_symmetry(tree, b, c);
 
-	for (struct tree_node *ni = tree->root->children; ni; ni = ni->sibling) {
+	for (struct tree_node *ni = node_children(tree->root); ni; ni = node_sibling(ni)) {
 		if (node_coord(ni) == c) {
 			tree_promote_node(tree, &ni);
 			return true;
@@ -5,27 +5,35 @@
  *
  * Two allocation methods are supported for the tree nodes:
  *
- * - calloc/free: each node is allocated with one calloc.
+ * - calloc/free: each block of nodes is allocated from the tree
+ *   heap, a range of address space reserved for the tree, with free
+ *   lists by block length.
  *   After a move, all nodes except the subtree rooted at
- *   the played move are freed one by one with free().
+ *   the played move are freed block by block.
  *   Since this can be very slow (seen 9s and loss on time because
  *   of this) the nodes are freed in a background thread.
  *   We still reserve enough memory for the next move in case
  *   the background thread doesn't free nodes fast enough.
  *
  * - fast_alloc: a large buffer is allocated once, and each
- *   node allocation takes some of this buffer. After a move
+ *   block allocation takes some of this buffer. After a move
  *   is played, no memory if freed if the buffer still has
  *   enough free space. Otherwise the subtree rooted at the
  *   played move is copied to a temporary buffer, pruning it
  *   if necessary to fit in this small buffer. We copy by
  *   preference nodes with largest number of playouts.
  *   Then the temporary buffer is copied back to the original
- *   buffer, which has now plenty of space.
+ *   buffer, which has now plenty of space. This garbage collection
+ *   is deferred until the opponent's turn when possible (while
+ *   pondering or in a background thread), and may be cut short.
  *   Once the fast_alloc mode is proven reliable, the
  *   calloc/free method will be removed. */
 
+#include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <pthread.h>
 #include "move.h"
 #include "stats.h"
@@ -48,22 +56,38 @@ struct uct;
  * +------+   +------+   +------+   +------+
  */
 
-/* TODO: Performance would benefit from a reorganization:
- * (i) Allocate all children of a node within a single block.
- * (ii) Keep all u stats together, and all amaf stats together.
- * Currently, rave_update is top source of cache misses, and
- * there is large memory overhead for having all nodes separate. */
+/* All children of a node are allocated within a single block, and their
+ * hot u and amaf stats are kept apart from the nodes in dense arrays:
+ *
+ *   [ u[0] .. u[bn-1] ][ amaf[0] .. amaf[bn-1] ][ node[0] .. node[bn-1] ][ index ]
+ *
+ * Each node knows its index within the block and the block length, so
+ * the stats can be found without extra pointers. Siblings follow each
+ * other in the block, except in local trees where each node is a block
+ * of its own. Use node_u() / node_amaf() to access the stats.
+ * Blocks of more than one node end with an index mapping each coord of
+ * the board to the position of its node in the block, so that the node
+ * of a given move can be found without scanning the block, see
+ * tree_block_node(). */
+
+/* Nodes refer to each other by 32-bit offsets from the referring node,
+ * in units of 8 bytes, so all nodes of a tree must be within
+ * TREE_REF_SPAN bytes of each other: they are all taken from the
+ * fast_alloc buffer or from the tree heap. Use node_parent() etc.
+ * to follow references and node_set_parent() etc. to set them. */
+typedef struct { int32_t off; } tree_ref_t;
+#define TREE_REF_UNIT 8
+#define TREE_REF_SPAN ((uint64_t) 1 << 34) // 16 GiB
 
 struct tree_node {
-	hash_t hash;
-	struct tree_node *parent, *sibling, *children;
+	tree_ref_t parent, sibling, children;
+
+	/* Index of the node within its block, and length of the block. */
+	unsigned short bi, bn;
 
 	/*** From here on, struct is saved/loaded from opening tbook */
 
-	struct move_stats u;
 	struct move_stats prior;
-	/* XXX: Should be way for policies to add their own stats */
-	struct move_stats amaf;
 	/* Stats before starting playout; used for distributed engine. */
 	struct move_stats pu;
 	/* Criticality information; information about final board owner
@@ -86,6 +110,8 @@ struct tree_node {
 	unsigned char d;
 
 #define TREE_HINT_INVALID 1 // don't go to this node, invalid move
+#define TREE_HINT_MOVED 2 // garbage collection copied the block, see tree_prune_children()
+#define TREE_HINT_DCNN 4 // children have dcnn priors
 	unsigned char hints;
 
 	/* In case multiple threads walk the tree, is_expanded is set
@@ -97,7 +123,110 @@ struct tree_node {
 	bool is_expanded;
 };
 
+static inline struct tree_node *
+tree_ref_node(const struct tree_node *n, tree_ref_t r)
+{
+	return r.off ? (struct tree_node *) ((char *) n + (ptrdiff_t) r.off * TREE_REF_UNIT) : NULL;
+}
+
+static inline tree_ref_t
+tree_node_ref(const struct tree_node *n, const struct tree_node *target)
+{
+	ptrdiff_t off = target ? ((char *) target - (char *) n) / TREE_REF_UNIT : 0;
+	assert(off == (int32_t) off);
+	return (tree_ref_t) { off };
+}
+
+#define node_parent(n) tree_ref_node((n), (n)->parent)
+#define node_sibling(n) tree_ref_node((n), (n)->sibling)
+#define node_children(n) tree_ref_node((n), (n)->children)
+#define node_set_parent(n, p) ((n)->parent = tree_node_ref((n), (p)))
+#define node_set_sibling(n, p) ((n)->sibling = tree_node_ref((n), (p)))
+#define node_set_children(n, p) ((n)->children = tree_node_ref((n), (p)))
+
+/* Memory taken by one node including its stats. */
+#define TREE_NODE_SIZE (sizeof(struct tree_node) + 2 * sizeof(struct move_stats))
+
+static inline struct move_stats *
+tree_node_ustats(const struct tree_node *n)
+{
+	return (struct move_stats *) (n - n->bi) - 2 * n->bn + n->bi;
+}
+
+static inline struct move_stats *
+tree_node_amafstats(const struct tree_node *n)
+{
+	return (struct move_stats *) (n - n->bi) - n->bn + n->bi;
+}
+
+#define node_u(n) (*tree_node_ustats(n))
+#define node_amaf(n) (*tree_node_amafstats(n))
+
+#define TREE_NO_NODE 0xffff
+
+/* Index at the end of the block of n, only if n->bn > 1. */
+static inline unsigned short *
+tree_node_index(const struct tree_node *n)
+{
+	return (unsigned short *) (n - n->bi + n->bn);
+}
+
+/* Node of move c in the block of n, NULL if there is none. */
+static inline struct tree_node *
+tree_block_node(struct tree_node *n, coord_t c)
+{
+	if (n->bn == 1)
+		return node_coord(n) == c ? n : NULL;
+	if (is_pass(c))
+		return node_coord(n - n->bi) == c ? n - n->bi : NULL;
+	int i = tree_node_index(n)[c];
+	return i == TREE_NO_NODE ? NULL : n - n->bi + i;
+}
+
 struct tree_hash;
+struct tree_heap;
+
+/* In fast_alloc mode, each search thread allocates nodes from its own
+ * arena, a chunk of the nodes buffer, and refills it from the buffer
+ * when exhausted. Only the refill is atomic. Arena slot of the calling
+ * thread is in tree_arena_slot: 0 for the main thread, tid + 1 for
+ * search threads. */
+#define TREE_ARENAS 256
+#define TREE_ARENA_CHUNK (1024 * 1024)
+
+struct tree_arena {
+	void *next, *end;
+	unsigned long used; // bytes allocated from this arena
+	char padding[64 - 2 * sizeof(void *) - sizeof(unsigned long)]; // one cache line each
+};
+
+extern __thread int tree_arena_slot;
+
+/* Page size and NUMA placement of the nodes buffer, see the tree_pages
+ * and tree_numa uct options. Huge pages save TLB misses during descent,
+ * interleaving spreads the buffer over the memory of all sockets
+ * instead of the one which touches it first. Linux only. */
+enum tree_pages {
+	TREE_PAGES_DEFAULT,
+	TREE_PAGES_THP, // transparent huge pages
+	TREE_PAGES_HUGETLB, // explicit huge pages, falls back to THP
+};
+#define TREE_NUMA_DEFAULT -1
+#define TREE_NUMA_INTERLEAVE -2 // otherwise bind to this node
+
+extern enum tree_pages tree_pages;
+extern int tree_numa;
+
+#define DEFAULT_DAG_HBITS 20
+#define DAG_HBITS_MIN 8
+#define DAG_HBITS_MAX 28
+
+/* Transposition table entry, maps a position to the children block
+ * of the first node which reached it. key is 0 for empty slots. */
+struct tree_tt_entry {
+	volatile hash_t key;
+	struct tree_node * volatile children;
+};
 
 struct tree {
 	struct board *board;
@@ -140,32 +269,74 @@ struct tree {
 	struct tree_hash *htable;
 	int hbits;
 
+	/* Transposition table, only in DAG mode. Nodes reaching the same
+	 * position at the same depth share their children, so a child may
+	 * have several parents; its parent field is just the first one.
+	 * Only for fast_alloc. */
+	struct tree_tt_entry *tt;
+	int tt_bits;
+
 	// Statistics
 	int max_depth;
-	volatile unsigned long nodes_size; // byte size of all allocated nodes
+	volatile unsigned long nodes_size; // byte size of nodes allocated outside the arenas, see tree_nodes_size()
 	unsigned long max_tree_size; // maximum byte size for entire tree, > 0 only for fast_alloc
 	unsigned long max_pruned_size;
 	unsigned long pruning_threshold;
 	void *nodes; // nodes buffer, only for fast_alloc
+	volatile unsigned long nodes_carved; // part of nodes buffer handed out to arenas
+	volatile bool nodes_full; // an allocation from the nodes buffer failed
+	struct tree_arena *arenas; // per-thread arenas, only for fast_alloc
+	size_t arena_chunk; // arena refill size
+	size_t nodes_mapped; // mmap()ed length of nodes buffer, 0 if malloc()ed
+	enum tree_pages pool_pages; // page size we actually got
+	struct tree_heap *heap; // nodes outside the buffer: local trees, and all nodes without fast_alloc
+
+	/* Garbage collection is not done when promoting a node but later,
+	 * off the clock if possible, see tree_garbage_collect(). */
+	bool gc_pending; // tree wants to be garbage collected
+	volatile bool gc_stop; // wrap up the running garbage collection now
+	int gc_stop_blocks; // t-unit: set gc_stop once the collection copied that many blocks
+	double gc_deadline; // for the pruning in progress, 0 if none
+	int gc_dropped; // nodes whose children the pruning in progress left out for lack of time
+	unsigned long gc_discarded; // total of these over the past collections
+
+	/* Root / hybrid thread models: a thread group's private tree,
+	 * its stats get merged into merge_to, see tree_merge(). */
+	struct tree *merge_to;
+	volatile int merging; // a thread is running tree_merge() on us
 };
 
 /* Warning: all functions below except tree_expand_node & tree_leaf_node are THREAD-UNSAFE! */
 struct tree *tree_init(struct board *board, enum stone color, unsigned long max_tree_size,
-		       unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits);
+		       unsigned long max_pruned_size, unsigned long pruning_threshold, floating_t ltree_aging, int hbits,
+		       int tt_bits);
 void tree_done(struct tree *tree);
+unsigned long tree_nodes_size(struct tree *tree);
+void tree_pool_stats(struct tree *tree, FILE *f);
 void tree_dump(struct tree *tree, double thres);
+/* Opening tbook file name for b, in the current directory. */
+char *tree_book_name(struct board *b);
 void tree_save(struct tree *tree, struct board *b, int thres);
 void tree_load(struct tree *tree, struct board *b);
 
 struct tree_node *tree_get_node(struct tree *tree, struct tree_node *node, coord_t c, bool create);
-struct tree_node *tree_garbage_collect(struct tree *tree, struct tree_node *node);
+struct tree_node *tree_garbage_collect(struct tree *tree, struct tree_node *node, double budget);
 void tree_promote_node(struct tree *tree, struct tree_node **node);
+/* Add the u stats @src gathered since the last merge to the matching nodes
+ * of @dst, down to @depth plies below the roots. Both trees must search
+ * the same position. The searches may go on meanwhile, but there must be
+ * only one merge from @src at a time; src nodes' pu keeps what was merged.
+ * With @amaf, the amaf stats of @src are added too: there is nothing to
+ * keep track of them, so this must be done only once, by the last merge
+ * of a tree created for the current search. */
+void tree_merge(struct tree *dst, struct tree *src, int depth, bool amaf);
 bool tree_promote_at(struct tree *tree, struct board *b, coord_t c);
 
 void tree_expand_node(struct tree *tree, struct tree_node *node, struct board *b, enum stone color, struct uct *u, int parity);
 struct tree_node *tree_lnode_for_node(struct tree *tree, struct tree_node *ni, struct tree_node *lni, int tenuki_d);
 
 static bool tree_leaf_node(struct tree_node *node);
+static bool tree_full(struct tree *tree, unsigned long max_tree_size);
 
 #define tree_node_parity(tree, node) \
 	((((node)->depth ^ (tree)->root->depth) & 1) ? -1 : 1)
@@ -181,7 +352,14 @@ static bool tree_leaf_node(struct tree_node *node);
 static inline bool
 tree_leaf_node(struct tree_node *node)
 {
-	return !(node->children);
+	return !node->children.off;
+}
+
+/* Cheap check whether there is no memory left for new nodes. */
+static inline bool
+tree_full(struct tree *tree, unsigned long max_tree_size)
+{
+	return tree->nodes_full || tree->nodes_size >= max_tree_size;
 }
 
 static inline floating_t
@@ -196,8 +374,8 @@ tree_node_criticality(const struct tree *t, const struct tree_node *node)
 	 * = winner_gets - (b_gets * b_wins + 1 - b_gets - b_wins + b_gets * b_wins)
 	 * = winner_gets - (2 * b_gets * b_wins - b_gets - b_wins + 1) */
 	return node->winner_owner.value
-		- (2 * node->black_owner.value * node->u.value
-		   - node->black_owner.value - node->u.value + 1);
+		- (2 * node->black_owner.value * node_u(node).value
+		   - node->black_owner.value - node_u(node).value + 1);
 }
 
 #endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <ctype.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +24,7 @@
 #include "uct/internal.h"
 #include "uct/plugins.h"
 #include "uct/prior.h"
+#include "uct/profile.h"
 #include "uct/search.h"
 #include "uct/slave.h"
 #include "uct/tree.h"
@@ -33,6 +35,7 @@
 struct uct_policy *policy_ucb1_init(struct uct *u, char *arg);
 struct uct_policy *policy_ucb1amaf_init(struct uct *u, char *arg, struct board *board);
 static void uct_pondering_start(struct uct *u, struct board *b0, struct tree *t, enum stone color);
+static void uct_gc_stop(struct uct *u);
 
 /* Maximal simulation length. */
 #define MC_GAMELEN	MAX_GAMELEN
@@ -42,9 +45,15 @@ static void
 setup_state(struct uct *u, struct board *b, enum stone color)
 {
 	u->t = tree_init(b, color, u->fast_alloc ? u->max_tree_size : 0,
-			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, u->stats_hbits);
+			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, u->stats_hbits,
+			 u->dag_hbits);
 	if (u->initial_extra_komi)
 		u->t->extra_komi = u->initial_extra_komi;
+	static bool pool_stats_shown = false;
+	if (UDEBUGL(2) && u->t->nodes && !pool_stats_shown) {
+		tree_pool_stats(u->t, stderr);
+		pool_stats_shown = true;
+	}
 	if (u->force_seed)
 		fast_srandom(u->force_seed);
 	if (UDEBUGL(3))
@@ -62,6 +71,10 @@ static void
 reset_state(struct uct *u)
 {
 	assert(u->t);
+	uct_gc_stop(u);
+	/* Playouts outside of a search may have left dcnn requests
+	 * pointing into the tree. */
+	dcnn_async_flush();
 	tree_done(u->t); u->t = NULL;
 }
 
@@ -140,6 +153,7 @@ uct_pass_is_safe(struct uct *u, struct board *b, enum stone color, bool pass_all
 	/* Make sure enough playouts are simulated to get a reasonable dead group list. */
 	while (u->ownermap.playouts < GJ_MINGAMES)
 		uct_playout(u, b, color, u->t);
+	dcnn_async_flush();
 
 	/* Save dead groups for final_status_list dead. */
 	struct move_queue unclear;
@@ -199,6 +213,7 @@ uct_ownermap(struct engine *e, struct board *b)
 		
 		while (u->ownermap.playouts < GJ_MINGAMES)
 			uct_playout(u, b, color, u->t);
+		dcnn_async_flush();
 	}
 	
 	return &u->ownermap;
@@ -270,11 +285,12 @@ uct_result(struct engine *e, struct board *b)
 
 	if (!u->t)
 		return NULL;
+	uct_gc_stop(u);
 	enum stone color = u->t->root_color;
 	struct tree_node *n = u->t->root;
 	snprintf(reply, 1024, "%s %s %d %.2f %.1f",
 		 stone2str(color), coord2sstr(node_coord(n), b),
-		 n->u.playouts, tree_node_get_value(u->t, -1, n->u.value),
+		 node_u(n).playouts, tree_node_get_value(u->t, -1, node_u(n).value),
 		 u->t->use_extra_komi ? u->t->extra_komi : 0);
 	return reply;
 }
@@ -286,12 +302,13 @@ uct_chat(struct engine *e, struct board *b, bool opponent, char *from, char *cmd
 
 	if (!u->t)
 		return generic_chat(b, opponent, from, cmd, S_NONE, pass, 0, 1, u->threads, 0.0, 0.0);
+	uct_gc_stop(u);
 
 	struct tree_node *n = u->t->root;
-	double winrate = tree_node_get_value(u->t, -1, n->u.value);
+	double winrate = tree_node_get_value(u->t, -1, node_u(n).value);
 	double extra_komi = u->t->use_extra_komi && fabs(u->t->extra_komi) >= 0.5 ? u->t->extra_komi : 0;
 
-	return generic_chat(b, opponent, from, cmd, u->t->root_color, node_coord(n), n->u.playouts, 1,
+	return generic_chat(b, opponent, from, cmd, u->t->root_color, node_coord(n), node_u(n).playouts, 1,
 			    u->threads, winrate, extra_komi);
 }
 
@@ -338,6 +355,7 @@ uct_dead_group_list(struct engine *e, struct board *b, struct move_queue *mq)
 	/* Make sure the ownermap is well-seeded. */
 	while (u->ownermap.playouts < GJ_MINGAMES)
 		uct_playout(u, b, S_BLACK, u->t);
+	dcnn_async_flush();
 	/* Show the ownermap: */
 	if (DEBUGL(2))
 		board_print_ownermap(b, stderr, &u->ownermap);
@@ -389,6 +407,7 @@ static int
 uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone color, struct tree *t, bool print_progress)
 {
 	struct uct_search_state s;
+	uct_gc_stop(u);
 	uct_search_start(u, b, color, t, ti, &s);
 	if (UDEBUGL(2) && s.base_playouts > 0)
 		fprintf(stderr, "<pre-simulated %d games>\n", s.base_playouts);
@@ -397,16 +416,12 @@ uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone colo
 	 * to reference ctx->t directly since the
 	 * thread manager will swap the tree pointer asynchronously. */
 
-	/* Now, just periodically poll the search tree. */
-	/* Note that in case of TD_GAMES, threads will not wait for
-	 * the uct_search_check_stop() signalization. */
+	/* Now, poll the search tree periodically, and as soon as
+	 * a time or playouts limit is reached (see uct_search_wait()). */
+	int i = uct_search_games(&s);
 	while (1) {
-		time_sleep(TREE_BUSYWAIT_INTERVAL);
-		/* TREE_BUSYWAIT_INTERVAL should never be less than desired time, or the
-		 * time control is broken. But if it happens to be less, we still search
-		 * at least 100ms otherwise the move is completely random. */
-
-		int i = uct_search_games(&s);
+		uct_search_wait(&s, ti, i);
+		i = uct_search_games(&s);
 		/* Print notifications etc. */
 		uct_search_progress(u, b, color, t, ti, &s, i);
 		/* Check if we should stop the search. */
@@ -430,7 +445,7 @@ uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone colo
 			.period = TT_MOVE,
 			.dim = TD_GAMES,
 		};
-		debug_ti.len.games = t->root->u.playouts + u->debug_after.playouts;
+		debug_ti.len.games = node_u(t->root).playouts + u->debug_after.playouts;
 		debug_ti.len.games_max = 0;
 
 		board_print_ownermap(b, stderr, &u->ownermap);
@@ -444,7 +459,7 @@ uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone colo
 		u->playout->debug_level = u->debug_after.level;
 		uct_halt = false;
 
-		uct_playouts(u, b, color, t, &debug_ti);
+		uct_playouts(u, b, color, t, &debug_ti, NULL);
 		tree_dump(t, u->dumpthres);
 
 		uct_halt = true;
@@ -463,7 +478,6 @@ uct_search(struct uct *u, struct board *b, struct time_info *ti, enum stone colo
 static void
 uct_pondering_start(struct uct *u, struct board *b0, struct tree *t, enum stone color)
 {
-	assert(!using_dcnn(b0));
 	if (UDEBUGL(1))
 		fprintf(stderr, "Starting to ponder with color %s\n", stone2str(stone_other(color)));
 	u->pondering = true;
@@ -482,22 +496,60 @@ uct_pondering_start(struct uct *u, struct board *b0, struct tree *t, enum stone
 	uct_search_start(u, b, color, t, NULL, &s);
 }
 
+/* Without pondering, we still garbage collect the tree in the
+ * background during the opponent's turn. */
+static pthread_t gc_thread;
+static bool gc_thread_running;
+
+static void *
+uct_gc_worker(void *data)
+{
+	struct tree *t = data;
+	uct_profile_thread(UCT_PROFILE_GC_SLOT);
+	t->root = tree_garbage_collect(t, t->root, 0);
+	return NULL;
+}
+
+static void
+uct_gc_start(struct uct *u)
+{
+	assert(!gc_thread_running && !thread_manager_running);
+	pthread_create(&gc_thread, NULL, uct_gc_worker, u->t);
+	gc_thread_running = true;
+}
+
+static void
+uct_gc_stop(struct uct *u)
+{
+	if (!gc_thread_running)
+		return;
+	u->t->gc_stop = true;
+	pthread_join(gc_thread, NULL);
+	gc_thread_running = false;
+	u->t->gc_stop = false;
+}
+
 /* uct_search_stop() frontend for the pondering (non-genmove) mode, and
- * to stop the background search for a slave in the distributed engine. */
+ * to stop the background search for a slave in the distributed engine.
+ * Also stops background garbage collection. */
 void
 uct_pondering_stop(struct uct *u)
 {
+	uct_gc_stop(u);
 	if (!thread_manager_running)
 		return;
 
-	/* Stop the thread manager. */
+	/* Stop the thread manager, cutting short any garbage
+	 * collection it is doing. */
+	if (u->t)  u->t->gc_stop = true;
 	struct uct_thread_ctx *ctx = uct_search_stop();
+	if (u->t)  u->t->gc_stop = false;
 	if (UDEBUGL(1)) {
 		if (u->pondering) fprintf(stderr, "(pondering) ");
 		uct_progress_status(u, ctx->t, ctx->color, ctx->games, NULL);
 	}
 	if (u->pondering) {
-		free(ctx->b);
+		board_done(ctx->b);
 		u->pondering = false;
 	}
 }
@@ -556,12 +608,14 @@ genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone colo
 	reset_dcnn_time();
 	double start_time = time_now();
 	struct uct *u = e->data;
+	uct_prior_cache_reset_stats(u->prior);
 	u->pass_all_alive |= pass_all_alive;
 	uct_pondering_stop(u);
 
-	if (using_dcnn(b)) {
+	if (using_dcnn(b) && !u->pondering_opt) {
 		// dcnn hack: reset state to make dcnn priors kick in.
-		// FIXME this makes pondering useless when using dcnn ...
+		// When pondering, the tree got them in the background
+		// instead, see uct_prior_dcnn_root().
 		if (u->t) {
 			u->initial_extra_komi = u->t->extra_komi;
 			reset_state(u);
@@ -571,7 +625,7 @@ genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone colo
 	uct_genmove_setup(u, b, color);
 
         /* Start the Monte Carlo Tree Search! */
-	int base_playouts = u->t->root->u.playouts;
+	int base_playouts = node_u(u->t->root).playouts;
 	int played_games = uct_search(u, b, ti, color, u->t, false);
 
 	struct tree_node *best;
@@ -582,6 +636,16 @@ genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone colo
 		double mcts_time  = total_time - get_dcnn_time();
 		fprintf(stderr, "genmove in %0.2fs (%d games/s, %d games/s/thread)\n",
 			total_time, (int)(played_games/mcts_time), (int)(played_games/mcts_time/u->threads));
+		if (using_dcnn(b)) {
+			int hits, misses;
+			get_dcnn_cache_stats(&hits, &misses);
+			fprintf(stderr, "dcnn in %0.2fs, cache %d hits %d misses\n", get_dcnn_time(), hits, misses);
+		}
+		int hits, misses;
+		uct_prior_cache_stats(u->prior, &hits, &misses);
+		if (hits + misses)
+			fprintf(stderr, "prior cache %d hits %d misses (%.1f%%)\n",
+				hits, misses, hits * 100.0 / (hits + misses));
 	}
 
 	uct_progress_status(u, u->t, color, played_games, best_coord);
@@ -620,6 +684,8 @@ uct_genmove(struct engine *e, struct board *b, struct time_info *ti, enum stone
 	 * the UCT will start cutting off any playouts. */
 	if (u->pondering_opt && u->t && !is_pass(node_coord(best))) {
 		uct_pondering_start(u, b, u->t, stone_other(color));
+	} else if (u->t && u->t->gc_pending) {
+		uct_gc_start(u);
 	}
 
 	return best_coord;
@@ -633,12 +699,12 @@ uct_get_best_moves(struct tree *t, coord_t *best_c, float *best_r, int nbest, bo
 	for (int i = 0; i < nbest; i++)  best_r[i] = 0;
 	
 	/* Find best moves */
-	for (struct tree_node *n = t->root->children; n; n = n->sibling)
-		best_moves_add_full(node_coord(n), n->u.playouts, n, best_c, best_r, (void**)best_d, nbest);
+	for (struct tree_node *n = node_children(t->root); n; n = node_sibling(n))
+		best_moves_add_full(node_coord(n), node_u(n).playouts, n, best_c, best_r, (void**)best_d, nbest);
 
 	if (winrates)  /* Get winrates */
 		for (int i = 0; i < nbest && best_c[i] != pass; i++)
-			best_r[i] = tree_node_get_value(t, 1, best_d[i]->u.value);
+			best_r[i] = tree_node_get_value(t, 1, node_u(best_d[i]).value);
 }
 
 /* Kindof like uct_genmove() but find the best candidates */
@@ -668,7 +734,7 @@ uct_gentbook(struct engine *e, struct board *b, struct time_info *ti, enum stone
 
 	if (ti->dim == TD_GAMES) {
 		/* Don't count in games that already went into the tbook. */
-		ti->len.games += u->t->root->u.playouts;
+		ti->len.games += node_u(u->t->root).playouts;
 	}
 	uct_search(u, b, ti, color, u->t, true);
 
@@ -683,7 +749,7 @@ uct_dumptbook(struct engine *e, struct board *b, enum stone color)
 {
 	struct uct *u = e->data;
 	struct tree *t = tree_init(b, color, u->fast_alloc ? u->max_tree_size : 0,
-			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, 0);
+			 u->max_pruned_size, u->pruning_threshold, u->local_tree_aging, 0, 0);
 	tree_load(t, b);
 	tree_dump(t, 0);
 	tree_done(t);
@@ -699,8 +765,10 @@ uct_evaluate_one(struct engine *e, struct board *b, struct time_info *ti, coord_
 	board_copy(&b2, b);
 	struct move m = { c, color };
 	int res = board_play(&b2, &m);
-	if (res < 0)
+	if (res < 0) {
+		board_done_noalloc(&b2);
 		return NAN;
+	}
 	color = stone_other(color);
 
 	if (u->t) reset_state(u);
@@ -713,10 +781,11 @@ uct_evaluate_one(struct engine *e, struct board *b, struct time_info *ti, coord_
 	if (!best) {
 		bestval = NAN; // the opponent has no reply!
 	} else {
-		bestval = tree_node_get_value(u->t, 1, best->u.value);
+		bestval = tree_node_get_value(u->t, 1, node_u(best).value);
 	}
 
 	reset_state(u); // clean our junk
+	board_done_noalloc(&b2);
 
 	return isnan(bestval) ? NAN : 1.0f - bestval;
 }
@@ -747,15 +816,19 @@ uct_state_init(char *arg, struct board *b)
 	u->mercymin = 0;
 	u->significant_threshold = 50;
 	u->expand_p = 8;
+	u->leaf_playouts = 1;
 	u->dumpthres = 0.01;
 	u->playout_amaf = true;
 	u->amaf_prior = false;
 	u->max_tree_size = 1408ULL * 1048576;
 	u->fast_alloc = true;
 	u->pruning_threshold = 0;
+	u->gc_budget = 1.0;
 
 	u->threads = 1;
 	u->thread_model = TM_TREEVL;
+	u->group_threads = 8;
+	u->merge_depth = 2;
 	u->virtual_loss = 1;
 
 	u->pondering_opt = false;
@@ -973,6 +1046,15 @@ uct_state_init(char *arg, struct board *b)
 				/* Expand UCT nodes after it has been
 				 * visited this many times. */
 				u->expand_p = atoi(optval);
+			} else if (!strcasecmp(optname, "leaf_playouts") && optval) {
+				/* Run this many playouts from the leaf at
+				 * each tree descent, to spread the descent
+				 * cost on large boards. */
+				u->leaf_playouts = atoi(optval);
+				if (u->leaf_playouts < 1 || u->leaf_playouts > LEAF_PLAYOUTS_MAX) {
+					fprintf(stderr, "UCT: Invalid leaf_playouts %s\n", optval);
+					exit(1);
+				}
 			} else if (!strcasecmp(optname, "random_policy_chance") && optval) {
 				/* If specified (N), with probability 1/N, random_policy policy
 				 * descend is used instead of main policy descend; useful
@@ -1012,6 +1094,10 @@ uct_state_init(char *arg, struct board *b)
 				/* By default, Pachi will run with only single
 				 * tree search thread! */
 				u->threads = atoi(optval);
+				if (u->threads >= TREE_ARENAS) {
+					fprintf(stderr, "UCT: At most %d threads supported\n", TREE_ARENAS - 1);
+					exit(1);
+				}
 			} else if (!strcasecmp(optname, "thread_model") && optval) {
 				if (!strcasecmp(optval, "tree")) {
 					/* Tree parallelization - all threads
@@ -1024,10 +1110,39 @@ uct_state_init(char *arg, struct board *b)
 					 * rages most threads choosing the
 					 * same tree branches to read. */
 					u->thread_model = TM_TREEVL;
+				} else if (!strcasecmp(optval, "root")) {
+					/* Root parallelization - each thread
+					 * searches a tree of its own, merged
+					 * into the main tree as it goes. Less
+					 * contention on the top nodes. */
+					u->thread_model = TM_ROOT;
+				} else if (!strcasecmp(optval, "hybrid")) {
+					/* Tree parallelization with virtual
+					 * loss within groups of group_threads
+					 * threads, root parallelization
+					 * between the groups. */
+					u->thread_model = TM_HYBRID;
 				} else {
 					fprintf(stderr, "UCT: Invalid thread model %s\n", optval);
 					exit(1);
 				}
+			} else if (!strcasecmp(optname, "group_threads") && optval) {
+				/* Threads sharing a tree in the hybrid thread model. */
+				u->group_threads = atoi(optval);
+				if (u->group_threads < 1) {
+					fprintf(stderr, "UCT: Invalid group_threads %s\n", optval);
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "merge_depth") && optval) {
+				/* Root and hybrid thread models: number of plies of
+				 * the group trees merged into the main tree (0 is
+				 * just the root). */
+				u->merge_depth = atoi(optval);
+			} else if (!strcasecmp(optname, "pin_threads")) {
+				/* Pin search thread i to cpu i (Linux only). Search
+				 * threads persist between searches, so this only
+				 * applies to threads not created yet. */
+				u->pin_threads = !optval || atoi(optval);
 			} else if (!strcasecmp(optname, "virtual_loss") && optval) {
 				/* Number of virtual losses added before evaluating a node. */
 				u->virtual_loss = atoi(optval);
@@ -1037,7 +1152,10 @@ uct_state_init(char *arg, struct board *b)
 			} else if (!strcasecmp(optname, "max_tree_size") && optval) {
 				/* Maximum amount of memory [MiB] consumed by the move tree.
 				 * For fast_alloc it includes the temp tree used for pruning.
-				 * Default is 3072 (3 GiB). */
+				 * Default is 3072 (3 GiB), at most 16384 since nodes
+				 * refer to each other by 32-bit offsets (TREE_REF_SPAN).
+				 * Split between the trees of all thread groups in the
+				 * root and hybrid thread models. */
 				u->max_tree_size = atol(optval) * 1048576;
 			} else if (!strcasecmp(optname, "fast_alloc")) {
 				u->fast_alloc = !optval || atoi(optval);
@@ -1047,6 +1165,55 @@ uct_state_init(char *arg, struct board *b)
 				 * Increase to reduce pruning time overhead if memory is plentiful.
 				 * This option is meaningful only for fast_alloc. */
 				u->pruning_threshold = atol(optval) * 1048576;
+			} else if (!strcasecmp(optname, "tree_pages") && optval) {
+				/* Page size for the fast_alloc nodes buffer:
+				 * "thp" for transparent huge pages, "huge" for
+				 * explicit huge pages (reserve them in
+				 * /proc/sys/vm/nr_hugepages, else falls back to thp),
+				 * "default" for normal pages. Linux only. */
+				if (!strcasecmp(optval, "thp"))
+					tree_pages = TREE_PAGES_THP;
+				else if (!strcasecmp(optval, "huge"))
+					tree_pages = TREE_PAGES_HUGETLB;
+				else if (!strcasecmp(optval, "default"))
+					tree_pages = TREE_PAGES_DEFAULT;
+				else {
+					fprintf(stderr, "UCT: Invalid tree_pages %s\n", optval);
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "tree_numa") && optval) {
+				/* NUMA placement of the fast_alloc nodes buffer:
+				 * "interleave" to spread it over all NUMA nodes,
+				 * or a node number to bind it there. Linux only. */
+				if (!strcasecmp(optval, "interleave"))
+					tree_numa = TREE_NUMA_INTERLEAVE;
+				else if (isdigit(*optval) && atoi(optval) < 64)
+					tree_numa = atoi(optval);
+				else {
+					fprintf(stderr, "UCT: Invalid tree_numa %s\n", optval);
+					exit(1);
+				}
+			} else if (!strcasecmp(optname, "gc_budget") && optval) {
+				/* Tree pruning is done during the opponent's turn
+				 * if possible. If it has to happen on our time,
+				 * spend at most this many seconds copying nodes,
+				 * dropping what could not be copied. 0 means no limit.
+				 * This option is meaningful only for fast_alloc. */
+				u->gc_budget = atof(optval);
+			} else if (!strcasecmp(optname, "dag")) {
+				/* Merge transpositions: nodes reaching the same position
+				 * share their children, making the tree a DAG. Optional
+				 * value is log2 of the transposition table size,
+				 * DAG_HBITS_MIN..DAG_HBITS_MAX, 0 turns dag off.
+				 * Meaningful only for fast_alloc. */
+				u->dag = !optval || atoi(optval);
+				u->dag_hbits = 0;
+				if (u->dag && optval) {
+					int bits = atoi(optval);
+					u->dag_hbits = bits < DAG_HBITS_MIN ? DAG_HBITS_MIN : bits > DAG_HBITS_MAX ? DAG_HBITS_MAX : bits;
+					if (u->dag_hbits != bits)
+						fprintf(stderr, "dag size %d out of range, using %d.\n", bits, u->dag_hbits);
+				}
 
 			/** Time control */
 
@@ -1329,6 +1496,13 @@ uct_state_init(char *arg, struct board *b)
 		u->local_tree_aging = 1.0f;
 	}
 
+	/* Root / hybrid thread models: max_tree_size is shared
+	 * by the trees of all thread groups. */
+	u->max_tree_size /= uct_thread_groups(u);
+
+	if (u->max_tree_size > TREE_REF_SPAN)
+		die("max_tree_size is limited to %lu MiB\n", (unsigned long) (TREE_REF_SPAN / 1048576));
+
 	if (u->fast_alloc) {
 		if (u->pruning_threshold < u->max_tree_size / 10)
 			u->pruning_threshold = u->max_tree_size / 10;
@@ -1343,10 +1517,24 @@ uct_state_init(char *arg, struct board *b)
 		/* Reserve 5% memory in case the background free() are slower
 		 * than the concurrent allocations. */
 		u->max_tree_size -= u->max_tree_size / 20;
+		if (u->dag) {
+			fprintf(stderr, "dag requires fast_alloc, turned off.\n");
+			u->dag = false;
+		}
+	}
+	if (u->dag && u->slave) {
+		/* Slaves identify nodes by their path. */
+		fprintf(stderr, "dag can't be used by slaves, turned off.\n");
+		u->dag = false;
 	}
+	if (!u->dag)
+		u->dag_hbits = 0;
+	else if (!u->dag_hbits)
+		u->dag_hbits = DEFAULT_DAG_HBITS;
 
 	if (!u->prior)
 		u->prior = uct_prior_init(NULL, b, u);
+	uct_prior_cache_init(u->prior, b, u->thread_model == TM_ROOT || u->thread_model == TM_HYBRID);
 
 	if (!u->playout)
 		u->playout = playout_moggy_init(NULL, b, u->jdict);
@@ -1367,11 +1555,6 @@ uct_state_init(char *arg, struct board *b)
 		u->dynkomi = board_small(b) ? uct_dynkomi_init_none(u, NULL, b)
 			: uct_dynkomi_init_linear(u, NULL, b);
 
-	if (u->pondering_opt && using_dcnn(b)) {
-		fprintf(stderr, "Can't use pondering with dcnn, pondering turned off.\n");
-		u->pondering_opt = false;
-	}
-
 	/* Some things remain uninitialized for now - the opening tbook
 	 * is not loaded and the tree not set up. */
 	/* This will be initialized in setup_state() at the first move
@@ -11,4 +11,8 @@ struct time_info;
 bool uct_gentbook(struct engine *e, struct board *b, struct time_info *ti, enum stone color);
 void uct_dumptbook(struct engine *e, struct board *b, enum stone color);
 
+/* Profile of the last search, see uct/profile.h. False if there is none. */
+struct uct_profile;
+bool uct_search_profile(struct uct_profile *p);
+
 #endif
@@ -17,6 +17,7 @@
 #include "tactics/util.h"
 #include "uct/dynkomi.h"
 #include "uct/internal.h"
+#include "uct/profile.h"
 #include "uct/search.h"
 #include "uct/tree.h"
 #include "uct/uct.h"
@@ -40,7 +41,7 @@ uct_progress_text(struct uct *u, struct tree *t, enum stone color, int playouts)
 		return;
 	}
 	fprintf(stderr, "[%d] ", playouts);
-	fprintf(stderr, "best %.1f%% ", 100 * tree_node_get_value(t, 1, best->u.value));
+	fprintf(stderr, "best %.1f%% ", 100 * tree_node_get_value(t, 1, node_u(best).value));
 
 	/* Dynamic komi */
 	if (t->use_extra_komi)
@@ -49,7 +50,7 @@ uct_progress_text(struct uct *u, struct tree *t, enum stone color, int playouts)
 	/* Best sequence */
 	fprintf(stderr, "| seq ");
 	for (int depth = 0; depth < 4; depth++) {
-		if (best && best->u.playouts >= 25) {
+		if (best && node_u(best).playouts >= 25) {
 			fprintf(stderr, "%3s ", coord2sstr(node_coord(best), b));
 			best = u->policy->choose(u->policy, best, b, color, resign);
 		} else {
@@ -72,7 +73,7 @@ uct_progress_text(struct uct *u, struct tree *t, enum stone color, int playouts)
 
 	/* Tree memory usage */
 	if (UDEBUGL(3))
-		fprintf(stderr, " | %.1fMb", (float)t->nodes_size / 1024 / 1024);
+		fprintf(stderr, " | %.1fMb", (float)tree_nodes_size(t) / 1024 / 1024);
 	
 	fprintf(stderr, "\n");
 }
@@ -87,7 +88,7 @@ uct_progress_gogui_sequence(strbuf_t *buf, struct uct *u, struct tree *t, enum s
 	struct tree_node *best = u->policy->choose(u->policy, t->root, t->board, color, resign);
 	if (!best) {  fprintf(stderr, "... No moves left\n"); return;  }
 	
-	for (int i = 0; i < 4 && best && best->u.playouts >= 25; i++) {
+	for (int i = 0; i < 4 && best && node_u(best).playouts >= 25; i++) {
 		seq[i] = node_coord(best);
 		best = u->policy->choose(u->policy, best, t->board, color, resign);
 	}
@@ -132,13 +133,19 @@ uct_progress_json(struct uct *u, struct tree *t, enum stone color, int playouts,
 		/* Final move choice */
 		fprintf(stderr, ", \"choice\": \"%s\"",
 			coord2sstr(*final, t->board));
+		/* Search profile */
+		struct uct_profile p;
+		if (uct_search_profile(&p)) {
+			fprintf(stderr, ", \"profile\": ");
+			uct_profile_json(stderr, &p);
+		}
 	} else {
 		struct tree_node *best = u->policy->choose(u->policy, t->root, t->board, color, resign);
 		if (best) {
 			/* Best move */
 			fprintf(stderr, ", \"best\": {\"%s\": %f}",
 				coord2sstr(best->coord, t->board),
-				tree_node_get_value(t, 1, best->u.value));
+				tree_node_get_value(t, 1, node_u(best).value));
 		}
 	}
 
@@ -146,13 +153,13 @@ uct_progress_json(struct uct *u, struct tree *t, enum stone color, int playouts,
 	int cans = 4;
 	struct tree_node *can[cans];
 	memset(can, 0, sizeof(can));
-	struct tree_node *best = t->root->children;
+	struct tree_node *best = node_children(t->root);
 	while (best) {
 		int c = 0;
-		while ((!can[c] || best->u.playouts > can[c]->u.playouts) && ++c < cans);
+		while ((!can[c] || node_u(best).playouts > node_u(can[c]).playouts) && ++c < cans);
 		for (int d = 0; d < c; d++) can[d] = can[d + 1];
 		if (c > 0) can[c - 1] = best;
-		best = best->sibling;
+		best = node_sibling(best);
 	}
 	fprintf(stderr, ", \"can\": [");
 	while (--cans >= 0) {
@@ -161,10 +168,10 @@ uct_progress_json(struct uct *u, struct tree *t, enum stone color, int playouts,
 		fprintf(stderr, "%s[", cans < 3 ? ", " : "");
 		best = can[cans];
 		for (int depth = 0; depth < 4; depth++) {
-			if (!best || best->u.playouts < 25) break;
+			if (!best || node_u(best).playouts < 25) break;
 			fprintf(stderr, "%s{\"%s\":%.3f}", depth > 0 ? "," : "",
 				coord2sstr(best->coord, t->board),
-				tree_node_get_value(t, 1, best->u.value));
+				tree_node_get_value(t, 1, node_u(best).value));
 			best = u->policy->choose(u->policy, best, t->board, color, resign);
 		}
 		fprintf(stderr, "]");
@@ -289,8 +296,8 @@ uct_leaf_node(struct uct *u, struct board *b, enum stone player_color,
 
 	if (UDEBUGL(7))
 		fprintf(stderr, "%s*-- UCT playout #%d start [%s] %f\n",
-			spaces, n->u.playouts, coord2sstr(node_coord(n), t->board),
-			tree_node_get_value(t, -parity, n->u.value));
+			spaces, node_u(n).playouts, coord2sstr(node_coord(n), t->board),
+			tree_node_get_value(t, -parity, node_u(n).value));
 
 	struct uct_playout_callback upc = {
 		.uct = u,
@@ -307,9 +314,11 @@ uct_leaf_node(struct uct *u, struct board *b, enum stone player_color,
 		.postpolicy_hook = uct_playout_postpolicy,
 		.hook_data = &upc,
 	};
+	int prof = uct_profile_enter(UP_PLAYOUT);
 	int result = play_random_game(&ps, b, next_color,
 	                              u->playout_amaf ? amaf : NULL,
 				      &u->ownermap, u->playout);
+	uct_profile_leave(prof);
 	if (next_color == S_WHITE) {
 		/* We need the result from black's perspective. */
 		result = - result;
@@ -336,7 +345,7 @@ scale_value(struct uct *u, struct board *b, enum stone node_color, struct tree_n
 		if (u->val_bytemp) {
 			/* xvalue is 0 at 0.5, 1 at 0 or 1 */
 			/* No correction for parity necessary. */
-			double xvalue = significant[node_color - 1] ? fabs(significant[node_color - 1]->u.value - 0.5) * 2 : 0;
+			double xvalue = significant[node_color - 1] ? fabs(node_u(significant[node_color - 1]).value - 0.5) * 2 : 0;
 			scale = u->val_bytemp_min + (u->val_scale - u->val_bytemp_min) * xvalue;
 		}
 
@@ -395,7 +404,7 @@ record_local_sequence(struct uct *u, struct tree *t, struct board *endb,
 
 	/* Pick the right local tree root... */
 	struct tree_node *lnode = seq_color == S_BLACK ? t->ltree_black : t->ltree_white;
-	lnode->u.playouts++;
+	stats_add_playouts(&node_u(lnode), 1);
 
 	/* ...determine the sequence value... */
 	double sval = 0.5;
@@ -435,7 +444,7 @@ record_local_sequence(struct uct *u, struct tree *t, struct board *endb,
 			stone2str(color), rval, descent[di].node->d);
 		lnode = tree_get_node(t, lnode, node_coord(descent[di++].node), true);
 		assert(lnode);
-		stats_add_result(&lnode->u, rval, pval);
+		stats_add_result(&node_u(lnode), rval, pval);
 	}
 
 	/* Add lnode for tenuki (pass) if we descended further. */
@@ -444,21 +453,24 @@ record_local_sequence(struct uct *u, struct tree *t, struct board *endb,
 		LTREE_DEBUG fprintf(stderr, "pass ");
 		lnode = tree_get_node(t, lnode, pass, true);
 		assert(lnode);
-		stats_add_result(&lnode->u, rval, pval);
+		stats_add_result(&node_u(lnode), rval, pval);
 	}
 	
 	LTREE_DEBUG fprintf(stderr, "\n");
 }
 
 
-int
-uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t)
+/* Simulation on b2, a scratch copy of b. The number of playouts
+ * actually run (none if the descent hit an invalid move) is added
+ * to *games. */
+static int
+uct_playout_board(struct uct *u, struct board *b, struct board *b2, enum stone player_color, struct tree *t, int *games)
 {
-	struct board b2;
-	board_copy(&b2, b);
-
-	struct playout_amafmap amaf;
-	amaf.gamelen = amaf.game_baselen = 0;
+	int prof = uct_profile_enter(UP_WALK);
+	/* One amaf map per leaf playout, they share the descent part. */
+	struct playout_amafmap amafs[LEAF_PLAYOUTS_MAX];
+	struct playout_amafmap *amaf = &amafs[0];
+	amaf->gamelen = amaf->game_baselen = 0;
 
 	/* Walk the tree until we find a leaf, then expand it and do
 	 * a random playout. */
@@ -483,18 +495,18 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 	 * with higher than configured number of playouts). For black
 	 * and white. */
 	struct tree_node *significant[2] = { NULL, NULL };
-	if (n->u.playouts >= u->significant_threshold)
+	if (node_u(n).playouts >= u->significant_threshold)
 		significant[node_color - 1] = n;
 
-	int result;
-	int pass_limit = (board_size(&b2) - 2) * (board_size(&b2) - 2) / 2;
+	int result = 0;
+	int pass_limit = (board_size(b2) - 2) * (board_size(b2) - 2) / 2;
 	int passes = is_pass(b->last_move.coord) && b->moves > 0;
 
 	/* debug */
 	static char spaces[] = "\0                                                      ";
 	/* /debug */
 	if (UDEBUGL(8))
-		fprintf(stderr, "--- (#%d) UCT walk with color %d\n", t->root->u.playouts, player_color);
+		fprintf(stderr, "--- (#%d) UCT walk with color %d\n", node_u(t->root).playouts, player_color);
 
 	while (!tree_leaf_node(n) && passes < 2) {
 		spaces[dlen - 1] = ' '; spaces[dlen] = 0;
@@ -516,42 +528,46 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 			descent[dlen].lnode = node_color == S_BLACK ? t->ltree_black : t->ltree_white;
 		}
 
+		int dprof = uct_profile_enter(UP_DESCENT);
 		if (!u->random_policy_chance || fast_random(u->random_policy_chance))
-			u->policy->descend(u->policy, t, &descent[dlen], parity, b2.moves > pass_limit);
+			u->policy->descend(u->policy, t, &descent[dlen], parity, b2->moves > pass_limit);
 		else
-			u->random_policy->descend(u->random_policy, t, &descent[dlen], parity, b2.moves > pass_limit);
+			u->random_policy->descend(u->random_policy, t, &descent[dlen], parity, b2->moves > pass_limit);
+		uct_profile_leave(dprof);
 
 
 		/*** Perform the descent: */
 
-		if (descent[dlen].node->u.playouts >= u->significant_threshold) {
+		if (node_u(descent[dlen].node).playouts >= u->significant_threshold) {
 			significant[node_color - 1] = descent[dlen].node;
 		}
 
 		seq_value.playouts += descent[dlen].value.playouts;
 		seq_value.value += descent[dlen].value.value * descent[dlen].value.playouts;
 		n = descent[dlen++].node;
-		assert(n == t->root || n->parent);
+		assert(n == t->root || node_parent(n));
 		if (UDEBUGL(7))
 			fprintf(stderr, "%s+-- UCT sent us to [%s:%d] %d,%f\n",
 			        spaces, coord2sstr(node_coord(n), t->board),
-				node_coord(n), n->u.playouts,
-				tree_node_get_value(t, parity, n->u.value));
+				node_coord(n), node_u(n).playouts,
+				tree_node_get_value(t, parity, node_u(n).value));
 
 		if (u->virtual_loss)
 			__sync_fetch_and_add(&n->descents, u->virtual_loss);
 
 		struct move m = { node_coord(n), node_color };
-		int res = board_play(&b2, &m);
+		int pprof = uct_profile_enter(UP_PLAY);
+		int res = board_play(b2, &m);
+		uct_profile_leave(pprof);
 
-		if (res < 0 || (!is_pass(m.coord) && !group_at(&b2, m.coord)) /* suicide */
-		    || b2.superko_violation) {
+		if (res < 0 || (!is_pass(m.coord) && !group_at(b2, m.coord)) /* suicide */
+		    || b2->superko_violation) {
 			if (UDEBUGL(4)) {
-				for (struct tree_node *ni = n; ni; ni = ni->parent)
-					fprintf(stderr, "%s<%"PRIhash"> ", coord2sstr(node_coord(ni), t->board), ni->hash);
+				for (struct tree_node *ni = n; ni; ni = node_parent(ni))
+					fprintf(stderr, "%s<%p> ", coord2sstr(node_coord(ni), t->board), ni);
 				fprintf(stderr, "marking invalid %s node %d,%d res %d group %d spk %d\n",
 				        stone2str(node_color), coord_x(node_coord(n),b), coord_y(node_coord(n),b),
-					res, group_at(&b2, m.coord), b2.superko_violation);
+					res, group_at(b2, m.coord), b2->superko_violation);
 			}
 			n->hints |= TREE_HINT_INVALID;
 			result = 0;
@@ -559,7 +575,7 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 		}
 
 		assert(node_coord(n) >= -1);
-		record_amaf_move(&amaf, node_coord(n), board_playing_ko_threat(&b2));
+		record_amaf_move(amaf, node_coord(n), board_playing_ko_threat(b2));
 
 		if (is_pass(node_coord(n)))
 			passes++;
@@ -570,20 +586,20 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 		/* We need to make sure only one thread expands the node. If
 		 * we are unlucky enough for two threads to meet in the same
 		 * node, the latter one will simply do another simulation from
-		 * the node itself, no big deal. t->nodes_size may exceed
-		 * the maximum in multi-threaded case but not by much so it's ok.
+		 * the node itself, no big deal. In calloc mode t->nodes_size may
+		 * exceed the maximum in multi-threaded case but not by much so it's ok.
 		 * The size test must be before the test&set not after, to allow
 		 * expansion of the node later if enough nodes have been freed. */
 		if (tree_leaf_node(n)
-		    && n->u.playouts - u->virtual_loss >= u->expand_p && t->nodes_size < u->max_tree_size
+		    && node_u(n).playouts - u->virtual_loss >= u->expand_p && !tree_full(t, u->max_tree_size)
 		    && !__sync_lock_test_and_set(&n->is_expanded, 1))
-			tree_expand_node(t, n, &b2, next_color, u, -parity);
+			tree_expand_node(t, n, b2, next_color, u, -parity);
 	}
 
-	amaf.game_baselen = amaf.gamelen;
+	amaf->game_baselen = amaf->gamelen;
 
 	if (t->use_extra_komi && u->dynkomi->persim) {
-		b2.komi += round(u->dynkomi->persim(u->dynkomi, &b2, t, n));
+		b2->komi += round(u->dynkomi->persim(u->dynkomi, b2, t, n));
 	}
 
 	/* !!! !!! !!!
@@ -592,76 +608,139 @@ uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree
 	 * number is black's win! Be VERY CAREFUL.
 	 * !!! !!! !!! */
 
-	// assert(tree_leaf_node(n));
-	/* In case of parallel tree search, the assertion might
-	 * not hold if two threads chew on the same node. */
-	result = uct_leaf_node(u, &b2, player_color, &amaf, descent, &dlen, significant, t, n, node_color, spaces);
+	/* With leaf_playouts > 1, the descent is shared by several playouts
+	 * from the leaf, each of them starting from a rollback of b2. Their
+	 * results go to the tree in a single policy update. */
+	struct board leaf;
+	if (u->leaf_playouts > 1)
+		board_copy(&leaf, b2);
+	floating_t rval[LEAF_PLAYOUTS_MAX], rsum = 0, ssum = 0;
+
+	for (int k = 0; k < u->leaf_playouts; k++) {
+		if (k > 0) {
+			board_rollback(b2, &leaf);
+			amaf = &amafs[k];
+			int baselen = amafs[0].game_baselen;
+			memcpy(amaf->game, amafs[0].game, baselen * sizeof(amaf->game[0]));
+			memcpy(amaf->is_ko_capture, amafs[0].is_ko_capture, baselen * sizeof(amaf->is_ko_capture[0]));
+			amaf->gamelen = amaf->game_baselen = baselen;
+		}
+
+		// assert(tree_leaf_node(n));
+		/* In case of parallel tree search, the assertion might
+		 * not hold if two threads chew on the same node. */
+		result = uct_leaf_node(u, b2, player_color, amaf, descent, &dlen, significant, t, n, node_color, spaces);
+
+		if (u->policy->wants_amaf && u->playout_amaf_cutoff) {
+			unsigned int cutoff = amaf->game_baselen;
+			cutoff += (amaf->gamelen - amaf->game_baselen) * u->playout_amaf_cutoff / 100;
+			amaf->gamelen = cutoff;
+		}
 
-	if (u->policy->wants_amaf && u->playout_amaf_cutoff) {
-		unsigned int cutoff = amaf.game_baselen;
-		cutoff += (amaf.gamelen - amaf.game_baselen) * u->playout_amaf_cutoff / 100;
-		amaf.gamelen = cutoff;
+		rval[k] = scale_value(u, b, node_color, significant, result);
+		rsum += rval[k];
+		ssum += (float)result / 2;
+
+		if (u->local_tree && node_parent(n) && !is_pass(node_coord(n)) && dlen > 0) {
+			/* Get the local sequences and record them in ltree. */
+			/* We will look for sequence starts in our descent
+			 * history, then run record_local_sequence() for each
+			 * found sequence start; record_local_sequence() may
+			 * pick longer sequences from descent history then,
+			 * which is expected as it will create new lnodes. */
+			int lprof = uct_profile_enter(UP_LTREE);
+			enum stone seq_color = player_color;
+			/* First move always starts a sequence. */
+			record_local_sequence(u, t, b2, descent, dlen, 1, seq_color);
+			seq_color = stone_other(seq_color);
+			for (int dseqi = 2; dseqi < dlen; dseqi++, seq_color = stone_other(seq_color)) {
+				if (u->local_tree_allseq) {
+					/* We are configured to record all subsequences. */
+					record_local_sequence(u, t, b2, descent, dlen, dseqi, seq_color);
+					continue;
+				}
+				if (descent[dseqi].node->d >= u->tenuki_d) {
+					/* Tenuki! Record the fresh sequence. */
+					record_local_sequence(u, t, b2, descent, dlen, dseqi, seq_color);
+					continue;
+				}
+				if (descent[dseqi].lnode && !descent[dseqi].lnode) {
+					/* Record result for in-descent picked sequence. */
+					record_local_sequence(u, t, b2, descent, dlen, dseqi, seq_color);
+					continue;
+				}
+			}
+			uct_profile_leave(lprof);
+		}
 	}
 
-	/* Record the result. */
+	/* Record the results. */
 
-	assert(n == t->root || n->parent);
-	floating_t rval = scale_value(u, b, node_color, significant, result);
-	u->policy->update(u->policy, t, n, node_color, player_color, &amaf, &b2, rval);
+	assert(n == t->root || node_parent(n));
+	int k = u->leaf_playouts;
+	int uprof = uct_profile_enter(UP_UPDATE);
+	u->policy->update(u->policy, t, descent, dlen, node_color, player_color, amafs, b2, rval, k);
+	uct_profile_leave(uprof);
 
-	stats_add_result(&t->avg_score, (float)result / 2, 1);
+	*games += k;
+	stats_add_result(&t->avg_score, ssum / k, k);
 	if (t->use_extra_komi) {
-		stats_add_result(&u->dynkomi->score, (float)result / 2, 1);
-		stats_add_result(&u->dynkomi->value, rval, 1);
+		stats_add_result(&u->dynkomi->score, ssum / k, k);
+		stats_add_result(&u->dynkomi->value, rsum / k, k);
 	}
 
-	if (u->local_tree && n->parent && !is_pass(node_coord(n)) && dlen > 0) {
-		/* Get the local sequences and record them in ltree. */
-		/* We will look for sequence starts in our descent
-		 * history, then run record_local_sequence() for each
-		 * found sequence start; record_local_sequence() may
-		 * pick longer sequences from descent history then,
-		 * which is expected as it will create new lnodes. */
-		enum stone seq_color = player_color;
-		/* First move always starts a sequence. */
-		record_local_sequence(u, t, &b2, descent, dlen, 1, seq_color);
-		seq_color = stone_other(seq_color);
-		for (int dseqi = 2; dseqi < dlen; dseqi++, seq_color = stone_other(seq_color)) {
-			if (u->local_tree_allseq) {
-				/* We are configured to record all subsequences. */
-				record_local_sequence(u, t, &b2, descent, dlen, dseqi, seq_color);
-				continue;
-			}
-			if (descent[dseqi].node->d >= u->tenuki_d) {
-				/* Tenuki! Record the fresh sequence. */
-				record_local_sequence(u, t, &b2, descent, dlen, dseqi, seq_color);
-				continue;
-			}
-			if (descent[dseqi].lnode && !descent[dseqi].lnode) {
-				/* Record result for in-descent picked sequence. */
-				record_local_sequence(u, t, &b2, descent, dlen, dseqi, seq_color);
-				continue;
-			}
-		}
-	}
+	if (u->leaf_playouts > 1)
+		board_done_noalloc(&leaf);
 
 end:
 	/* We need to undo the virtual loss we added during descend. */
 	if (u->virtual_loss) {
-		for (; n->parent; n = n->parent) {
-			__sync_fetch_and_sub(&n->descents, u->virtual_loss);
-		}
+		for (int di = 1; di < dlen; di++)
+			__sync_fetch_and_sub(&descent[di].node->descents, u->virtual_loss);
 	}
 
+	uct_profile_leave(prof);
+	return result;
+}
+
+int
+uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t)
+{
+	struct board b2;
+	board_copy(&b2, b);
+	int games = 0;
+	int result = uct_playout_board(u, b, &b2, player_color, t, &games);
 	board_done_noalloc(&b2);
 	return result;
 }
 
 int
-uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti)
+uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, struct board *b2)
 {
-	int i;
-	for (i = 0; !uct_halt; i++)
-		uct_playout(u, b, color, t);
-	return i;
+	/* Rather than copying the board for each simulation, roll
+	 * back a single scratch copy, see board_rollback(). */
+	struct board local;
+	if (b2) {
+		board_rollback(b2, b);
+	} else {
+		b2 = &local;
+		board_copy(b2, b);
+	}
+
+	int games = 0;
+	for (int i = 0; !uct_halt; i++) {
+		uct_playout_board(u, b, b2, color, t, &games);
+		board_rollback(b2, b);
+		if (t->merge_to && !(i % TREE_MERGE_INTERVAL)
+		    && !__sync_lock_test_and_set(&t->merging, 1)) {
+			tree_merge(t->merge_to, t, u->merge_depth, false);
+			__sync_lock_release(&t->merging);
+		}
+		struct tree *mt = t->merge_to ? t->merge_to : t;
+		if (unlikely(node_u(mt->root).playouts >= uct_wake_games))
+			uct_search_wake();
+	}
+	if (b2 == &local)
+		board_done_noalloc(&local);
+	return games;
 }
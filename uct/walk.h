@@ -10,6 +10,10 @@ struct board;
 void uct_progress_status(struct uct *u, struct tree *t, enum stone color, int playouts, coord_t *final);
 
 int uct_playout(struct uct *u, struct board *b, enum stone player_color, struct tree *t);
-int uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti);
+/* Playouts until uct_halt. @b2 is a scratch board of the same size as
+ * @b, copied from it or from another position before (search threads
+ * keep theirs between searches), or NULL to use a fresh copy. Returns
+ * the number of playouts run. */
+int uct_playouts(struct uct *u, struct board *b, enum stone color, struct tree *t, struct time_info *ti, struct board *b2);
 
 #endif